@@ -6,7 +6,8 @@
 #include "common.h"
 #include "posix.h"
 
-void prep(const std::filesystem::path& file_path, uint64_t file_size) {
+void prep(const std::filesystem::path& file_path, uint64_t file_size,
+          uint64_t num_txs) {
   unlink(file_path.c_str());
 
   int fd = open(file_path.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
@@ -16,6 +17,14 @@ void prep(const std::filesystem::path& file_path, uint64_t file_size) {
 
   prefill_file(fd, file_size, 4096);
 
+  // small overwrites that only grow the tx history
+  char buf[8]{};
+  for (uint64_t i = 0; i < num_txs; ++i) {
+    off_t offset = static_cast<off_t>(i * 4096 % file_size);
+    if (pwrite(fd, buf, sizeof(buf), offset) != sizeof(buf))
+      throw std::runtime_error("pwrite failed");
+  }
+
   struct stat st {};
   madfs::posix::fstat(fd, &st);
   printf("file size: %.3f MB\n", st.st_size / 1024. / 1024.);
@@ -33,6 +42,7 @@ struct Args {
   bool prep = false;
   bool open = false;
   uint64_t file_size = 4096;
+  uint64_t num_txs = 0;
   std::filesystem::path file_path = "test.txt";
 
   static Args parse(int argc, char** argv) {
@@ -47,6 +57,8 @@ struct Args {
             {"o,open", "Open the file", cxxopts::value<bool>(args.open)},
             {"s,size", "File size in bytes",
              cxxopts::value<uint64_t>(args.file_size)},
+            {"n,num_txs", "Number of small overwrites after prefilling",
+             cxxopts::value<uint64_t>(args.num_txs)},
             {"help", "Print help"},
         });
 
@@ -61,6 +73,6 @@ struct Args {
 
 int main(int argc, char** argv) {
   const auto args = Args::parse(argc, argv);
-  if (args.prep) prep(args.file_path, args.file_size);
+  if (args.prep) prep(args.file_path, args.file_size, args.num_txs);
   if (args.open) bench_open(args.file_path);
 }
@@ -0,0 +1,82 @@
+/**
+ * This microbenchmark compares the kernels copying into persistent memory (see
+ * pmem::Kernels) for sizes from 64B to 2MB, to calibrate the threshold from
+ * which the non-temporal one is used (MADFS_NT_THRESHOLD). Each copy is
+ * followed by a fence, as a write would.
+ *
+ *  PMEM_PATH=/mnt/pmem0-ext4-dax ./build-release/micro_copy
+ */
+
+#include <benchmark/benchmark.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "posix.h"
+#include "utils/persist.h"
+
+constexpr size_t MAX_SIZE = 2 << 20;
+// copy to different places, so that the caches do not absorb the copies
+constexpr size_t MAP_SIZE = 64 << 20;
+
+const char* filepath = get_filepath();
+
+enum class Kernel {
+  MOVNT,
+  MOV_FLUSH,
+  MOV_NOFLUSH,
+};
+
+template <Kernel kernel>
+void bench(benchmark::State& state) {
+  const auto num_bytes = static_cast<size_t>(state.range(0));
+
+  char* src_buf = new char[MAX_SIZE];
+  std::fill(src_buf, src_buf + MAX_SIZE, 'x');
+
+  // bypass madfs, so that the file is mapped as is
+  madfs::posix::unlink(filepath);
+  int fd = madfs::posix::open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd < 0) state.SkipWithError("open failed");
+  if (madfs::posix::fallocate(fd, 0, 0, MAP_SIZE) < 0)
+    state.SkipWithError("fallocate failed");
+  auto dst = static_cast<char*>(madfs::posix::mmap(
+      nullptr, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  if (dst == MAP_FAILED) state.SkipWithError("mmap failed");
+  memset(dst, 0, MAP_SIZE);
+
+  const madfs::pmem::Kernels& kernels = madfs::pmem::kernels;
+  size_t offset = 0;
+  for (auto _ : state) {
+    if constexpr (kernel == Kernel::MOVNT)
+      kernels.memmove_nt(dst + offset, src_buf, num_bytes);
+    else if constexpr (kernel == Kernel::MOV_FLUSH)
+      kernels.memmove_t(dst + offset, src_buf, num_bytes);
+    else if constexpr (kernel == Kernel::MOV_NOFLUSH)
+      kernels.memmove_large(dst + offset, src_buf, num_bytes);
+    madfs::fence();
+    offset = offset + 2 * num_bytes > MAP_SIZE ? 0 : offset + num_bytes;
+  }
+
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          state.range(0));
+
+  madfs::posix::munmap(dst, MAP_SIZE);
+  madfs::posix::close(fd);
+  madfs::posix::unlink(filepath);
+  delete[] src_buf;
+}
+
+BENCHMARK_TEMPLATE(bench, Kernel::MOVNT)
+    ->Name("movnt")
+    ->RangeMultiplier(2)
+    ->Range(64, MAX_SIZE);
+BENCHMARK_TEMPLATE(bench, Kernel::MOV_FLUSH)
+    ->Name("mov_flush")
+    ->RangeMultiplier(2)
+    ->Range(64, MAX_SIZE);
+BENCHMARK_TEMPLATE(bench, Kernel::MOV_NOFLUSH)
+    ->Name("mov_noflush")
+    ->RangeMultiplier(2)
+    ->Range(64, MAX_SIZE);
+
+BENCHMARK_MAIN();
@@ -26,6 +26,8 @@ enum class Mode {
   UNIF,
   APPEND,
   ZIPF,
+  // thread 0 keeps writing while the others read
+  ONE_WRITER,
 };
 
 template <Mode mode>
@@ -127,6 +129,29 @@ void bench(benchmark::State& state) {
       assert(res == num_bytes);
       fsync(fd);
     }
+  } else if constexpr (mode == Mode::ONE_WRITER) {
+    const int num_blocks = file_size / BLOCK_SIZE;
+
+    int rand_off[num_iter];
+    std::generate(rand_off, rand_off + num_iter, [&]() {
+      return rand() % (file_size / num_bytes) * num_bytes;
+    });
+
+    int i = 0;
+    for (auto _ : state) {
+      if (state.thread_index == 0) {
+        // write the blocks in turn, so every read has new tx entries to apply
+        [[maybe_unused]] ssize_t res =
+            pwrite(fd, src_buf, num_bytes, (i % num_blocks) * BLOCK_SIZE);
+        assert(res == num_bytes);
+        fsync(fd);
+      } else {
+        [[maybe_unused]] ssize_t res =
+            pread(fd, dst_buf, num_bytes, rand_off[i]);
+        assert(res == num_bytes);
+      }
+      i++;
+    }
   }
 
   // tear down
@@ -149,10 +174,17 @@ void bench(benchmark::State& state) {
     double commit_cnt =
         madfs::debug::get_count(madfs::Event::SINGLE_BLOCK_TX_COMMIT) +
         madfs::debug::get_count(madfs::Event::ALIGNED_TX_COMMIT);
+    double abort_cnt = madfs::debug::get_count(madfs::Event::TX_ABORT);
+    double redo_cnt = madfs::debug::get_count(madfs::Event::TX_REDO);
+    double lock_wait_cnt =
+        madfs::debug::get_count(madfs::Event::RANGE_LOCK_WAIT);
 
     if (start_cnt != 0 && commit_cnt != 0) {
       state.counters["tx_copy"] = copy_cnt / start_cnt / state.threads;
       state.counters["tx_commit"] = commit_cnt / start_cnt / state.threads;
+      state.counters["tx_abort"] = abort_cnt / start_cnt / state.threads;
+      state.counters["tx_redo"] = redo_cnt / start_cnt / state.threads;
+      state.counters["lock_wait"] = lock_wait_cnt / start_cnt / state.threads;
     }
   }
 }
@@ -181,6 +213,12 @@ int main(int argc, char** argv) {
         ->UseRealTime();
   }
 
+  benchmark::RegisterBenchmark("1w_4k", bench<Mode::ONE_WRITER>)
+      ->Args({BLOCK_SIZE})
+      ->DenseThreadRange(2, MAX_NUM_THREAD)
+      ->Iterations(num_iter)
+      ->UseRealTime();
+
   //  for (const auto& [name, num_bytes] :
   //       {std::pair{"append_4k", 4096}, std::pair{"append_2k", 2048}}) {
   //    benchmark::RegisterBenchmark(name, bench<Mode::APPEND>)
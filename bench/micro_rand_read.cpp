@@ -0,0 +1,74 @@
+/**
+ * This microbenchmark reads small pieces at random offsets of a large file, so
+ * that almost every read touches a page that is not in the TLB. It measures
+ * the cost of translating a file offset into an address, including the page
+ * walk, which is cheaper if the file is mapped with huge pages.
+ *
+ *  BENCH_FILE_SIZE=4096 LD_PRELOAD=./build-release/libmadfs.so \
+ *    ./build-release/micro_rand_read
+ */
+
+#define _FORTIFY_SOURCE 0
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+
+#include "common.h"
+
+constexpr int MAX_SIZE = 4096;
+// the offsets are drawn up front, so that the generator is not measured
+constexpr size_t NUM_OFFSETS = 1 << 20;
+
+const char* filepath = get_filepath();
+const size_t file_size = static_cast<size_t>(get_file_size());
+
+int fd;
+std::vector<off_t> offsets;
+
+void setup(const benchmark::State&) {
+  unlink(filepath);
+  fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd < 0) throw std::runtime_error("open failed");
+  prefill_file(fd, file_size);
+  close(fd);
+
+  fd = open(filepath, O_RDONLY);
+  if (fd < 0) throw std::runtime_error("open failed");
+
+  std::mt19937_64 rng(42);
+  std::uniform_int_distribution<size_t> dist(0, file_size / MAX_SIZE - 1);
+  offsets.resize(NUM_OFFSETS);
+  for (auto& offset : offsets)
+    offset = static_cast<off_t>(dist(rng) * MAX_SIZE);
+}
+
+void teardown(const benchmark::State&) {
+  close(fd);
+  unlink(filepath);
+}
+
+void bench(benchmark::State& state) {
+  const auto num_bytes = static_cast<size_t>(state.range(0));
+  char dst_buf[MAX_SIZE];
+
+  size_t i = 0;
+  for (auto _ : state) {
+    [[maybe_unused]] ssize_t res = pread(fd, dst_buf, num_bytes, offsets[i]);
+    assert(res == static_cast<ssize_t>(num_bytes));
+    benchmark::DoNotOptimize(dst_buf);
+    i = (i + 1) % NUM_OFFSETS;
+  }
+
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          state.range(0));
+}
+
+BENCHMARK(bench)
+    ->Name("rnd_pread")
+    ->Setup(setup)
+    ->Teardown(teardown)
+    ->RangeMultiplier(4)
+    ->Range(64, MAX_SIZE);
+
+BENCHMARK_MAIN();
@@ -3,7 +3,7 @@ import logging
 
 from bench_utils import drop_cache
 from fs import MADFS
-from plot_open import plot_open
+from plot_open import plot_open, plot_open_history
 from runner import Runner
 from utils import root_dir, get_timestamp
 
@@ -23,6 +23,15 @@ logical_to_virtual_size = {
     1024: 1024 * 1024 * 1024 - 4096 * 514,
 }
 
+# the number of small overwrites appended to the tx history of a 4MB file
+history_lengths = [1_000, 10_000, 100_000, 1_000_000]
+
+# the open time with the block table checkpointed on close, and without
+checkpoint_envs = {
+    "checkpoint": {},
+    "no_checkpoint": {"MADFS_CHECKPOINT_INTERVAL": 0},
+}
+
 
 def main():
     result_dir = root_dir / "results" / "bench_open" / "exp" / get_timestamp()
@@ -44,6 +53,23 @@ def main():
 
     plot_open(result_dir)
 
+    for num_txs in history_lengths:
+        for name, env in checkpoint_envs.items():
+            runner.run(
+                prog_args=["--prepare", "-f", data_path, "-s", 4 * 1024 * 1024,
+                           "-n", num_txs],
+                prog_log_name=f"{num_txs}tx_{name}_prepare.log",
+                env=env,
+            )
+            drop_cache()
+            runner.run(
+                prog_args=["--open", "-f", data_path],
+                prog_log_name=f"{num_txs}tx_{name}.log",
+                env=env,
+            )
+
+    plot_open_history(result_dir)
+
 
 if __name__ == "__main__":
     main()
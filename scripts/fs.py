@@ -97,26 +97,14 @@ class MADFS(Ext4DAX):
 
         return build_path / "libmadfs.so"
 
-    @staticmethod
-    def _make_cmake_args(cc: str) -> str:
-        options = ["OCC", "MUTEX", "SPINLOCK", "RWLOCK"]
-
-        if cc not in options:
-            raise ValueError(f"{cc} is not a valid option")
-
-        result = " ".join(
-            f"-DMADFS_CC_{option}={'ON' if option == cc else 'OFF'}"
-            for option in options
-        )
-
-        return result
-
     def get_env(self, prog, **kwargs):
+        if self.cc not in ["OCC", "MUTEX", "SPINLOCK", "RWLOCK"]:
+            raise ValueError(f"{self.cc} is not a valid option")
+        # the concurrency control is chosen at runtime, so one build serves all
+        env = {"MADFS_CC": self.cc.lower()}
         if is_madfs_linked(prog):
-            return {}
-        cmake_args = MADFS._make_cmake_args(self.cc)
-        madfs_path = MADFS.build(cmake_args=cmake_args, **kwargs)
-        env = {"LD_PRELOAD": madfs_path}
+            return env
+        env["LD_PRELOAD"] = MADFS.build(**kwargs)
         return env
 
 
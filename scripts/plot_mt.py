@@ -57,6 +57,7 @@ def plot_mt(result_dir):
                 "unif_100R": "100% Read",
                 "zipf_4k": r"4 KB Write w/ Zipf",
                 "zipf_2k": r"2 KB Write w/ Zipf",
+                "1w_4k": r"1 Writer + N 4 KB Readers",
             }
 
             ax.set_title(titles.get(name), pad=3, fontsize=11)
@@ -95,6 +95,32 @@ def plot_open(result_dir):
     save_fig(ax.get_figure(), "result", result_dir)
 
 
+def plot_open_history(result_dir):
+    result = []
+    for f in result_dir.iterdir():
+        m = re.fullmatch(r"(?P<num_txs>\d+)tx_(?P<config>(no_)?checkpoint)\.log", f.name)
+        if m is None:
+            continue
+        df = parse_file(f)
+        df["num_txs"] = int(m["num_txs"])
+        df["config"] = m["config"]
+        result.append(df)
+    df = pd.concat(result)
+    export_df(result_dir, df, "history")
+
+    df = df[df["name"] == "OPEN"]
+    df = df.pivot(index="num_txs", columns="config", values="avg").reset_index()
+    df = df.apply(pd.to_numeric)
+    df.sort_values(by="num_txs", inplace=True)
+    export_df(result_dir, df, "history_pivot")
+
+    ax = df.plot(x="num_txs", y=["checkpoint", "no_checkpoint"], marker="o",
+                 logx=True, figsize=(5, 2.5))
+    ax.set_xlabel("Number of Transactions")
+    ax.set_ylabel(r"Open Time ($\mu$s)")
+    save_fig(ax.get_figure(), "history", result_dir)
+
+
 if __name__ == "__main__":
     parser = ArgumentParser()
     parser.add_argument("-r", "--result_dir", help="Directory with results", type=Path,
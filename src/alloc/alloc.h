@@ -14,7 +14,7 @@ class Allocator {
 
   Allocator(MemTable* mem_table, BitmapMgr* bitmap_mgr,
             PerThreadData* per_thread_data)
-      : block(mem_table, bitmap_mgr),
+      : block(mem_table, bitmap_mgr, per_thread_data->get_index()),
         tx_block(&block, mem_table, per_thread_data),
         log_entry(&block, mem_table) {}
 };
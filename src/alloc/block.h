@@ -1,7 +1,9 @@
 #pragma once
 
-#include <array>
 #include <bit>
+#include <map>
+#include <set>
+#include <utility>
 #include <vector>
 
 #include "bitmap.h"
@@ -9,116 +11,116 @@
 #include "mem_table.h"
 
 namespace madfs::dram {
+
+/**
+ * Allocate runs of contiguous blocks for a thread.
+ *
+ * The free blocks taken from the bitmap or freed by the thread are kept as runs
+ * ordered by their first block, so that a freed run is merged with the free
+ * runs next to it, and indexed by their size, so that an allocation takes the
+ * smallest run that fits. A run never crosses a grow unit, since only the
+ * blocks within one are contiguous in memory (see MemTable); thus, a run has at
+ * most MAX_RUN_BLOCKS blocks.
+ */
 class BlockAllocator {
+ public:
+  static constexpr uint32_t MAX_RUN_BLOCKS = 1 << GROW_UNIT_IN_BLOCK_SHIFT;
+  static_assert(MAX_RUN_BLOCKS == BitmapMgr::SHARD_NUM_BLOCKS);
+  // how many shards to try before taking a grow unit at the end of the file
+  static constexpr uint32_t MAX_NUM_SHARD_PROBES = 16;
+
+ private:
   MemTable* mem_table;
   BitmapMgr* bitmap_mgr;
 
-  // free_lists[n-1] means a free list of size n beginning from LogicalBlockIdx
-  std::array<std::vector<LogicalBlockIdx>, BITMAP_ENTRY_BLOCKS_CAPACITY>
-      free_lists{};
+  // the number of blocks of the free runs by their first block
+  std::map<LogicalBlockIdx, uint32_t> runs;
+  // the free runs by their number of blocks and then their first block
+  std::set<std::pair<uint32_t, LogicalBlockIdx>> runs_by_size;
 
-  BitmapIdx recent_bitmap_idx{};
+  // where to search the bitmap from, and the end of the shard it is in
+  BitmapIdx recent_bitmap_idx;
+  BitmapIdx shard_end;
 
  public:
-  BlockAllocator(MemTable* mem_table, BitmapMgr* bitmap_mgr)
-      : mem_table(mem_table), bitmap_mgr(bitmap_mgr) {}
+  /**
+   * @param shard_idx the shard of the bitmap to start from, which is the index
+   * of the per-thread data, so that concurrent threads start apart; it wraps
+   * around the shards that the file spans, so that a small file does not grow
+   * for each thread that writes to it
+   */
+  BlockAllocator(MemTable* mem_table, BitmapMgr* bitmap_mgr, size_t shard_idx)
+      : mem_table(mem_table), bitmap_mgr(bitmap_mgr) {
+    uint32_t num_shards = BitmapMgr::get_num_shards(
+        mem_table->get_meta()->get_num_logical_blocks());
+    recent_bitmap_idx = static_cast<BitmapIdx>(shard_idx % num_shards) *
+                        BitmapMgr::SHARD_NUM_BLOCKS;
+    shard_end = recent_bitmap_idx + BitmapMgr::SHARD_NUM_BLOCKS;
+  }
   ~BlockAllocator() { return_free_list(); }
 
   /**
-   * allocate contiguous blocks (num_blocks must <= 64)
-   * if large number of blocks required, please break it into multiple alloc and
-   * use log entries to chain them together
+   * allocate contiguous blocks (num_blocks must <= MAX_RUN_BLOCKS)
+   * to allocate for a large write, use alloc_chunks instead, which falls back
+   * to shorter runs if there is no long one
    *
    * @param num_blocks number of blocks to allocate
    * @return the logical block id of the first block
    */
   [[nodiscard]] LogicalBlockIdx alloc(uint32_t num_blocks) {
-    assert(num_blocks <= BITMAP_ENTRY_BLOCKS_CAPACITY);
-
-    if (!free_lists[num_blocks - 1].empty()) {
-      LogicalBlockIdx lidx = free_lists[num_blocks - 1].back();
-      free_lists[num_blocks - 1].pop_back();
-      LOG_TRACE(
-          "Allocator::alloc: allocating from free list (fully consumed): "
-          "[n_blk: %d, lidx: %u]",
-          num_blocks, lidx.get());
-      return lidx;
-    }
+    assert(num_blocks > 0 && num_blocks <= MAX_RUN_BLOCKS);
 
-    for (uint32_t n = num_blocks + 1; n <= BITMAP_ENTRY_BLOCKS_CAPACITY; ++n) {
-      if (!free_lists[n - 1].empty()) {
-        LogicalBlockIdx lidx = free_lists[n - 1].back();
-
-        free_lists[n - 1].pop_back();
-        free_lists[n - num_blocks - 1].push_back(lidx + num_blocks);
-        LOG_TRACE(
-            "Allocator::alloc: allocating from free list (partially consumed): "
-            "[n_blk: %d, lidx: %u] -> [n_blk: %d, lidx: %u]",
-            n, lidx.get(), n - num_blocks, lidx.get() + num_blocks);
-        return lidx;
-      }
+    auto it = runs_by_size.lower_bound({num_blocks, 0});
+    while (it == runs_by_size.end()) {
+      refill(num_blocks);
+      it = runs_by_size.lower_bound({num_blocks, 0});
     }
 
-    bool is_found = false;
-
-  retry:
-    // then we have to allocate from global bitmaps
-    // but try_alloc doesn't necessarily return the number of blocks we want
-    auto [allocated_idx, allocated_bits] =
-        bitmap_mgr->try_alloc(recent_bitmap_idx);
-    LOG_TRACE("Allocator::alloc: allocating from bitmap %d: 0x%lx",
-              allocated_idx, allocated_bits);
-
-    // add available bits to the local free list
-    uint32_t num_bits_left = BITMAP_ENTRY_BLOCKS_CAPACITY;
-    LogicalBlockIdx allocated_block_idx;
-    while (num_bits_left > 0) {
-      // first remove all trailing ones
-      auto num_right_ones =
-          static_cast<uint32_t>(std::countr_one(allocated_bits));
-      allocated_bits >>= num_right_ones;
-      num_bits_left -= num_right_ones;
-
-      // allocated_bits should have many trailing zeros
-      uint32_t num_right_zeros =
-          std::min(static_cast<uint32_t>(std::countr_zero(allocated_bits)),
-                   num_bits_left);
-      // if not, it means no bits left
-      if (num_right_zeros == 0) break;
-
-      if (!is_found && num_right_zeros >= num_blocks) {
-        is_found = true;
-        allocated_block_idx =
-            allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY - num_bits_left;
-        LOG_TRACE("Allocator::alloc: allocated blocks: [n_blk: %d, lidx: %u]",
-                  num_right_zeros, allocated_block_idx.get());
-        if (num_right_zeros > num_blocks) {
-          free_lists[num_right_zeros - num_blocks - 1].emplace_back(
-              allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY - num_bits_left +
-              num_blocks);
-          LOG_TRACE(
-              "Allocator::alloc: unused blocks saved: [n_blk: %d, lidx: %u]",
-              num_right_zeros - num_blocks,
-              allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY - num_bits_left +
-                  num_blocks);
-        }
-      } else {
-        free_lists[num_right_zeros - 1].emplace_back(
-            allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY - num_bits_left);
-        LOG_TRACE(
-            "Allocator::alloc: unused blocks saved: [n_blk: %d, lidx: %u]",
-            num_right_zeros,
-            allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY - num_bits_left);
+    auto [run_num_blocks, lidx] = *it;
+    runs_by_size.erase(it);
+    runs.erase(lidx);
+    if (run_num_blocks > num_blocks)
+      insert_run(lidx + num_blocks, run_num_blocks - num_blocks);
+    LOG_TRACE(
+        "Allocator::alloc: allocating from free list: [n_blk: %d, lidx: %u] "
+        "-> [n_blk: %d, lidx: %u]",
+        run_num_blocks, lidx.get(), run_num_blocks - num_blocks,
+        lidx.get() + num_blocks);
+    return lidx;
+  }
+
+  /**
+   * Allocate the blocks of a write as chunks of BITMAP_ENTRY_BLOCKS_CAPACITY
+   * blocks (the last one may be shorter), which are contiguous as far as the
+   * free runs allow
+   *
+   * @param[in] num_blocks number of blocks to allocate
+   * @param[out] lidxs the logical block id of the first block of each chunk is
+   * appended to it
+   */
+  void alloc_chunks(uint32_t num_blocks, std::vector<LogicalBlockIdx>& lidxs) {
+    while (num_blocks > 0) {
+      uint32_t run_num_blocks = std::min(num_blocks, MAX_RUN_BLOCKS);
+      if (run_num_blocks == MAX_RUN_BLOCKS &&
+          runs_by_size.lower_bound({run_num_blocks, 0}) == runs_by_size.end()) {
+        // a whole grow unit is taken from the bitmap at once
+        push_chunks(alloc_grow_unit(), MAX_RUN_BLOCKS, lidxs);
+        num_blocks -= MAX_RUN_BLOCKS;
+        continue;
+      }
+      if (run_num_blocks > BITMAP_ENTRY_BLOCKS_CAPACITY &&
+          runs_by_size.lower_bound({run_num_blocks, 0}) == runs_by_size.end()) {
+        refill(run_num_blocks);
+        // take the whole chunks that the largest run holds instead
+        if (runs_by_size.lower_bound({run_num_blocks, 0}) == runs_by_size.end())
+          run_num_blocks = std::max(
+              ALIGN_DOWN(runs_by_size.rbegin()->first,
+                         BITMAP_ENTRY_BLOCKS_CAPACITY),
+              BITMAP_ENTRY_BLOCKS_CAPACITY);
       }
-      allocated_bits >>= num_right_zeros;
-      num_bits_left -= num_right_zeros;
+      push_chunks(alloc(run_num_blocks), run_num_blocks, lidxs);
+      num_blocks -= run_num_blocks;
     }
-    // this recent is not useful because we have taken all bits; move on
-    recent_bitmap_idx = allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY;
-
-    // don't have the right size, retry
-    if (!is_found) goto retry;
-    return allocated_block_idx;
   }
 
   /**
@@ -126,9 +128,16 @@ class BlockAllocator {
    */
   void free(LogicalBlockIdx block_idx, uint32_t num_blocks = 1) {
     if (block_idx == 0) return;
-    LOG_TRACE("Allocator::alloc: adding to free list: [%u, %u)",
+    LOG_TRACE("Allocator::free: adding to free list: [%u, %u)",
               block_idx.get(), num_blocks + block_idx.get());
-    free_lists[num_blocks - 1].emplace_back(block_idx);
+    // split the range at the grow units, so that no run crosses one
+    while (num_blocks > 0) {
+      uint32_t run_num_blocks = std::min(
+          num_blocks, MAX_RUN_BLOCKS - (block_idx & GROW_UNIT_IN_BLOCK_MASK));
+      merge_run(block_idx, run_num_blocks);
+      block_idx += run_num_blocks;
+      num_blocks -= run_num_blocks;
+    }
   }
 
   /**
@@ -136,9 +145,7 @@ class BlockAllocator {
    * continuous
    */
   void free(const std::vector<LogicalBlockIdx>& recycle_image) {
-    // try to group blocks
-    // we don't try to merge the blocks with existing free list since the
-    // searching is too expensive
+    // try to group blocks, so that the runs are merged once per group
     uint32_t group_begin = 0;
     LogicalBlockIdx group_begin_lidx = 0;
     uint32_t image_size = recycle_image.size();
@@ -153,29 +160,143 @@ class BlockAllocator {
         // continue the group if it matches the expectation
         if (recycle_image[curr] == group_begin_lidx + (curr - group_begin))
           continue;
-        LOG_TRACE("Allocator::free: adding to free list: [%u, %u)",
-                  group_begin_lidx.get(),
-                  curr - group_begin + group_begin_lidx.get());
-        free_lists[curr - group_begin - 1].emplace_back(group_begin_lidx);
+        free(group_begin_lidx, curr - group_begin);
         group_begin_lidx = recycle_image[curr];
         if (group_begin_lidx != 0) group_begin = curr;
       }
     }
-    if (group_begin_lidx != 0) {
-      LOG_TRACE("Allocator::free: adding to free list: [%u, %u)",
-                group_begin_lidx.get(),
-                group_begin_lidx.get() + image_size - group_begin);
-      free_lists[image_size - group_begin - 1].emplace_back(group_begin_lidx);
-    }
+    if (group_begin_lidx != 0)
+      free(group_begin_lidx, image_size - group_begin);
   }
 
   /**
    * Return all the blocks in the free list to the bitmap
    */
   void return_free_list() {
-    for (uint32_t n = 0; n < BITMAP_ENTRY_BLOCKS_CAPACITY; ++n)
-      for (LogicalBlockIdx lidx : free_lists[n])
-        bitmap_mgr->free(static_cast<BitmapIdx>(lidx.get()), n + 1);
+    for (const auto& run : runs) {
+      LogicalBlockIdx lidx = run.first;
+      uint32_t num_blocks = run.second;
+      // a bitmap entry is freed at a time
+      while (num_blocks > 0) {
+        uint32_t len = std::min(
+            num_blocks, BITMAP_ENTRY_BLOCKS_CAPACITY -
+                            (lidx & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1)));
+        bitmap_mgr->free(static_cast<BitmapIdx>(lidx.get()),
+                         static_cast<uint8_t>(len));
+        lidx += len;
+        num_blocks -= len;
+      }
+    }
+    runs.clear();
+    runs_by_size.clear();
+  }
+
+ private:
+  static void push_chunks(LogicalBlockIdx lidx, uint32_t num_blocks,
+                          std::vector<LogicalBlockIdx>& lidxs) {
+    for (uint32_t i = 0; i < num_blocks; i += BITMAP_ENTRY_BLOCKS_CAPACITY)
+      lidxs.push_back(lidx + i);
+  }
+
+  void insert_run(LogicalBlockIdx lidx, uint32_t num_blocks) {
+    runs.emplace(lidx, num_blocks);
+    runs_by_size.emplace(num_blocks, lidx);
+  }
+
+  /**
+   * Add a free run, merging it with the free runs right before and after it
+   * within the same grow unit
+   *
+   * @return the number of blocks of the merged run
+   */
+  uint32_t merge_run(LogicalBlockIdx lidx, uint32_t num_blocks) {
+    auto next = runs.lower_bound(lidx);
+    LogicalBlockIdx end = lidx + num_blocks;
+    if (next != runs.end() && next->first == end &&
+        (end & GROW_UNIT_IN_BLOCK_MASK) != 0) {
+      num_blocks += next->second;
+      runs_by_size.erase({next->second, next->first});
+      next = runs.erase(next);
+    }
+    if (next != runs.begin() && (lidx & GROW_UNIT_IN_BLOCK_MASK) != 0) {
+      auto prev = std::prev(next);
+      if (prev->first + prev->second == lidx) {
+        runs_by_size.erase({prev->second, prev->first});
+        lidx = prev->first;
+        num_blocks += prev->second;
+        runs.erase(prev);
+      }
+    }
+    insert_run(lidx, num_blocks);
+    return num_blocks;
+  }
+
+  /**
+   * Allocate a whole grow unit from the bitmap, which is aligned to it, so that
+   * its blocks are also contiguous in memory
+   *
+   * A few shards from the current one are tried first; if they are in use, it
+   * is taken from the end of the file, which grows the file rather than
+   * searching a fragmented bitmap.
+   */
+  LogicalBlockIdx alloc_grow_unit() {
+    if (auto idx = bitmap_mgr->alloc_shard(recent_bitmap_idx,
+                                           MAX_NUM_SHARD_PROBES)) {
+      LOG_TRACE("Allocator::alloc_grow_unit: allocated near hint: %u", *idx);
+      return *idx;
+    }
+    uint32_t num_blocks_in_file =
+        mem_table->get_meta()->get_num_logical_blocks();
+    auto idx = bitmap_mgr->alloc_shard(num_blocks_in_file, UINT32_MAX);
+    PANIC_IF(!idx, "Failed to allocate a grow unit from bitmap");
+    LOG_TRACE("Allocator::alloc_grow_unit: allocated at the end: %u", *idx);
+    return *idx;
+  }
+
+  /**
+   * Take the free blocks of the bitmap entries from recent_bitmap_idx on, until
+   * a free run of num_blocks blocks forms or the next entry cannot extend one
+   */
+  void refill(uint32_t num_blocks) {
+    for (bool is_first = true;; is_first = false) {
+      if (!bitmap_mgr->may_have_free(recent_bitmap_idx, shard_end)) {
+        uint32_t num_blocks_in_file =
+            mem_table->get_meta()->get_num_logical_blocks();
+        recent_bitmap_idx = bitmap_mgr->next_shard(num_blocks_in_file);
+        shard_end = ALIGN_DOWN(recent_bitmap_idx, BitmapMgr::SHARD_NUM_BLOCKS) +
+                    BitmapMgr::SHARD_NUM_BLOCKS;
+      }
+      // try_alloc doesn't necessarily return the number of blocks we want
+      auto [allocated_idx, allocated_bits] =
+          bitmap_mgr->try_alloc(recent_bitmap_idx);
+      LOG_TRACE("Allocator::alloc: allocating from bitmap %d: 0x%lx",
+                allocated_idx, allocated_bits);
+      bool is_next = allocated_idx == recent_bitmap_idx;
+      // this recent is not useful because we have taken all bits; move on
+      recent_bitmap_idx = allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY;
+
+      // add each run of zero bits to the free runs
+      uint32_t max_num_blocks = 0;
+      uint32_t offset = 0;
+      while (offset < BITMAP_ENTRY_BLOCKS_CAPACITY) {
+        uint64_t bits = allocated_bits >> offset;
+        auto num_ones = static_cast<uint32_t>(std::countr_one(bits));
+        offset += num_ones;
+        if (offset >= BITMAP_ENTRY_BLOCKS_CAPACITY) break;
+        uint32_t num_zeros =
+            std::min(static_cast<uint32_t>(std::countr_zero(bits >> num_ones)),
+                     BITMAP_ENTRY_BLOCKS_CAPACITY - offset);
+        max_num_blocks = std::max(
+            max_num_blocks, merge_run(allocated_idx + offset, num_zeros));
+        offset += num_zeros;
+      }
+
+      if (max_num_blocks >= num_blocks) return;
+      // only the next entry can extend the run at the end of this one
+      if (!is_first && !is_next) return;
+      if (allocated_bits >> (BITMAP_ENTRY_BLOCKS_CAPACITY - 1) != 0) return;
+      if ((recent_bitmap_idx & GROW_UNIT_IN_BLOCK_MASK) == 0) return;
+    }
   }
 };
 }  // namespace madfs::dram
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "alloc/alloc.h"
+#include "shm.h"
+#include "utils/utils.h"
+
+namespace madfs::dram {
+
+/**
+ * The per-thread allocators of a file.
+ *
+ * A thread finds its allocator through a small thread-local cache keyed by the
+ * file, so a lookup in the steady state is a pointer compare. Since a file
+ * opened later may reuse the address of a closed one, each instance also has a
+ * unique generation that must match.
+ *
+ * An allocator is released, i.e., its free blocks and its per-thread data are
+ * handed back to the file, when its thread exits or when the file is closed,
+ * whichever comes first.
+ */
+class LocalAllocators : noncopyable {
+  /**
+   * The allocator of one thread for one file; shared by the file and the
+   * thread, so that either side can release it
+   */
+  struct Slot {
+    const LocalAllocators* const owner;
+    const uint64_t generation;
+    std::mutex mutex;
+    std::unique_ptr<Allocator> allocator;  // guarded by mutex
+    std::atomic_bool released{false};
+
+    Slot(const LocalAllocators* owner, uint64_t generation,
+         std::unique_ptr<Allocator> allocator)
+        : owner(owner),
+          generation(generation),
+          allocator(std::move(allocator)) {}
+
+    void release() {
+      std::lock_guard<std::mutex> guard(mutex);
+      allocator.reset();
+      released.store(true, std::memory_order_release);
+    }
+  };
+
+  struct CacheEntry {
+    const LocalAllocators* owner;
+    uint64_t generation;
+    Allocator* allocator;
+  };
+
+  static constexpr uint32_t CACHE_SIZE = 4;
+
+  // the slots of the current thread, released when the thread exits
+  struct ThreadSlots {
+    std::vector<std::shared_ptr<Slot>> slots;
+    ~ThreadSlots();
+  };
+
+  // trivially destructible, so that a lookup needs no thread-local init guard
+  static inline thread_local CacheEntry cache[CACHE_SIZE];
+  static inline thread_local uint32_t cache_victim;
+  static inline thread_local ThreadSlots thread_slots;
+
+  static inline std::atomic<uint64_t> next_generation{1};
+
+  MemTable* const mem_table;
+  BitmapMgr* const bitmap_mgr;
+  const ShmMgr* const shm_mgr;
+  const uint64_t generation;
+
+  std::mutex mutex;
+  std::vector<std::shared_ptr<Slot>> slots;  // guarded by mutex
+
+ public:
+  LocalAllocators(MemTable* mem_table, BitmapMgr* bitmap_mgr,
+                  const ShmMgr* shm_mgr)
+      : mem_table(mem_table),
+        bitmap_mgr(bitmap_mgr),
+        shm_mgr(shm_mgr),
+        generation(next_generation.fetch_add(1, std::memory_order_relaxed)) {}
+
+  ~LocalAllocators() { clear(); }
+
+  /**
+   * @return the allocator of the current thread; created on first use
+   */
+  [[nodiscard]] Allocator* get() {
+    for (const auto& entry : cache)
+      if (entry.owner == this && entry.generation == generation)
+        return entry.allocator;
+    return get_slow();
+  }
+
+  /**
+   * Release the allocators of all threads; they must no longer be in use
+   */
+  void clear() {
+    std::lock_guard<std::mutex> guard(mutex);
+    for (const auto& slot : slots) slot->release();
+    slots.clear();
+  }
+
+ private:
+  Allocator* get_slow() {
+    auto& local_slots = thread_slots.slots;
+    std::erase_if(local_slots, [](const auto& slot) {
+      return slot->released.load(std::memory_order_acquire);
+    });
+
+    Allocator* allocator = nullptr;
+    for (const auto& slot : local_slots) {
+      if (slot->owner == this && slot->generation == generation) {
+        allocator = slot->allocator.get();
+        break;
+      }
+    }
+
+    if (!allocator) {
+      auto slot = std::make_shared<Slot>(
+          this, generation,
+          std::make_unique<Allocator>(mem_table, bitmap_mgr,
+                                      shm_mgr->alloc_per_thread_data()));
+      allocator = slot->allocator.get();
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        // drop the slots released by the threads that have exited
+        std::erase_if(slots, [](const auto& s) {
+          return s->released.load(std::memory_order_acquire);
+        });
+        slots.push_back(slot);
+      }
+      local_slots.push_back(std::move(slot));
+    }
+
+    cache[cache_victim++ % CACHE_SIZE] = {this, generation, allocator};
+    return allocator;
+  }
+};
+
+inline LocalAllocators::ThreadSlots::~ThreadSlots() {
+  for (auto& entry : cache) entry = {};
+  // the file releases the slot under the same lock before it goes away, so a
+  // slot that is not yet released still has its file alive
+  for (const auto& slot : slots) slot->release();
+}
+
+}  // namespace madfs::dram
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstring>
+
 #include "alloc/block.h"
 #include "cursor/log.h"
 #include "idx.h"
@@ -61,6 +63,48 @@ class LogEntryAllocator {
     return head;
   }
 
+  /**
+   * populate a single LOG_DELTA log entry carrying the bytes written to a
+   * block; do persist but not fenced
+   *
+   * @param vidx the virtual block to write
+   * @param lidx the logical block currently mapped to vidx
+   * @param local_offset the starting offset within the block
+   * @param data the bytes to write
+   * @param size the number of bytes; at most MAX_DELTA_SIZE
+   * @return a cursor pointing to the log entry
+   */
+  LogCursor append_delta(VirtualBlockIdx vidx, LogicalBlockIdx lidx,
+                         uint16_t local_offset, const char* data,
+                         uint16_t size) {
+    assert(size <= MAX_DELTA_SIZE);
+    // keep the next log entry 4-byte aligned
+    uint32_t entry_size =
+        ALIGN_UP(pmem::LogEntry::get_delta_entry_size(size), 4);
+    if (curr_log_block_idx == 0 || BLOCK_SIZE - curr_log_offset < entry_size) {
+      curr_log_block_idx = block_allocator->alloc(1);
+      curr_log_block =
+          &mem_table->lidx_to_addr_rw(curr_log_block_idx)->log_entry_block;
+      curr_log_offset = 0;
+    }
+
+    LogCursor log_cursor{{curr_log_block_idx, curr_log_offset}, curr_log_block};
+    curr_log_offset += entry_size;
+
+    log_cursor->op = pmem::LogEntry::Op::LOG_DELTA;
+    log_cursor->has_next = false;
+    log_cursor->leftover_bytes = 0;
+    log_cursor->num_blocks = 1;
+    log_cursor->begin_vidx = vidx;
+    log_cursor->begin_lidxs[0] = lidx;
+    pmem::LogDelta* delta = log_cursor->get_delta();
+    delta->local_offset = local_offset;
+    delta->size = size;
+    std::memcpy(delta->data, data, size);
+    log_cursor->persist();
+    return log_cursor;
+  }
+
  private:
   /**
    * Allocate a linked list of log entry that could fit a mapping of the given
@@ -63,18 +63,22 @@ class BitmapEntry : noncopyable {
 
   // free blocks in [begin_idx, begin_idx + len)
   void free(BitmapIdx begin_idx, uint32_t len) {
+    // shifting by 64 is undefined, so the whole entry is masked separately
+    uint64_t mask = len == BITMAP_ENTRY_BLOCKS_CAPACITY
+                        ? BITMAP_ALL_USED
+                        : (((uint64_t)1 << len) - 1) << begin_idx;
   retry:
     uint64_t b = entry.load(std::memory_order_acquire);
-    uint64_t freed = b & ~((((uint64_t)1 << len) - 1) << begin_idx);
+    uint64_t freed = b & ~mask;
     if (!entry.compare_exchange_strong(b, freed, std::memory_order_acq_rel,
                                        std::memory_order_acquire))
       goto retry;
   }
 
   // WARN: not thread-safe
+  // may be called concurrently, e.g., by the parallel replay on open
   void set_allocated(uint32_t idx) {
-    entry.store(entry.load(std::memory_order_relaxed) | (1UL << idx),
-                std::memory_order_relaxed);
+    entry.fetch_or(1UL << idx, std::memory_order_relaxed);
   }
 
   // WARN: not thread-safe
@@ -95,6 +99,10 @@ class BitmapEntry : noncopyable {
     return entry.load(std::memory_order_relaxed) & (1UL << idx);
   }
 
+  [[nodiscard]] bool is_full() const {
+    return entry.load(std::memory_order_seq_cst) == BITMAP_ALL_USED;
+  }
+
   [[nodiscard]] uint64_t is_empty() const {
     return entry.load(std::memory_order_relaxed) == 0;
   }
@@ -110,19 +118,170 @@ class BitmapEntry : noncopyable {
 static_assert(sizeof(BitmapEntry) == BITMAP_ENTRY_SIZE,
               "BitmapEntry must of 64 bits");
 
+/**
+ * A summary of which bitmap entries are fully used, so that a search for free
+ * blocks skips them without touching their cache lines.
+ *
+ * The first level has one bit per bitmap entry, and each level above has one
+ * bit per word of the level below, which is set if all the bits of the word
+ * are. Finding the next entry not fully used thus takes a few countr_zero.
+ *
+ * The summary is only a hint and is updated lazily: an entry is marked when a
+ * search takes all its free blocks, and unmarked when blocks of it are freed.
+ * A bit is set before the word below is checked again and cleared after the
+ * word below is changed, so that a bit is never left set for a word that is not
+ * full; it may be left clear for a full one, which costs a visit.
+ */
+class BitmapSummary {
+  static constexpr uint32_t NUM_LEVELS = 3;
+  static constexpr uint32_t NUM_WORDS[NUM_LEVELS] = {
+      (NUM_BITMAP_ENTRIES + 63) / 64,
+      (NUM_BITMAP_ENTRIES + 64 * 64 - 1) / (64 * 64),
+      (NUM_BITMAP_ENTRIES + 64 * 64 * 64 - 1) / (64 * 64 * 64),
+  };
+  static_assert(NUM_WORDS[NUM_LEVELS - 1] == 1);
+  static constexpr uint64_t ALL_SET = std::numeric_limits<uint64_t>::max();
+
+  std::atomic<uint64_t>* levels[NUM_LEVELS]{};
+
+ public:
+  static constexpr size_t SIZE =
+      (NUM_WORDS[0] + NUM_WORDS[1] + NUM_WORDS[2]) * sizeof(uint64_t);
+
+  /**
+   * Use the summary at addr, which is zero-filled along with the bitmap
+   */
+  void attach(void* addr) {
+    auto words = static_cast<std::atomic<uint64_t>*>(addr);
+    for (uint32_t level = 0; level < NUM_LEVELS; ++level) {
+      levels[level] = words;
+      words += NUM_WORDS[level];
+    }
+  }
+
+  /**
+   * @return the first entry from idx on that may not be fully used, or
+   * NUM_BITMAP_ENTRIES if none
+   */
+  [[nodiscard]] uint32_t find_free(uint32_t idx) const {
+    return std::min(find_clear(0, idx), NUM_BITMAP_ENTRIES);
+  }
+
+  /**
+   * Mark the entry as fully used, which the caller must check again afterwards
+   * and call mark_free if it is not
+   */
+  void mark_full(uint32_t idx) { set(0, idx); }
+
+  /**
+   * Mark the entry as not fully used, after some of its blocks are freed
+   */
+  void mark_free(uint32_t idx) {
+    // the free of the entry must be visible before the bit is read, or the
+    // search marking the entry may miss it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!(levels[0][idx / 64].load(std::memory_order_relaxed) &
+          (1UL << (idx % 64))))
+      return;
+    clear(0, idx);
+  }
+
+ private:
+  /**
+   * @return the first bit from idx on that is clear at the level, or a bit
+   * beyond the level if none
+   */
+  [[nodiscard]] uint32_t find_clear(uint32_t level, uint32_t idx) const {
+    const uint32_t end = NUM_WORDS[level] * 64;
+    while (idx < end) {
+      uint32_t word_idx = idx / 64;
+      uint64_t clear_bits =
+          ~levels[level][word_idx].load(std::memory_order_relaxed) &
+          (ALL_SET << (idx % 64));
+      if (clear_bits)
+        return word_idx * 64 +
+               static_cast<uint32_t>(std::countr_zero(clear_bits));
+      // the level above tells which of the following words are all set
+      idx = level + 1 < NUM_LEVELS ? find_clear(level + 1, word_idx + 1) * 64
+                                   : (word_idx + 1) * 64;
+    }
+    return end;
+  }
+
+  void set(uint32_t level, uint32_t idx) {
+    std::atomic<uint64_t>& word = levels[level][idx / 64];
+    uint64_t bit = 1UL << (idx % 64);
+    uint64_t old_word = word.fetch_or(bit, std::memory_order_seq_cst);
+    if (old_word == ALL_SET || (old_word | bit) != ALL_SET) return;
+    if (level + 1 == NUM_LEVELS) return;
+    // the word just became all set; a bit of it may be cleared meanwhile
+    set(level + 1, idx / 64);
+    if (word.load(std::memory_order_seq_cst) != ALL_SET)
+      clear(level + 1, idx / 64);
+  }
+
+  void clear(uint32_t level, uint32_t idx) {
+    std::atomic<uint64_t>& word = levels[level][idx / 64];
+    uint64_t old_word =
+        word.fetch_and(~(1UL << (idx % 64)), std::memory_order_seq_cst);
+    if (old_word == ALL_SET && level + 1 < NUM_LEVELS)
+      clear(level + 1, idx / 64);
+  }
+};
+
+/**
+ * The bitmap of a file, which is shared by all processes writing to it.
+ *
+ * To keep threads allocating at the same time from touching the same entries,
+ * the bitmap is split into shards of one grow unit each, whose entries share a
+ * cache line. A thread starts from the shard of its per-thread data (see
+ * BlockAllocator), and once the shard is full, moves to the shard that the
+ * shared cursor points to; the cursor goes round the shards of the file, so
+ * that the threads spread over them and use the blocks freed in any, and only
+ * leaves the file once all of its shards are full.
+ */
 class BitmapMgr : noncopyable {
+ public:
+  static constexpr uint32_t SHARD_NUM_ENTRIES =
+      GROW_UNIT_SIZE / BITMAP_ENTRY_BYTES_CAPACITY;
+  static constexpr uint32_t SHARD_NUM_BLOCKS =
+      SHARD_NUM_ENTRIES * BITMAP_ENTRY_BLOCKS_CAPACITY;
+  static_assert(SHARD_NUM_ENTRIES * BITMAP_ENTRY_SIZE == CACHELINE_SIZE);
+  static_assert(BitmapSummary::SIZE + sizeof(std::atomic<uint32_t>) <=
+                SHM_BITMAP_SUMMARY_SIZE);
+
+ private:
   BitmapEntry* entries{nullptr};
+  BitmapSummary summary;
+  // the next shard to move to, which follows the summary
+  std::atomic<uint32_t>* shard_cursor{nullptr};
 
   friend ::madfs::dram::File;
   friend ::madfs::utility::Converter;
 
  public:
   BitmapMgr() = default;
+
+  /**
+   * Use the bitmap and its summary in the shared memory
+   */
+  void attach(void* bitmap_addr, void* summary_addr) {
+    entries = static_cast<BitmapEntry*>(bitmap_addr);
+    summary.attach(summary_addr);
+    shard_cursor = reinterpret_cast<std::atomic<uint32_t>*>(
+        static_cast<char*>(summary_addr) + BitmapSummary::SIZE);
+  }
+
   void set_allocated(LogicalBlockIdx block_idx) const {
     entries[block_idx >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT].set_allocated(
         block_idx & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1));
   }
 
+  [[nodiscard]] bool is_allocated(LogicalBlockIdx block_idx) const {
+    return entries[block_idx >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT]
+        .is_allocated(block_idx & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1));
+  }
+
   /**
    * allocate a single block in the bitmap
    * used for managing MetaBlock::inline_bitmap
@@ -157,6 +316,80 @@ class BitmapMgr : noncopyable {
     return {};
   }
 
+  /**
+   * @return whether an entry in [begin, end) may have free blocks
+   */
+  [[nodiscard]] bool may_have_free(BitmapIdx begin, BitmapIdx end) const {
+    return summary.find_free(begin >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT) <
+           (end >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT);
+  }
+
+  /**
+   * @return the number of shards that a file of num_blocks blocks spans; at
+   * least one
+   */
+  [[nodiscard]] static uint32_t get_num_shards(uint32_t num_blocks) {
+    return std::max(ALIGN_UP(num_blocks, SHARD_NUM_BLOCKS) / SHARD_NUM_BLOCKS,
+                    1u);
+  }
+
+  /**
+   * Pick the shard to move to once the shard of a thread is full
+   *
+   * @param num_blocks the number of blocks of the file
+   * @return where to search from: the first entry that may have free blocks in
+   * or after the shard at the cursor, or in the file if none
+   */
+  [[nodiscard]] BitmapIdx next_shard(uint32_t num_blocks) const {
+    uint32_t num_shards = get_num_shards(num_blocks);
+    uint32_t shard =
+        shard_cursor->fetch_add(1, std::memory_order_relaxed) % num_shards;
+    uint32_t idx = summary.find_free(shard * SHARD_NUM_ENTRIES);
+    // the file grows if all its shards are full
+    if (idx >= num_shards * SHARD_NUM_ENTRIES) idx = summary.find_free(0);
+    LOG_DEBUG("move to shard %u: entry %u", shard, idx);
+    return idx << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+  }
+
+  /**
+   * Allocate a whole shard, i.e., a grow unit of contiguous blocks aligned to
+   * it, by taking its entries one after another with alloc_all
+   *
+   * @param hint where to search from
+   * @param max_num_shards how many shards to try at most
+   * @return the first block of the shard, or nothing if none is free
+   */
+  [[nodiscard]] std::optional<BitmapIdx> alloc_shard(BitmapIdx hint,
+                                                     uint32_t max_num_shards) {
+    uint32_t idx = ALIGN_UP(hint >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT,
+                            SHARD_NUM_ENTRIES);
+    for (uint32_t n = 0; n < max_num_shards && idx < NUM_BITMAP_ENTRIES; ++n) {
+      // the shards with a full entry are skipped without touching them
+      if (uint32_t free_idx = summary.find_free(idx); free_idx != idx) {
+        idx = ALIGN_UP(free_idx, SHARD_NUM_ENTRIES);
+        continue;
+      }
+      uint32_t num_entries = 0;
+      while (num_entries < SHARD_NUM_ENTRIES &&
+             entries[idx + num_entries].alloc_all())
+        ++num_entries;
+      if (num_entries == SHARD_NUM_ENTRIES) {
+        for (uint32_t i = idx; i < idx + SHARD_NUM_ENTRIES; ++i) {
+          summary.mark_full(i);
+          if (!entries[i].is_full()) summary.mark_free(i);
+        }
+        return idx << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+      }
+      // some blocks of the shard are in use; give back what was taken, which
+      // a concurrent search may have marked as full in the summary meanwhile
+      for (uint32_t i = idx; i < idx + num_entries; ++i)
+        free(i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT,
+             BITMAP_ENTRY_BLOCKS_CAPACITY);
+      idx += SHARD_NUM_ENTRIES;
+    }
+    return {};
+  }
+
   /**
    * try to allocate from hint until one bitmap contains at least one available
    * block
@@ -164,14 +397,20 @@ class BitmapMgr : noncopyable {
    * @param hint hint to search
    * @return the index of current bitmap entry and the entry itself
    */
-  [[nodiscard]] std::tuple<BitmapIdx, uint64_t> try_alloc(
-      BitmapIdx hint) const {
+  [[nodiscard]] std::tuple<BitmapIdx, uint64_t> try_alloc(BitmapIdx hint) {
     uint32_t idx =
         static_cast<uint32_t>(hint) >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
-    for (; idx < NUM_BITMAP_ENTRIES; ++idx) {
-      uint64_t allocated_bits = entries[idx].alloc_rest();
-      if (allocated_bits != BitmapEntry::BITMAP_ALL_USED)
-        return {idx << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT, allocated_bits};
+    // the blocks before the hint may have been freed since; retry from there
+    for (uint32_t round = 0; round < 2; ++round, idx = 0) {
+      for (idx = summary.find_free(idx); idx < NUM_BITMAP_ENTRIES;
+           idx = summary.find_free(idx + 1)) {
+        // either way, the entry is fully used now
+        uint64_t allocated_bits = entries[idx].alloc_rest();
+        summary.mark_full(idx);
+        if (!entries[idx].is_full()) summary.mark_free(idx);
+        if (allocated_bits != BitmapEntry::BITMAP_ALL_USED)
+          return {idx << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT, allocated_bits};
+      }
     }
     PANIC("Failed to allocate from bitmap");
   }
@@ -183,12 +422,14 @@ class BitmapMgr : noncopyable {
    * @param begin the BitmapLocalIndex starting from which it will be freed
    * @param len the number of bits to be freed
    */
-  void free(BitmapIdx begin, uint8_t len) const {
+  void free(BitmapIdx begin, uint8_t len) {
     LOG_TRACE("Freeing [%d, %d)", begin, begin + len);
 
-    entries[static_cast<uint32_t>(begin) >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT]
-        .free(static_cast<uint32_t>(begin) & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1),
-              len);
+    uint32_t idx =
+        static_cast<uint32_t>(begin) >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+    entries[idx].free(
+        static_cast<uint32_t>(begin) & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1), len);
+    summary.mark_free(idx);
   }
 
   friend std::ostream& operator<<(std::ostream& out, const BitmapMgr& b) {
@@ -1,21 +1,30 @@
 #pragma once
 
-#include <tbb/concurrent_vector.h>
+#include <immintrin.h>
+#include <pthread.h>
 
 #include <atomic>
 #include <cstdint>
 #include <cstring>
+#include <memory>
 #include <ostream>
+#include <thread>
 #include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #include "bitmap.h"
 #include "block/block.h"
+#include "checkpoint.h"
+#include "config.h"
+#include "conflict_index.h"
 #include "const.h"
 #include "cursor/log.h"
 #include "cursor/tx_entry.h"
+#include "delta_table.h"
 #include "entry.h"
+#include "extent_table.h"
 #include "idx.h"
-#include "utils/tbb.h"
 #include "utils/utils.h"
 
 namespace madfs::dram {
@@ -31,26 +40,152 @@ struct FileState {
 };
 static_assert(sizeof(FileState) == 24);
 
+/**
+ * A block table shared by the processes that open a file with
+ * runtime_options.shared_blk_table, placed in the shared memory of the file
+ * (see ShmMgr::start_attach_blk_table). It is built by the first process to
+ * open the file; after that, whichever process holds the mutex applies the new
+ * tx entries for all of them, so the others neither replay the tx history nor
+ * keep a copy of the table.
+ */
+struct SharedBlkTable {
+  // up to 1 TB (MAX_LEAVES * ExtentTable::LEAF_BLOCKS blocks) per file, of
+  // which up to 64 GB are in fragmented (i.e., flat) leaves
+  static constexpr uint32_t MAX_LEAVES = 1 << 19;
+  static constexpr uint32_t MAX_FLATS = 1 << 15;
+  // up to 64 MB of deltas, in up to 64 GB of the file
+  static constexpr uint32_t MAX_DELTA_LEAVES = 1 << 15;
+  static constexpr uint32_t MAX_DELTA_CHUNKS = 1024;
+
+  // the lock of BlkTable across processes
+  pthread_mutex_t mutex;
+  std::atomic<bool> is_ready;
+  // set once a process finds no room left in it (see BlkTable::detach_unsafe);
+  // no process attaches to it afterwards, until it is reset
+  std::atomic<bool> is_full;
+  // see BlkTable::published and BlkTable::version
+  std::atomic<uint64_t> version;
+  std::atomic<TxEntryIdx> cursor;
+  std::atomic<uint64_t> file_size;
+
+  alignas(BLOCK_SIZE) ExtentTable::Shared<MAX_LEAVES, MAX_FLATS> extents;
+  alignas(BLOCK_SIZE)
+      DeltaTable::Shared<MAX_LEAVES, MAX_DELTA_LEAVES, MAX_DELTA_CHUNKS> deltas;
+};
+
 // read logs and update mapping from virtual blocks to logical blocks
 class BlkTable {
+  /**
+   * The changes made by a contiguous range of the tx history, replayed without
+   * the rest of it (see replay_unsafe)
+   */
+  struct ReplayPartial {
+    // the last mapping of each virtual block and its position in the range
+    std::unordered_map<uint32_t, std::pair<LogicalBlockIdx, uint32_t>> mappings;
+    // the deltas in tx order, each with its position in the range
+    std::vector<std::pair<uint32_t, const pmem::LogEntry*>> deltas;
+    uint32_t num_changes{0};
+    uint64_t file_size{0};
+    // where the replay of the range stopped
+    TxCursor cursor;
+    // whether the range ends at the tail of the tx history
+    bool reached_tail{false};
+
+    void map_blocks(VirtualBlockIdx vidx, LogicalBlockIdx lidx,
+                    uint32_t num_blocks) {
+      for (uint32_t i = 0; i < num_blocks; ++i)
+        mappings[vidx.get() + i] = {lidx + i, num_changes};
+      num_changes++;
+    }
+    void add_delta(const pmem::LogEntry& entry) {
+      deltas.emplace_back(num_changes++, &entry);
+    }
+    void extend_file_size(uint64_t size) {
+      file_size = std::max(file_size, size);
+    }
+  };
+
+  /**
+   * A sink that applies the changes to the block table and summarizes them for
+   * the conflict index
+   */
+  struct SummarySink {
+    BlkTable& blk_table;
+    // whether the bytes a growth of the file size covers are written in place
+    // (i.e., by a size tx), so that they count as changed
+    bool is_in_place_growth;
+    ConflictIndex::Summary summary{};
+
+    void map_blocks(VirtualBlockIdx vidx, LogicalBlockIdx lidx,
+                    uint32_t num_blocks) {
+      blk_table.map_blocks(vidx, lidx, num_blocks);
+      summary.add_range(vidx, vidx + num_blocks - 1);
+    }
+    void add_delta(const pmem::LogEntry& entry) {
+      blk_table.add_delta(entry);
+      summary.add_range(entry.begin_vidx, entry.begin_vidx);
+    }
+    void extend_file_size(uint64_t size) {
+      uint64_t old_size = blk_table.state.file_size;
+      if (is_in_place_growth && size > old_size)
+        summary.add_range(BLOCK_SIZE_TO_IDX(old_size),
+                          BLOCK_SIZE_TO_IDX(size - 1));
+      blk_table.extend_file_size(size);
+      summary.file_size = std::max(summary.file_size, size);
+    }
+  };
+
+  // the parallel replay is only worth it with this many tx blocks per thread
+  static constexpr size_t REPLAY_MIN_BLOCKS_PER_THREAD = 16;
+
+  /**
+   * The mapping of the virtual blocks. The lock holder changes own_tables, and
+   * the readers load them from tables instead, since they are replaced by
+   * private ones if this process detaches from the shared ones (see
+   * detach_unsafe).
+   */
+  struct Tables {
+    ExtentTable extents;
+    DeltaTable deltas;
+  };
+
   MemTable* mem_table;
 
-  tbb::concurrent_vector<std::atomic<LogicalBlockIdx>,
-                         zero_allocator<std::atomic<LogicalBlockIdx>>>
-      table;
-  static_assert(std::atomic<LogicalBlockIdx>::is_always_lock_free);
+  std::unique_ptr<Tables> own_tables{std::make_unique<Tables>()};
+  std::atomic<Tables*> tables{own_tables.get()};
+  // the tables replaced, which the readers may still be using
+  std::unique_ptr<Tables> old_tables;
+  // the tx entries recently applied by update_unsafe
+  ConflictIndex conflict_index;
 
+  // the state of the tables above; only accessed with the lock held
   FileState state;
+
   /**
-   * Version of the file state above.
-   * It can only be updated with file->spinlock held. Before a writer (of
-   * BlkTable) tries to update the three fields above, it must increment the
-   * version; after it's done, it must increment it again.
-   * Thus, when this version is odd, it means someone is updating three fields
-   * above and they are in a temporary inconsistent state.
+   * The state last published for the threads not holding the lock, as a
+   * seqlock: the lock holder makes the version odd, copies the state, and then
+   * makes it even again; a reader retries if the version is odd or changes.
+   *
+   * The tables are not covered by the version: their readers only check the
+   * version of the leaf they read (see ExtentTable), so the lock holder can
+   * apply a long run of tx entries without blocking anyone, and the version
+   * only changes once it is done. The tables may thus be ahead of the
+   * published state, which is fine for a tx that validates against the tx
+   * entries after its cursor anyway.
    */
+  FileState published;
   std::atomic<uint64_t> version;
 
+  // if set, the tables above live in shared memory, and the state and the
+  // version are published there instead; reset if this process detaches
+  std::atomic<SharedBlkTable*> shared{nullptr};
+  // the shared table whose mutex this process holds; only accessed by the lock
+  // holder
+  SharedBlkTable* locked_shared{nullptr};
+  // set if the shared tables have no room left for a change being applied, in
+  // which case the lock holder detaches from them; only accessed by it
+  bool is_full{false};
+
   // move spinlock into a separated cacheline
   union {
     pthread_spinlock_t spinlock;
@@ -61,37 +196,206 @@ class BlkTable {
   explicit BlkTable(MemTable* mem_table)
       : mem_table(mem_table),
         state{TxCursor::from_meta(mem_table->get_meta()), 0},
+        published(state),
         version(0) {
-    table.grow_to_at_least(NUM_BLOCKS_PER_GROW);
     pthread_spin_init(&spinlock, PTHREAD_PROCESS_PRIVATE);
   }
 
   ~BlkTable() { pthread_spin_destroy(&spinlock); }
 
+  /**
+   * Use the table in shared memory instead of a private one; must be called
+   * right after construction, while no other process may attach to it (see
+   * ShmMgr::start_attach_blk_table)
+   *
+   * @param shared_table the table in shared memory
+   * @param is_reset whether the table is reset, in which case build is called
+   * to build it as if it were a private one
+   * @return whether it is attached or built; false if the table was never
+   * built (e.g., its builder died) or is full, in which case this block table
+   * stays private and is not built yet. If the table is reset but does not fit
+   * while being built, this block table is built as a private one instead (see
+   * is_shared).
+   */
+  template <typename Fn>
+  bool attach(SharedBlkTable* shared_table, bool is_reset, Fn&& build) {
+    if (!is_reset &&
+        (!shared_table->is_ready.load(std::memory_order_acquire) ||
+         shared_table->is_full.load(std::memory_order_relaxed)))
+      return false;
+    if (is_reset) init_robust_mutex(&shared_table->mutex);
+    shared.store(shared_table, std::memory_order_relaxed);
+    own_tables->extents.attach(&shared_table->extents);
+    own_tables->deltas.attach(&shared_table->deltas);
+    if (is_reset) {
+      build();
+      if (is_shared())
+        shared_table->is_ready.store(true, std::memory_order_release);
+    } else {
+      load_shared_state();
+    }
+    return true;
+  }
+
+  [[nodiscard]] bool is_shared() const {
+    return shared.load(std::memory_order_relaxed) != nullptr;
+  }
+
   /**
    * @return the logical block index corresponding the the virtual block index
    *  0 is returned if the virtual block index is not allocated yet
    */
   [[nodiscard]] LogicalBlockIdx vidx_to_lidx(
       VirtualBlockIdx virtual_block_idx) const {
-    if (virtual_block_idx >= table.size()) return 0;
-    return table[virtual_block_idx.get()];
+    return get_tables().extents.get(virtual_block_idx);
+  }
+
+  /**
+   * @return the run of virtual blocks beginning at vidx that are mapped to
+   * contiguous logical blocks (or all unmapped, in which case lidx is 0)
+   */
+  [[nodiscard]] Extent get_extent(VirtualBlockIdx vidx) const {
+    return get_tables().extents.get_extent(vidx);
+  }
+
+  /**
+   * Find the first tx entry from cursor that may change any of the virtual
+   * blocks [first, last], among the ones applied recently; thread safe
+   *
+   * @param[in] cursor where to start; must not be in an overflow state
+   * @param[out] seq the position of the entry found (see TxCursor::get_seq),
+   * or the position after the ones applied recently if none
+   * @param[out] file_size the largest file size implied by the entries before
+   * @return false if the entry at cursor is not among the ones applied recently
+   */
+  bool find_conflict(const TxCursor& cursor, VirtualBlockIdx first,
+                     VirtualBlockIdx last, uint64_t* seq,
+                     uint64_t* file_size) const {
+    return conflict_index.find(cursor.get_seq(), cursor.idx, first, last, seq,
+                               file_size);
+  }
+
+  /**
+   * @return the number of deltas not yet folded into the virtual block
+   */
+  [[nodiscard]] uint32_t get_num_deltas(VirtualBlockIdx vidx) const {
+    return get_tables().deltas.get_num_deltas(vidx);
   }
 
+  [[nodiscard]] bool has_delta(VirtualBlockIdx vidx) const {
+    return get_tables().deltas.has_deltas(vidx);
+  }
+
+  [[nodiscard]] size_t get_delta_memory() const {
+    return get_tables().deltas.get_memory();
+  }
+
+  /**
+   * @return whether a small write may be logged as a delta; the room for
+   * deltas is bounded, and it is freed as they are folded
+   */
+  [[nodiscard]] bool can_add_delta() const {
+    return !get_tables().deltas.is_almost_full();
+  }
+
+  /**
+   * Apply the deltas of a virtual block to a buffer, in the order they were
+   * committed.
+   *
+   * @param vidx the virtual block
+   * @param buf the buffer holding bytes [begin, end) of the block
+   * @param begin the offset within the block where buf starts
+   * @param end the offset within the block where buf ends
+   */
+  void apply_delta(VirtualBlockIdx vidx, char* buf, size_t begin,
+                   size_t end) const {
+    const DeltaTable& deltas = get_tables().deltas;
+    if (deltas.has_deltas(vidx)) deltas.apply(vidx, buf, begin, end);
+  }
+
+  /**
+   * @param vidx the virtual block to read
+   * @param lidx the logical block mapped to vidx
+   * @param scratch a buffer of BLOCK_SIZE bytes
+   * @return the address of the content of the virtual block, which is either
+   * the logical block itself or, if it has deltas, a copy in scratch with the
+   * deltas applied
+   */
+  const char* get_block_ro(VirtualBlockIdx vidx, LogicalBlockIdx lidx,
+                           char* scratch) const {
+    const char* src = mem_table->lidx_to_addr_ro(lidx)->data_ro();
+    const DeltaTable& deltas = get_tables().deltas;
+    if (!deltas.has_deltas(vidx)) return src;
+    dram::memcpy(scratch, src, BLOCK_SIZE);
+    deltas.apply(vidx, scratch, 0, BLOCK_SIZE);
+    return scratch;
+  }
+
+  const char* get_block_ro(VirtualBlockIdx vidx, char* scratch) const {
+    return get_block_ro(vidx, vidx_to_lidx(vidx), scratch);
+  }
+
+  /**
+   * Fold the deltas of every virtual block into a newly allocated logical block
+   * and remap the virtual block to it in DRAM. Only called by GarbageCollector,
+   * which is single-threaded and builds a new tx history from the block table.
+   *
+   * @param allocator the allocator to allocate new blocks
+   * @return the newly allocated logical blocks
+   */
+  std::vector<LogicalBlockIdx> fold_deltas_unsafe(Allocator* allocator) {
+    std::vector<LogicalBlockIdx> folded_lidxs;
+    char scratch[BLOCK_SIZE];
+    own_tables->deltas.for_each_head([&](VirtualBlockIdx vidx,
+                                         const DeltaNode*) {
+      LogicalBlockIdx new_lidx = allocator->block.alloc(1);
+      pmem::memcpy_persist(mem_table->lidx_to_addr_rw(new_lidx)->data_rw(),
+                           get_block_ro(vidx, scratch), BLOCK_SIZE);
+      // the old logical block may still be read by other processes that have
+      // not seen the new tx history, so it is not freed here
+      map_blocks(vidx, new_lidx, 1);
+      folded_lidxs.emplace_back(new_lidx);
+    });
+    fence();
+    return folded_lidxs;
+  }
+
+  /**
+   * Bring the block table up to date with the tx entries committed so far
+   *
+   * @param result_state the state up to date is stored here
+   * @param allocator if given, allow allocation when iterating the tx_idx
+   */
   void update(FileState* result_state, Allocator* allocator = nullptr) {
-    if (!need_update(result_state, allocator)) return;
-    pthread_spin_lock(&spinlock);
+    // the versions of the shared state and the private one do not compare
+    const SharedBlkTable* shared_table =
+        shared.load(std::memory_order_relaxed);
+    uint64_t ver;
+    if (!need_update(result_state, allocator, &ver)) return;
+
+    // If another thread holds the lock, let it apply the new tx entries for
+    // everyone rather than queue up behind it only to find nothing left to
+    // apply. The holder may have started before the entries seen above were
+    // committed, but the next one to publish must have started after.
+    const uint64_t covered_ver = (ver & ~1ul) + 4;
+    while (!try_lock()) {
+      _mm_pause();
+      if (!need_update(result_state, allocator, &ver)) return;
+      if (!(ver & 1) && ver >= covered_ver &&
+          shared.load(std::memory_order_relaxed) == shared_table)
+        return;
+    }
     update_unsafe(allocator);
     *result_state = state;
-    pthread_spin_unlock(&spinlock);
+    unlock();
   }
 
   template <typename Fn>
   void update(Fn&& fn, Allocator* allocator = nullptr) {
-    pthread_spin_lock(&spinlock);
+    lock();
     update_unsafe(allocator);
     fn(const_cast<const FileState&>(state));
-    pthread_spin_unlock(&spinlock);
+    unlock();
   }
 
   /**
@@ -113,39 +417,214 @@ class BlkTable {
       return state.file_size;
     }
 
-    // inc the version into an odd number to indicate temporarily inconsistency
-    uint64_t old_ver = version.load(std::memory_order_relaxed);
-    version.store(old_ver + 1, std::memory_order_release);
-
     LogicalBlockIdx prev_tx_block_idx = 0;
     while (true) {
       auto tx_entry = cursor.get_entry();
       if (!tx_entry.is_valid()) break;
       if (bitmap_mgr && cursor.idx.block_idx != prev_tx_block_idx)
         bitmap_mgr->set_allocated(cursor.idx.block_idx);
-      if (tx_entry.is_inline())
-        apply_inline_tx(tx_entry.inline_entry);
-      else
-        apply_indirect_tx(tx_entry.indirect_entry, bitmap_mgr);
+      SummarySink sink{*this, tx_entry.is_size()};
+      apply_tx(tx_entry, bitmap_mgr, sink);
+      conflict_index.add(cursor.get_seq(), cursor.idx, sink.summary);
       prev_tx_block_idx = cursor.idx.block_idx;
       if (bool success = cursor.advance(mem_table, allocator); !success) break;
     }
 
+    if (is_full) {
+      detach_unsafe();
+    } else if (cursor.idx != state.cursor.idx) {
+      // nothing to publish if no tx entry is applied
+      state.cursor = cursor;
+      publish_state();
+    }
+
     // mark all live data blocks in bitmap
+    if (bitmap_mgr) mark_allocated(bitmap_mgr);
+
+    return state.file_size;
+  }
+
+  /**
+   * Build a newly constructed block table from the tx history, using up to
+   * runtime_options.replay_threads threads; not thread-safe. The replay starts
+   * from the current state, i.e., either the beginning of the history or a
+   * checkpoint restored by restore_unsafe.
+   *
+   * The chain of tx blocks is split into contiguous ranges in tx_seq order.
+   * Each thread replays a range into a partial map, and the partial maps are
+   * then merged in tx order, so that a later mapping of a virtual block wins.
+   * A short history is replayed by update_unsafe instead.
+   *
+   * @param bitmap_mgr if given, initialized the bitmap; the replay must start
+   * from the beginning of the history
+   */
+  uint64_t replay_unsafe(BitmapMgr* bitmap_mgr = nullptr) {
+    assert(!bitmap_mgr || state.cursor.idx == TxEntryIdx{});
+
+    auto num_threads =
+        static_cast<size_t>(std::max(runtime_options.replay_threads, 1));
+    if (num_threads == 1) return update_unsafe(nullptr, bitmap_mgr);
+
+    TxCursor cursor = state.cursor;
+    if (!cursor.handle_overflow(mem_table)) return state.file_size;
+    auto get_next_tx_block = [](const TxCursor& c) {
+      return c.idx.is_inline() ? c.meta->get_next_tx_block()
+                               : c.block->get_next_tx_block();
+    };
+
+    // the first entry to replay in each tx block
+    std::vector<TxCursor> tx_blocks{cursor};
+    for (LogicalBlockIdx idx = get_next_tx_block(cursor); idx != 0;
+         idx = get_next_tx_block(tx_blocks.back()))
+      tx_blocks.emplace_back(TxEntryIdx{idx, 0},
+                             &mem_table->lidx_to_addr_rw(idx)->tx_block);
+    num_threads = std::min(num_threads,
+                           tx_blocks.size() / REPLAY_MIN_BLOCKS_PER_THREAD);
+    if (num_threads <= 1) return update_unsafe(nullptr, bitmap_mgr);
+
+    LOG_DEBUG("replay %zu tx blocks with %zu threads", tx_blocks.size(),
+              num_threads);
+    TimerGuard<Event::UPDATE> timer_guard;
+
     if (bitmap_mgr)
-      for (const auto& logical_idx : table)
-        bitmap_mgr->set_allocated(logical_idx);
+      for (const auto& cursor : tx_blocks)
+        bitmap_mgr->set_allocated(cursor.idx.block_idx);
 
-    state.cursor = cursor;
+    std::vector<ReplayPartial> partials(num_threads);
+    {
+      std::vector<std::thread> threads;
+      for (size_t i = 0; i < num_threads; ++i) {
+        size_t begin = tx_blocks.size() * i / num_threads;
+        size_t end = tx_blocks.size() * (i + 1) / num_threads;
+        // no tx block links back to the meta block, so 0 means no end
+        LogicalBlockIdx end_block =
+            end < tx_blocks.size() ? tx_blocks[end].idx.block_idx : 0;
+        threads.emplace_back(&BlkTable::replay_range, this, tx_blocks[begin],
+                             end_block, bitmap_mgr, &partials[i]);
+      }
+      for (auto& thread : threads) thread.join();
+    }
 
-    // inc the version into an even number to indicate they are consistent now
-    version.store(old_ver + 2, std::memory_order_release);
+    for (const auto& partial : partials) {
+      merge_partial(partial);
+      state.cursor = partial.cursor;
+      // the history ends early if a range hits an invalid entry
+      if (partial.reached_tail) break;
+    }
+    if (is_full) detach_unsafe();
+
+    if (bitmap_mgr) {
+      std::vector<std::thread> threads;
+      const size_t num_leaves =
+          own_tables->extents.capacity() / ExtentTable::LEAF_BLOCKS;
+      for (size_t i = 0; i < num_threads; ++i) {
+        auto begin = static_cast<uint32_t>(num_leaves * i / num_threads);
+        auto end = static_cast<uint32_t>(num_leaves * (i + 1) / num_threads);
+        threads.emplace_back(&BlkTable::mark_allocated, this, bitmap_mgr,
+                             begin * ExtentTable::LEAF_BLOCKS,
+                             end * ExtentTable::LEAF_BLOCKS);
+      }
+      for (auto& thread : threads) thread.join();
+    }
 
+    publish_state();
     return state.file_size;
   }
 
+  /**
+   * Mark the blocks in use in the bitmap, i.e., the tx blocks, the log entry
+   * blocks, and the mapped data blocks, without rebuilding the table; used if
+   * the table is shared and built by a process that does not initialize the
+   * bitmap
+   */
+  void init_bitmap(BitmapMgr* bitmap_mgr) {
+    // the tx history is only walked for the blocks it uses
+    struct {
+      void map_blocks(VirtualBlockIdx, LogicalBlockIdx, uint32_t) {}
+      void add_delta(const pmem::LogEntry&) {}
+      void extend_file_size(uint64_t) {}
+    } no_sink;
+
+    update([&](const FileState&) {
+      TxCursor cursor = TxCursor::from_meta(mem_table->get_meta());
+      if (!cursor.handle_overflow(mem_table)) return;
+      LogicalBlockIdx prev_tx_block_idx = 0;
+      while (true) {
+        auto tx_entry = cursor.get_entry();
+        if (!tx_entry.is_valid()) break;
+        if (cursor.idx.block_idx != prev_tx_block_idx)
+          bitmap_mgr->set_allocated(cursor.idx.block_idx);
+        apply_tx(tx_entry, bitmap_mgr, no_sink);
+        prev_tx_block_idx = cursor.idx.block_idx;
+        if (!cursor.advance(mem_table)) break;
+      }
+      mark_allocated(bitmap_mgr);
+    });
+  }
+
   [[nodiscard]] FileState get_state_unsafe() const { return state; }
 
+  /**
+   * @return a checkpoint of the block table, brought up to date first
+   */
+  [[nodiscard]] Checkpoint get_checkpoint() {
+    Checkpoint checkpoint;
+    update([&](const FileState& curr_state) {
+      auto& header = checkpoint.header;
+      header.cursor = curr_state.cursor.idx;
+      header.file_size = curr_state.file_size;
+      header.tx_seq = header.cursor.is_inline()
+                          ? pmem::MetaBlock::get_tx_seq()
+                          : curr_state.cursor.block->get_tx_seq();
+      auto num_vidxs = static_cast<uint32_t>(
+          BLOCK_SIZE_TO_IDX(ALIGN_UP(curr_state.file_size, BLOCK_SIZE)));
+      const auto& [extents, deltas] = *own_tables;
+      extents.for_each_extent([&](VirtualBlockIdx vidx, LogicalBlockIdx lidx,
+                                  uint32_t num_blocks) {
+        if (vidx >= num_vidxs) return;
+        num_blocks = std::min(num_blocks, num_vidxs - vidx.get());
+        checkpoint.extents.push_back({vidx.get(), lidx.get(), num_blocks});
+      });
+      header.num_extents = static_cast<uint32_t>(checkpoint.extents.size());
+
+      std::vector<const DeltaNode*> chain;
+      deltas.for_each_head([&](VirtualBlockIdx vidx, const DeltaNode* head) {
+        if (vidx >= num_vidxs) return;
+        chain.clear();
+        for (auto node = head; node; node = deltas.get_prev(node))
+          chain.emplace_back(node);
+        // the older ones first
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+          checkpoint.add_delta(vidx, (*it)->local_offset, (*it)->size,
+                               (*it)->data);
+      });
+    });
+    return checkpoint;
+  }
+
+  /**
+   * Restore a newly constructed block table from a checkpoint, so that
+   * replay_unsafe only replays the tx entries after it; not thread-safe
+   */
+  void restore_unsafe(const Checkpoint& checkpoint) {
+    assert(state.cursor.idx == TxEntryIdx{});
+    TimerGuard<Event::CHECKPOINT_LOAD> timer_guard;
+    const auto& header = checkpoint.header;
+
+    for (const auto& extent : checkpoint.extents)
+      map_blocks(extent.vidx, extent.lidx, extent.num_blocks);
+    checkpoint.for_each_delta(
+        [&](VirtualBlockIdx vidx, uint16_t local_offset, uint16_t size,
+            const char* data) { add_delta(vidx, local_offset, size, data); });
+
+    state.file_size = header.file_size;
+    state.cursor = get_cursor(header.cursor);
+    if (is_full)
+      detach_unsafe();
+    else
+      publish_state();
+  }
+
  private:
   /**
    * Quick check if update is necessary; thread safe
@@ -155,14 +634,13 @@ class BlkTable {
    *
    * @param result_state if no need to update, file state is stored here
    * @param allocator if given, allow allocation
+   * @param[out] ver the version of the published state read (see read_state)
    * @return whether update is necessary
    */
-  [[nodiscard]] bool need_update(FileState* result_state,
-                                 Allocator* allocator) const {
-    uint64_t curr_ver = version.load(std::memory_order_acquire);
-    if (curr_ver & 1) return true;  // old version means inconsistency
-    *result_state = state;
-    if (curr_ver != version.load(std::memory_order_acquire)) return true;
+  [[nodiscard]] bool need_update(FileState* result_state, Allocator* allocator,
+                                 uint64_t* ver) const {
+    *ver = read_state(result_state);
+    if (*ver & 1) return true;  // odd version means inconsistency
     bool success = result_state->cursor.handle_overflow(mem_table, allocator);
     if (!success) {
       return false;
@@ -172,20 +650,285 @@ class BlkTable {
     return result_state->cursor.get_entry().is_valid();
   }
 
-  void grow_to_fit(VirtualBlockIdx idx) {
-    if (table.size() > idx.get()) return;
-    table.grow_to_at_least(next_pow2(idx.get()));
+  /**
+   * Read the published state like a seqlock reader
+   * @return the version of the state read; odd if it is inconsistent
+   */
+  uint64_t read_state(FileState* result_state) const {
+    if (const SharedBlkTable* shared_table =
+            shared.load(std::memory_order_acquire)) {
+      const SharedBlkTable& s = *shared_table;
+      uint64_t curr_ver = s.version.load(std::memory_order_acquire);
+      if (curr_ver & 1) return curr_ver;
+      TxEntryIdx cursor = s.cursor.load(std::memory_order_relaxed);
+      uint64_t file_size = s.file_size.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (curr_ver != s.version.load(std::memory_order_relaxed))
+        return curr_ver | 1;
+      *result_state = {get_cursor(cursor), file_size};
+      return curr_ver;
+    }
+    uint64_t curr_ver = version.load(std::memory_order_acquire);
+    if (curr_ver & 1) return curr_ver;
+    *result_state = published;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (curr_ver != version.load(std::memory_order_relaxed))
+      return curr_ver | 1;
+    return curr_ver;
+  }
+
+  [[nodiscard]] const Tables& get_tables() const {
+    return *tables.load(std::memory_order_acquire);
+  }
+
+  void lock() {
+    if (SharedBlkTable* shared_table = shared.load(std::memory_order_acquire))
+      if (lock_shared(shared_table, pthread_mutex_lock(&shared_table->mutex)))
+        return;
+    pthread_spin_lock(&spinlock);
+  }
+
+  /**
+   * @return whether the lock is acquired; false if it is held by others
+   */
+  bool try_lock() {
+    if (SharedBlkTable* shared_table =
+            shared.load(std::memory_order_acquire)) {
+      int rc = pthread_mutex_trylock(&shared_table->mutex);
+      if (rc == EBUSY) return false;
+      if (lock_shared(shared_table, rc)) return true;
+    }
+    return pthread_spin_trylock(&spinlock) == 0;
+  }
+
+  /**
+   * Handle the result of locking the mutex of the shared table
+   *
+   * @return whether this process still uses the shared table; if not, it has
+   * detached meanwhile, and the mutex is released for the private lock to be
+   * taken instead
+   */
+  bool lock_shared(SharedBlkTable* shared_table, int rc) {
+    if (rc == EOWNERDEAD) {
+      // the previous holder died in the middle of an update. The tables stay
+      // readable (see ExtentTable), and everything it has changed since the
+      // published cursor comes from the tx entries after it, which are applied
+      // again from there.
+      LOG_WARN("the holder of the shared block table lock died");
+      pthread_mutex_consistent(&shared_table->mutex);
+      uint64_t ver = shared_table->version.load(std::memory_order_relaxed);
+      if (ver & 1)
+        shared_table->version.store(ver + 1, std::memory_order_release);
+    } else {
+      PANIC_IF(rc != 0, "pthread_mutex_lock failed: %s", strerror(rc));
+    }
+    if (shared.load(std::memory_order_relaxed) != shared_table) {
+      pthread_mutex_unlock(&shared_table->mutex);
+      return false;
+    }
+    locked_shared = shared_table;
+    load_shared_state();
+    return true;
+  }
+
+  void unlock() {
+    if (SharedBlkTable* shared_table = locked_shared) {
+      locked_shared = nullptr;
+      pthread_mutex_unlock(&shared_table->mutex);
+    } else {
+      pthread_spin_unlock(&spinlock);
+    }
+  }
+
+  // publish the state for the threads not holding the lock
+  void publish_state() {
+    SharedBlkTable* shared_table = shared.load(std::memory_order_relaxed);
+    std::atomic<uint64_t>& ver = shared_table ? shared_table->version : version;
+    uint64_t old_ver = ver.load(std::memory_order_relaxed);
+    ver.store(old_ver + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (shared_table) {
+      shared_table->file_size.store(state.file_size, std::memory_order_relaxed);
+      shared_table->cursor.store(state.cursor.idx, std::memory_order_relaxed);
+    } else {
+      published = state;
+    }
+    ver.store(old_ver + 2, std::memory_order_release);
+  }
+
+  // the state may have been changed by other processes since the last time
+  void load_shared_state() {
+    const SharedBlkTable* shared_table = shared.load(std::memory_order_relaxed);
+    state.cursor =
+        get_cursor(shared_table->cursor.load(std::memory_order_relaxed));
+    state.file_size = shared_table->file_size.load(std::memory_order_relaxed);
   }
 
   /**
-   * Apply an indirect transaction to the block table
+   * Stop using the shared tables, which have no room left for the tx entries
+   * being applied, and use private ones built from the tx history instead;
+   * called by the lock holder, or while the table is being built. The other
+   * processes detach as well once they apply the same entries, and no process
+   * attaches to the shared tables until they are reset.
+   */
+  void detach_unsafe() {
+    SharedBlkTable* shared_table = shared.load(std::memory_order_relaxed);
+    LOG_WARN("the shared block table is full; use a private one");
+    shared_table->is_full.store(true, std::memory_order_relaxed);
+
+    BlkTable private_table(mem_table);
+    if (auto checkpoint = Checkpoint::load(mem_table))
+      private_table.restore_unsafe(*checkpoint);
+    private_table.replay_unsafe();
+
+    // the other threads taking the shared lock from now on take the private
+    // one instead, which is thus held until the shared one is released
+    if (locked_shared) pthread_spin_lock(&spinlock);
+    old_tables = std::move(own_tables);
+    own_tables = std::move(private_table.own_tables);
+    tables.store(own_tables.get(), std::memory_order_release);
+    state = private_table.state;
+    published = state;
+    version.store(version.load(std::memory_order_relaxed) + 2,
+                  std::memory_order_release);
+    shared.store(nullptr, std::memory_order_release);
+    is_full = false;
+    if (locked_shared) {
+      locked_shared = nullptr;
+      pthread_mutex_unlock(&shared_table->mutex);
+    }
+  }
+
+  [[nodiscard]] TxCursor get_cursor(TxEntryIdx idx) const {
+    if (idx.is_inline()) return {idx, mem_table->get_meta()};
+    return {idx, &mem_table->lidx_to_addr_rw(idx.block_idx)->tx_block};
+  }
+
+  /**
+   * Replay the tx history from cursor until the tx block end_block into a
+   * partial map; called by the threads of replay_unsafe
+   */
+  void replay_range(TxCursor cursor, LogicalBlockIdx end_block,
+                    BitmapMgr* bitmap_mgr, ReplayPartial* partial) const {
+    while (true) {
+      auto tx_entry = cursor.get_entry();
+      if (!tx_entry.is_valid()) {
+        partial->reached_tail = true;
+        break;
+      }
+      apply_tx(tx_entry, bitmap_mgr, *partial);
+      if (!cursor.advance(mem_table)) {
+        partial->reached_tail = true;
+        break;
+      }
+      if (cursor.idx.block_idx == end_block) break;
+    }
+    partial->cursor = cursor;
+  }
+
+  void merge_partial(const ReplayPartial& partial) {
+    // map in the order of vidx, so that the runs are merged into extents as
+    // they are added
+    std::vector<std::pair<uint32_t, LogicalBlockIdx>> mappings;
+    mappings.reserve(partial.mappings.size());
+    for (const auto& [vidx, mapping] : partial.mappings)
+      mappings.emplace_back(vidx, mapping.first);
+    std::sort(mappings.begin(), mappings.end());
+    for (size_t begin = 0, end; begin < mappings.size(); begin = end) {
+      for (end = begin + 1; end < mappings.size(); ++end)
+        if (mappings[end].first != mappings[begin].first + (end - begin) ||
+            mappings[end].second != mappings[begin].second + (end - begin))
+          break;
+      map_blocks(mappings[begin].first, mappings[begin].second,
+                 static_cast<uint32_t>(end - begin));
+    }
+    for (const auto& [pos, entry] : partial.deltas) {
+      // skip the deltas obsoleted by a later mapping in the same range
+      auto it = partial.mappings.find(entry->begin_vidx.get());
+      if (it != partial.mappings.end() && it->second.second > pos) continue;
+      add_delta(*entry);
+    }
+    extend_file_size(partial.file_size);
+  }
+
+  /*
+   * The changes decoded from the tx history go to a sink, which is either the
+   * block table itself or a ReplayPartial; both provide map_blocks,
+   * add_delta, and extend_file_size.
+   */
+
+  void map_blocks(VirtualBlockIdx vidx, LogicalBlockIdx lidx,
+                  uint32_t num_blocks) {
+    if (!own_tables->extents.map(vidx, lidx, num_blocks)) {
+      is_full = true;
+      return;
+    }
+    // a new mapping of the virtual block makes all its deltas obsolete
+    for (uint32_t i = 0; i < num_blocks; ++i)
+      own_tables->deltas.clear(vidx + i);
+  }
+
+  void extend_file_size(uint64_t file_size) {
+    if (file_size > state.file_size) state.file_size = file_size;
+  }
+
+  /**
+   * Add a delta log entry; the mapping and the file size are unchanged
+   * @param entry a LOG_DELTA log entry
+   */
+  void add_delta(const pmem::LogEntry& entry) {
+    const pmem::LogDelta* delta = entry.get_delta();
+    add_delta(entry.begin_vidx, delta->local_offset, delta->size, delta->data);
+  }
+
+  void add_delta(VirtualBlockIdx vidx, uint16_t local_offset, uint16_t size,
+                 const char* data) {
+    if (own_tables->deltas.add(vidx, local_offset, size, data)) return;
+    // the writers stop adding deltas while a quarter of the room is left (see
+    // can_add_delta), and the deltas folded since then are freed, so only the
+    // shared tables, which also have a fixed number of leaves, run out of room
+    PANIC_IF(!is_shared(), "no room left for the deltas of vidx %u",
+             vidx.get());
+    is_full = true;
+  }
+
+  // mark the mapped blocks of the leaves in [begin, end) in the bitmap
+  void mark_allocated(BitmapMgr* bitmap_mgr, uint32_t begin = 0,
+                      uint32_t end = UINT32_MAX) const {
+    own_tables->extents.for_each_extent(
+        [&](VirtualBlockIdx, LogicalBlockIdx lidx, uint32_t num_blocks) {
+          for (uint32_t i = 0; i < num_blocks; ++i)
+            bitmap_mgr->set_allocated(lidx + i);
+        },
+        begin, end);
+  }
+
+  template <typename Sink>
+  void apply_tx(pmem::TxEntry tx_entry, BitmapMgr* bitmap_mgr,
+                Sink& sink) const {
+    if (tx_entry.is_size())
+      apply_size_tx(tx_entry.size_entry, sink);
+    else if (tx_entry.is_inline())
+      apply_inline_tx(tx_entry.inline_entry, sink);
+    else
+      apply_indirect_tx(tx_entry.indirect_entry, bitmap_mgr, sink);
+  }
+
+  /**
+   * Apply an indirect transaction
    *
    * @param tx_entry the entry to be applied
    * @param bitmap_mgr if passed, initialized the bitmap
+   * @param sink where the changes go
    */
-  void apply_indirect_tx(pmem::TxEntryIndirect tx_entry,
-                         BitmapMgr* bitmap_mgr) {
+  template <typename Sink>
+  void apply_indirect_tx(pmem::TxEntryIndirect tx_entry, BitmapMgr* bitmap_mgr,
+                         Sink& sink) const {
     LogCursor log_cursor(tx_entry, mem_table, bitmap_mgr);
+    if (log_cursor->is_delta()) {
+      sink.add_delta(*log_cursor);
+      return;
+    }
 
     uint32_t num_blocks;
     VirtualBlockIdx begin_vidx, end_vidx;
@@ -195,57 +938,69 @@ class BlkTable {
       begin_vidx = log_cursor->begin_vidx;
       num_blocks = log_cursor->num_blocks;
       end_vidx = begin_vidx + num_blocks;
-      grow_to_fit(end_vidx);
 
-      for (uint32_t offset = 0; offset < log_cursor->num_blocks; ++offset)
-        table[begin_vidx.get() + offset] =
-            log_cursor->begin_lidxs[offset / BITMAP_ENTRY_BLOCKS_CAPACITY] +
-            offset % BITMAP_ENTRY_BLOCKS_CAPACITY;
+      // each logical block run covers up to BITMAP_ENTRY_BLOCKS_CAPACITY
+      for (uint32_t offset = 0; offset < num_blocks;
+           offset += BITMAP_ENTRY_BLOCKS_CAPACITY)
+        sink.map_blocks(
+            begin_vidx + offset,
+            log_cursor->begin_lidxs[offset / BITMAP_ENTRY_BLOCKS_CAPACITY],
+            std::min(num_blocks - offset, BITMAP_ENTRY_BLOCKS_CAPACITY));
       // only the last one matters, so this variable will keep being overwritten
       leftover_bytes = log_cursor->leftover_bytes;
     } while (log_cursor.advance(mem_table, bitmap_mgr));
 
-    if (uint64_t new_file_size = BLOCK_IDX_TO_SIZE(end_vidx) - leftover_bytes;
-        new_file_size > state.file_size) {
-      state.file_size = new_file_size;
-    }
+    sink.extend_file_size(BLOCK_IDX_TO_SIZE(end_vidx) - leftover_bytes);
   }
 
   /**
-   * Apply an inline transaction to the block table
+   * Apply an inline transaction
    * @param tx_entry the entry to be applied
+   * @param sink where the changes go
    */
-  void apply_inline_tx(pmem::TxEntryInline tx_entry) {
+  template <typename Sink>
+  void apply_inline_tx(pmem::TxEntryInline tx_entry, Sink& sink) const {
     uint32_t num_blocks = tx_entry.num_blocks;
-    // for dummy entry, do nothing
-    if (num_blocks == 0) return;
+    assert(num_blocks > 0);
     VirtualBlockIdx begin_vidx = tx_entry.begin_virtual_idx;
     LogicalBlockIdx begin_lidx = tx_entry.begin_logical_idx;
     VirtualBlockIdx end_vidx = begin_vidx + num_blocks;
-    grow_to_fit(end_vidx);
 
     // update block table mapping
-    for (uint32_t i = 0; i < num_blocks; ++i)
-      table[begin_vidx.get() + i] = begin_lidx + i;
+    sink.map_blocks(begin_vidx, begin_lidx, num_blocks);
 
     // update file size if this write exceeds current file size
     // inline tx must be aligned to BLOCK_SIZE boundary
-    uint64_t now_file_size = BLOCK_IDX_TO_SIZE(end_vidx);
-    if (now_file_size > state.file_size) state.file_size = now_file_size;
+    sink.extend_file_size(BLOCK_IDX_TO_SIZE(end_vidx));
+  }
+
+  /**
+   * Apply a size transaction; the mapping is unchanged
+   * @param tx_entry the entry to be applied; a dummy entry does nothing
+   * @param sink where the changes go
+   */
+  template <typename Sink>
+  static void apply_size_tx(pmem::TxEntrySize tx_entry, Sink& sink) {
+    sink.extend_file_size(tx_entry.file_size);
   }
 
   friend std::ostream& operator<<(std::ostream& out, const BlkTable& b) {
     out << "BlkTable:\n";
     out << "\tfile_size: " << b.state.file_size << "\n";
     out << "\ttail_tx_idx: " << b.state.cursor.idx << "\n";
-    for (size_t i = 0; i < b.table.size(); ++i) {
-      if (b.table[i].load() == 0) continue;
-      if (i >= 100) {
-        out << "\t...\n";
-        break;
+    out << "\tshared: " << b.is_shared() << "\n";
+    const auto& [extents, deltas] = b.get_tables();
+    out << "\tnum_delta_blocks: " << deltas.num_blocks() << "\n";
+    uint32_t num_extents = 0;
+    extents.for_each_extent([&](VirtualBlockIdx vidx, LogicalBlockIdx lidx,
+                                uint32_t num_blocks) {
+      if (++num_extents > 100) {
+        if (num_extents == 101) out << "\t...\n";
+        return;
       }
-      out << "\t" << i << " -> " << b.table[i] << "\n";
-    }
+      out << "\t[" << vidx << ", " << vidx + num_blocks << ") -> [" << lidx
+          << ", " << lidx + num_blocks << ")\n";
+    });
     return out;
   }
 };
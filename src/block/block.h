@@ -1,5 +1,6 @@
 #pragma once
 
+#include "block/checkpoint.h"
 #include "block/log.h"
 #include "block/meta.h"
 #include "block/tx.h"
@@ -10,6 +11,7 @@ union Block {
   MetaBlock meta_block;
   TxBlock tx_block;
   LogEntryBlock log_entry_block;
+  CheckpointBlock checkpoint_block;
   char data[BLOCK_SIZE];
   char cache_lines[NUM_CL_PER_BLOCK][CACHELINE_SIZE];
 
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "const.h"
+#include "idx.h"
+#include "utils/utils.h"
+
+namespace madfs::pmem {
+
+/**
+ * The fixed-size part of a block table checkpoint, followed by the extents of
+ * the mapping and then the deltas not yet folded (see dram::Checkpoint)
+ */
+struct CheckpointHeader {
+  // the checkpoint reflects all the tx entries before this one
+  TxEntryIdx cursor;
+  uint64_t file_size;
+  // the tx_seq of the tx block of the cursor; 0 for the meta block
+  uint32_t tx_seq;
+  uint32_t num_extents;
+  uint32_t num_deltas;
+  uint32_t unused;
+};
+
+static_assert(sizeof(CheckpointHeader) == 32);
+
+/**
+ * A run of virtual blocks mapped to contiguous logical blocks
+ */
+struct CheckpointExtent {
+  uint32_t vidx;
+  uint32_t lidx;
+  uint32_t num_blocks;
+};
+
+/**
+ * A delta in the checkpoint, followed by `size` bytes of data
+ */
+struct CheckpointDelta {
+  uint32_t vidx;
+  uint16_t local_offset;
+  uint16_t size;
+};
+
+/**
+ * A checkpoint is stored as a byte stream in a linked list of CheckpointBlock,
+ * whose head is referenced from the meta block
+ */
+class CheckpointBlock : public noncopyable {
+ public:
+  constexpr static uint32_t CAPACITY = BLOCK_SIZE - 2 * sizeof(uint32_t);
+
+ private:
+  // the next block of the same checkpoint; 0 if it is the last one
+  std::atomic<LogicalBlockIdx> next;
+  uint32_t unused;
+
+ public:
+  char data[CAPACITY];
+
+  [[nodiscard]] LogicalBlockIdx get_next() const {
+    return next.load(std::memory_order_relaxed);
+  }
+
+  void set_next(LogicalBlockIdx block_idx) {
+    next.store(block_idx, std::memory_order_relaxed);
+  }
+};
+
+static_assert(sizeof(CheckpointBlock) == BLOCK_SIZE,
+              "CheckpointBlock must be of size BLOCK_SIZE");
+
+}  // namespace madfs::pmem
@@ -18,6 +18,19 @@ struct TxCursor;
 
 namespace madfs::pmem {
 
+/**
+ * The head of the block table checkpoint (see CheckpointBlock); the version is
+ * bumped on every change so that a lock-free reader can detect a replacement
+ */
+struct CheckpointRef {
+  LogicalBlockIdx block_idx;
+  uint32_t version;
+
+  bool operator==(const CheckpointRef& rhs) const = default;
+};
+
+static_assert(sizeof(CheckpointRef) == 8);
+
 /*
  * LogicalBlockIdx 0 -> MetaBlock; other blocks can be any type of blocks
  */
@@ -39,6 +52,10 @@ class MetaBlock : public noncopyable {
       // orphan but not yet freed tx blocks are organized as a linked list;
       // these blocks are freed once they are not referenced by others
       std::atomic<LogicalBlockIdx> next_orphan_block;
+
+      // the latest checkpoint of the block table; 0 if there is none
+      std::atomic<CheckpointRef> checkpoint;
+      static_assert(std::atomic<CheckpointRef>::is_always_lock_free);
     } cl1_meta;
 
     // padding avoid cache line contention
@@ -51,7 +68,7 @@ class MetaBlock : public noncopyable {
   // metadata above
   union {
     struct {
-      // this lock is ONLY used for bitmap rebuild
+      // this lock is ONLY used for bitmap rebuild and checkpoint updates
       pthread_mutex_t mutex;
 
       // total number of blocks actually in this file (including unused ones)
@@ -164,6 +181,21 @@ class MetaBlock : public noncopyable {
     return cl1_meta.next_orphan_block.load(std::memory_order_acquire);
   }
 
+  /**
+   * Replace the checkpoint with the one beginning at block_idx (0 for none);
+   * must be called with the meta lock held
+   */
+  void set_checkpoint(LogicalBlockIdx block_idx) {
+    CheckpointRef ref = cl1_meta.checkpoint.load(std::memory_order_relaxed);
+    cl1_meta.checkpoint.store({block_idx, ref.version + 1},
+                              std::memory_order_release);
+    persist_cl_fenced(&cl1_meta);
+  }
+
+  [[nodiscard]] CheckpointRef get_checkpoint() const {
+    return cl1_meta.checkpoint.load(std::memory_order_acquire);
+  }
+
   /**
    * Set the flushed tx tail
    * tx_tail is mostly just a hint, so it's fine to be not up-to-date; thus by
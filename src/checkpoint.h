@@ -0,0 +1,278 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <vector>
+
+#include "alloc/block.h"
+#include "bitmap.h"
+#include "block/block.h"
+#include "idx.h"
+#include "mem_table.h"
+#include "utils/persist.h"
+#include "utils/utils.h"
+
+namespace madfs::dram {
+
+/**
+ * A checkpoint of the block table: the mapping and the deltas in effect after
+ * all the tx entries before header.cursor, so that an open only replays the tx
+ * entries after it.
+ *
+ * It is persisted as a byte stream in a linked list of pmem::CheckpointBlock
+ * referenced from the meta block. A new checkpoint is written to new blocks
+ * and then published with the meta lock held, so that a reader needs no lock:
+ * like a seqlock, it checks that the reference is unchanged after reading.
+ * The deltas are copied into the checkpoint rather than referenced, since
+ * garbage collection may free the log entries they come from.
+ */
+class Checkpoint {
+ public:
+  pmem::CheckpointHeader header{};
+  // header.num_extents runs of the mapping, in the order of vidx
+  std::vector<pmem::CheckpointExtent> extents;
+  // header.num_deltas of pmem::CheckpointDelta, each followed by its data
+  std::vector<char> deltas;
+
+  void add_delta(VirtualBlockIdx vidx, uint16_t local_offset, uint16_t size,
+                 const char* data) {
+    pmem::CheckpointDelta delta{vidx.get(), local_offset, size};
+    auto old_size = deltas.size();
+    deltas.resize(old_size + sizeof(delta) + size);
+    std::memcpy(deltas.data() + old_size, &delta, sizeof(delta));
+    std::memcpy(deltas.data() + old_size + sizeof(delta), data, size);
+    header.num_deltas++;
+  }
+
+  /**
+   * Call fn(vidx, local_offset, size, data) on each delta, in the order they
+   * were added
+   */
+  template <typename Fn>
+  void for_each_delta(Fn&& fn) const {
+    const char* p = deltas.data();
+    for (uint32_t i = 0; i < header.num_deltas; ++i) {
+      pmem::CheckpointDelta delta;
+      std::memcpy(&delta, p, sizeof(delta));
+      p += sizeof(delta);
+      fn(VirtualBlockIdx(delta.vidx), delta.local_offset, delta.size, p);
+      p += delta.size;
+    }
+  }
+
+  /**
+   * Read the checkpoint referenced by the meta block
+   *
+   * @return nullopt if there is none, or if it is replaced while being read
+   */
+  static std::optional<Checkpoint> load(MemTable* mem_table) {
+    pmem::MetaBlock* meta = mem_table->get_meta();
+    pmem::CheckpointRef ref = meta->get_checkpoint();
+    if (ref.block_idx == 0) return {};
+
+    Checkpoint checkpoint;
+    Reader reader(mem_table, ref.block_idx);
+    if (!checkpoint.read_from(reader)) {
+      LOG_WARN("checkpoint at block %u is invalid", ref.block_idx.get());
+      return {};
+    }
+    // the blocks may have been freed and reused after the reference is
+    // replaced; pairs with set_checkpoint
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (meta->get_checkpoint() != ref) return {};
+    return checkpoint;
+  }
+
+  /**
+   * Persist the checkpoint and make the meta block reference it, replacing the
+   * previous one; must be called with the meta lock held
+   */
+  void store(MemTable* mem_table, BlockAllocator* allocator) const {
+    Writer writer(mem_table, allocator);
+    writer.write(&header, sizeof(header));
+    writer.write(extents.data(),
+                 extents.size() * sizeof(pmem::CheckpointExtent));
+    writer.write(deltas.data(), deltas.size());
+    writer.finish();
+
+    pmem::MetaBlock* meta = mem_table->get_meta();
+    LogicalBlockIdx old_block_idx = meta->get_checkpoint().block_idx;
+    meta->set_checkpoint(writer.first_block_idx);
+    free_blocks(mem_table, allocator, old_block_idx);
+  }
+
+  /**
+   * Drop the checkpoint referenced by the meta block, e.g., if the tx history
+   * it refers to is going to be replaced; must be called with the meta lock
+   * held
+   */
+  static void invalidate(MemTable* mem_table, BlockAllocator* allocator) {
+    pmem::MetaBlock* meta = mem_table->get_meta();
+    LogicalBlockIdx old_block_idx = meta->get_checkpoint().block_idx;
+    if (old_block_idx == 0) return;
+    meta->set_checkpoint(0);
+    free_blocks(mem_table, allocator, old_block_idx);
+  }
+
+  /**
+   * @return the tx_seq of the checkpoint referenced by the meta block, or 0 if
+   * there is none; only a hint unless the meta lock is held
+   */
+  static uint32_t get_tx_seq(MemTable* mem_table) {
+    pmem::MetaBlock* meta = mem_table->get_meta();
+    LogicalBlockIdx block_idx = meta->get_checkpoint().block_idx;
+    if (block_idx == 0 || block_idx >= meta->get_num_logical_blocks()) return 0;
+    pmem::CheckpointHeader checkpoint_header;
+    std::memcpy(&checkpoint_header,
+                mem_table->lidx_to_addr_ro(block_idx)->checkpoint_block.data,
+                sizeof(checkpoint_header));
+    return checkpoint_header.tx_seq;
+  }
+
+  /**
+   * Mark the blocks of the checkpoint referenced by the meta block as allocated
+   * in the bitmap; must be called with the meta lock held
+   */
+  static void mark_allocated(MemTable* mem_table, BitmapMgr* bitmap_mgr) {
+    LogicalBlockIdx first = mem_table->get_meta()->get_checkpoint().block_idx;
+    for (LogicalBlockIdx idx = first; idx != 0;
+         idx = mem_table->lidx_to_addr_ro(idx)->checkpoint_block.get_next())
+      bitmap_mgr->set_allocated(idx);
+  }
+
+ private:
+  class Writer {
+    MemTable* mem_table;
+    BlockAllocator* allocator;
+    pmem::CheckpointBlock* block{nullptr};
+    uint32_t offset{pmem::CheckpointBlock::CAPACITY};
+
+   public:
+    LogicalBlockIdx first_block_idx{0};
+
+    Writer(MemTable* mem_table, BlockAllocator* allocator)
+        : mem_table(mem_table), allocator(allocator) {}
+
+    void write(const void* buf, size_t count) {
+      auto src = static_cast<const char*>(buf);
+      while (count > 0) {
+        if (offset == pmem::CheckpointBlock::CAPACITY) next_block();
+        auto len = std::min<size_t>(
+            count, pmem::CheckpointBlock::CAPACITY - offset);
+        std::memcpy(block->data + offset, src, len);
+        offset += len;
+        src += len;
+        count -= len;
+      }
+    }
+
+    void finish() {
+      if (block) pmem::persist_unfenced(block, BLOCK_SIZE);
+      fence();
+    }
+
+   private:
+    void next_block() {
+      LogicalBlockIdx block_idx = allocator->alloc(1);
+      auto next = &mem_table->lidx_to_addr_rw(block_idx)->checkpoint_block;
+      next->set_next(0);
+      if (block) {
+        block->set_next(block_idx);
+        pmem::persist_unfenced(block, BLOCK_SIZE);
+      } else {
+        first_block_idx = block_idx;
+      }
+      block = next;
+      offset = 0;
+    }
+  };
+
+  /**
+   * Read a checkpoint that may be freed and overwritten concurrently, so every
+   * block index is checked before use
+   */
+  class Reader {
+    MemTable* mem_table;
+    const pmem::CheckpointBlock* block{nullptr};
+    uint32_t offset{0};
+    uint32_t num_blocks_left;
+
+   public:
+    Reader(MemTable* mem_table, LogicalBlockIdx block_idx)
+        : mem_table(mem_table),
+          num_blocks_left(mem_table->get_meta()->get_num_logical_blocks()) {
+      if (!valid_block(block_idx)) return;
+      block = &mem_table->lidx_to_addr_ro(block_idx)->checkpoint_block;
+    }
+
+    bool read(void* buf, size_t count) {
+      auto dst = static_cast<char*>(buf);
+      while (count > 0) {
+        if (!block) return false;
+        if (offset == pmem::CheckpointBlock::CAPACITY) {
+          LogicalBlockIdx next = block->get_next();
+          if (!valid_block(next)) return false;
+          block = &mem_table->lidx_to_addr_ro(next)->checkpoint_block;
+          offset = 0;
+        }
+        auto len = std::min<size_t>(
+            count, pmem::CheckpointBlock::CAPACITY - offset);
+        std::memcpy(dst, block->data + offset, len);
+        offset += len;
+        dst += len;
+        count -= len;
+      }
+      return true;
+    }
+
+    // the number of bytes that can be read at most
+    [[nodiscard]] uint64_t max_bytes() const {
+      return static_cast<uint64_t>(num_blocks_left + 1) *
+             pmem::CheckpointBlock::CAPACITY;
+    }
+
+   private:
+    bool valid_block(LogicalBlockIdx block_idx) {
+      // a chain longer than the file must have a cycle
+      if (num_blocks_left == 0) return false;
+      --num_blocks_left;
+      return block_idx != 0 &&
+             block_idx < mem_table->get_meta()->get_num_logical_blocks();
+    }
+  };
+
+  bool read_from(Reader& reader) {
+    if (!reader.read(&header, sizeof(header))) return false;
+    uint64_t extents_bytes = static_cast<uint64_t>(header.num_extents) *
+                             sizeof(pmem::CheckpointExtent);
+    if (extents_bytes > reader.max_bytes()) return false;
+    extents.resize(header.num_extents);
+    if (!reader.read(extents.data(), extents_bytes)) return false;
+
+    for (uint32_t i = 0; i < header.num_deltas; ++i) {
+      pmem::CheckpointDelta delta;
+      if (!reader.read(&delta, sizeof(delta))) return false;
+      if (delta.local_offset + delta.size > BLOCK_SIZE) return false;
+      auto old_size = deltas.size();
+      deltas.resize(old_size + sizeof(delta) + delta.size);
+      std::memcpy(deltas.data() + old_size, &delta, sizeof(delta));
+      if (!reader.read(deltas.data() + old_size + sizeof(delta), delta.size))
+        return false;
+    }
+    return true;
+  }
+
+  static void free_blocks(MemTable* mem_table, BlockAllocator* allocator,
+                          LogicalBlockIdx block_idx) {
+    while (block_idx != 0) {
+      LogicalBlockIdx next =
+          mem_table->lidx_to_addr_ro(block_idx)->checkpoint_block.get_next();
+      allocator->free(block_idx);
+      block_idx = next;
+    }
+  }
+};
+
+}  // namespace madfs::dram
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "idx.h"
+#include "utils/utils.h"
+
+namespace madfs::dram {
+
+/**
+ * A summary of the tx entries recently applied to the block table, so that a
+ * tx checking the entries committed after its snapshot for conflicts (see
+ * Tx::handle_conflict) skips the ones that cannot touch its range without
+ * reading them from the log.
+ *
+ * Each entry is summarized by the range of virtual blocks it may change and the
+ * file size it implies. The summaries of the last CAPACITY entries are kept in
+ * a ring indexed by the position of the entry in the tx history (see
+ * TxCursor::get_seq), under an implicit segment tree whose nodes hold the union
+ * of the ranges and the largest file size below them, so that the first entry
+ * overlapping a range is found in logarithmic time.
+ *
+ * Like the tables of BlkTable, the writer is the one holding the lock of
+ * BlkTable, and readers take no lock: a reader checks afterwards that the part
+ * of the ring it read was not reused meanwhile.
+ */
+class ConflictIndex : noncopyable {
+ public:
+  static constexpr uint32_t CAPACITY_SHIFT = 10;
+  static constexpr uint32_t CAPACITY = 1 << CAPACITY_SHIFT;
+
+  /**
+   * The virtual blocks [first, last] and the file size; the range is empty if
+   * first > last
+   */
+  struct Summary {
+    VirtualBlockIdx first{UINT32_MAX};
+    VirtualBlockIdx last{0};
+    uint64_t file_size{0};
+
+    void add_range(VirtualBlockIdx range_first, VirtualBlockIdx range_last) {
+      first = std::min(first, range_first);
+      last = std::max(last, range_last);
+    }
+  };
+
+ private:
+  struct Node {
+    // first in the lower 32 bits and last in the upper ones
+    std::atomic<uint64_t> range;
+    std::atomic<uint64_t> file_size;
+  };
+
+  // node 1 is the root, the children of node i are 2i and 2i+1, and the leaf
+  // of ring slot i is node CAPACITY + i
+  std::unique_ptr<Node[]> nodes;
+  // the entry of each ring slot, to tell the histories apart
+  std::unique_ptr<std::atomic<TxEntryIdx>[]> idxs;
+
+  // the entries [begin, end) are summarized, except those overwritten in the
+  // ring; begin is only moved by reset, which makes generation odd meanwhile
+  std::atomic<uint64_t> begin{0};
+  std::atomic<uint64_t> end{0};
+  std::atomic<uint32_t> generation{0};
+
+ public:
+  ConflictIndex()
+      : nodes(std::make_unique<Node[]>(2 * CAPACITY)),
+        idxs(std::make_unique<std::atomic<TxEntryIdx>[]>(CAPACITY)) {
+    for (uint32_t i = 0; i < 2 * CAPACITY; ++i)
+      nodes[i].range.store(pack(Summary{}), std::memory_order_relaxed);
+  }
+
+  /**
+   * Add the summary of the entry at position seq; an entry not following the
+   * last one (e.g., the tx history has been replaced, or the entries between
+   * were applied by another process) drops everything before it
+   */
+  void add(uint64_t seq, TxEntryIdx idx, const Summary& summary) {
+    if (seq != end.load(std::memory_order_relaxed)) reset(seq);
+    auto slot = static_cast<uint32_t>(seq & (CAPACITY - 1));
+    idxs[slot].store(idx, std::memory_order_relaxed);
+    uint32_t i = CAPACITY + slot;
+    nodes[i].range.store(pack(summary), std::memory_order_relaxed);
+    nodes[i].file_size.store(summary.file_size, std::memory_order_relaxed);
+    for (i /= 2; i > 0; i /= 2) {
+      Summary left = unpack(nodes[2 * i]), right = unpack(nodes[2 * i + 1]);
+      left.add_range(right.first, right.last);
+      left.file_size = std::max(left.file_size, right.file_size);
+      nodes[i].range.store(pack(left), std::memory_order_relaxed);
+      nodes[i].file_size.store(left.file_size, std::memory_order_relaxed);
+    }
+    end.store(seq + 1, std::memory_order_release);
+  }
+
+  /**
+   * Find the first entry from position seq whose range overlaps [first, last]
+   *
+   * @param[in] seq the position of the entry at idx
+   * @param[in] idx the entry to start from
+   * @param[out] found_seq the position of the entry found, or the end of the
+   * summarized entries if none
+   * @param[out] file_size the largest file size of the entries skipped
+   * @return false if the entry at seq is not summarized
+   */
+  bool find(uint64_t seq, TxEntryIdx idx, VirtualBlockIdx first,
+            VirtualBlockIdx last, uint64_t* found_seq,
+            uint64_t* file_size) const {
+    uint32_t gen = generation.load(std::memory_order_acquire);
+    if (gen & 1) return false;
+    uint64_t curr_end = end.load(std::memory_order_acquire);
+    if (seq < begin.load(std::memory_order_relaxed) || seq >= curr_end ||
+        curr_end - seq >= CAPACITY)
+      return false;
+    auto slot = static_cast<uint32_t>(seq & (CAPACITY - 1));
+    if (idxs[slot].load(std::memory_order_relaxed) != idx) return false;
+
+    // the slots of [seq, curr_end), which may wrap around the ring
+    auto len = static_cast<uint32_t>(curr_end - seq);
+    *file_size = 0;
+    uint32_t found = find_in(1, 0, CAPACITY, slot, slot + len, first, last,
+                             file_size);
+    if (found == CAPACITY && slot + len > CAPACITY)
+      found = find_in(1, 0, CAPACITY, 0, slot + len - CAPACITY, first, last,
+                      file_size);
+    *found_seq = found == CAPACITY
+                     ? curr_end
+                     : seq + ((found - slot) & (CAPACITY - 1));
+
+    // the writer overwrites the slot of end - CAPACITY next
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return generation.load(std::memory_order_relaxed) == gen &&
+           end.load(std::memory_order_relaxed) < seq + CAPACITY;
+  }
+
+ private:
+  void reset(uint64_t seq) {
+    uint32_t gen = generation.load(std::memory_order_relaxed);
+    generation.store(gen + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    begin.store(seq, std::memory_order_relaxed);
+    end.store(seq, std::memory_order_relaxed);
+    generation.store(gen + 2, std::memory_order_release);
+  }
+
+  /**
+   * @return the first slot in [lo, hi) of node i that is also in [a, b) and
+   * overlaps [first, last], or CAPACITY if none; file_size is raised to that
+   * of the slots skipped
+   */
+  uint32_t find_in(uint32_t i, uint32_t lo, uint32_t hi, uint32_t a,
+                   uint32_t b, VirtualBlockIdx first, VirtualBlockIdx last,
+                   uint64_t* file_size) const {
+    if (b <= lo || hi <= a) return CAPACITY;
+    if (a <= lo && hi <= b) {
+      Summary summary = unpack(nodes[i]);
+      if (summary.first > last || summary.last < first) {
+        *file_size = std::max(*file_size, summary.file_size);
+        return CAPACITY;
+      }
+      if (hi - lo == 1) return lo;
+    }
+    uint32_t mid = (lo + hi) / 2;
+    uint32_t found = find_in(2 * i, lo, mid, a, b, first, last, file_size);
+    if (found != CAPACITY) return found;
+    return find_in(2 * i + 1, mid, hi, a, b, first, last, file_size);
+  }
+
+  static uint64_t pack(const Summary& summary) {
+    return static_cast<uint64_t>(summary.last.get()) << 32 |
+           summary.first.get();
+  }
+
+  static Summary unpack(const Node& node) {
+    uint64_t range = node.range.load(std::memory_order_relaxed);
+    return {static_cast<uint32_t>(range), static_cast<uint32_t>(range >> 32),
+            node.file_size.load(std::memory_order_relaxed)};
+  }
+};
+
+}  // namespace madfs::dram
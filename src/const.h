@@ -48,6 +48,16 @@ constexpr static uint16_t NUM_CL_TX_ENTRY_IN_META =
 constexpr static uint16_t NUM_INLINE_TX_ENTRY =
     NUM_CL_TX_ENTRY_IN_META * NUM_TX_ENTRY_PER_CL;
 
+/*
+ * delta log
+ */
+// an unaligned write within a single block and no larger than this is logged
+// inline as a delta instead of copy-on-write of the whole block
+constexpr static uint16_t MAX_DELTA_SIZE = 512;
+// once a block has accumulated this many deltas, the next small write to it
+// goes through copy-on-write, which folds the deltas into a new block
+constexpr static uint32_t MAX_NUM_DELTAS_PER_BLOCK = 8;
+
 /*
  * bitmap
  */
@@ -77,6 +87,14 @@ constexpr static uint32_t NUM_OFFSET_QUEUE_SLOT = 16;
 constexpr static uint32_t SHM_GC_SIZE = BLOCK_SIZE;
 constexpr static uint32_t SHM_PER_THREAD_SIZE = CACHELINE_SIZE;
 constexpr static uint32_t MAX_NUM_THREADS = SHM_GC_SIZE / SHM_PER_THREAD_SIZE;
+// followed by the range locks of the adaptive concurrency control
+constexpr static uint32_t SHM_RANGE_LOCK_SIZE = BLOCK_SIZE;
+// followed by the summary of the bitmap (see BitmapSummary) and the cursor of
+// its shards (see BitmapMgr)
+constexpr static uint32_t SHM_BITMAP_SUMMARY_SIZE = 9 * BLOCK_SIZE;
+// followed by the last block claimed by an in-place append (see AppendTx)
+constexpr static uint32_t SHM_APPEND_CLAIM_SIZE = BLOCK_SIZE;
 constexpr static uint32_t SHM_SIZE =
-    NUM_BITMAP_BLOCKS * BLOCK_SIZE + SHM_GC_SIZE;
+    NUM_BITMAP_BLOCKS * BLOCK_SIZE + SHM_GC_SIZE + SHM_RANGE_LOCK_SIZE +
+    SHM_BITMAP_SUMMARY_SIZE + SHM_APPEND_CLAIM_SIZE;
 }  // namespace madfs
@@ -24,7 +24,8 @@ class Converter {
     PANIC_IF(ret, "Fail to fstat");
 
     if (stat_buf.st_size == 0) {
-      return new dram::File(fd, stat_buf, O_RDWR, pathname);
+      return new dram::File(fd, stat_buf, O_RDWR, pathname,
+                            /*shared_blk_table*/ false);
     }
 
     uint64_t block_align_size = ALIGN_UP(stat_buf.st_size, BLOCK_SIZE);
@@ -53,7 +54,8 @@ class Converter {
 
     // first mark all these blocks as used, so that they won't be occupied by
     // allocator when preparing log entries
-    dram::File* file = new dram::File(fd, stat_buf, O_RDWR, pathname);
+    dram::File* file = new dram::File(fd, stat_buf, O_RDWR, pathname,
+                                      /*shared_blk_table*/ false);
     dram::Allocator* allocator = file->get_local_allocator();
     allocator->block.return_free_list();
     uint32_t num_bitmaps_full =
@@ -155,12 +157,11 @@ class Converter {
     PANIC_IF(new_region == MAP_FAILED, "Fail to mmap the new region");
 
     // copy data to the new region
+    char block_buf[BLOCK_SIZE];
     for (VirtualBlockIdx vidx = 0; vidx < virtual_num_blocks; ++vidx)
-      pmem::memcpy_persist(
-          new_region[vidx.get()].data_rw(),
-          file->mem_table.lidx_to_addr_ro(file->blk_table.vidx_to_lidx(vidx))
-              ->data_ro(),
-          BLOCK_SIZE);
+      pmem::memcpy_persist(new_region[vidx.get()].data_rw(),
+                           file->blk_table.get_block_ro(vidx, block_buf),
+                           BLOCK_SIZE);
 
     fence();
 
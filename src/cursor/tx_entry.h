@@ -93,6 +93,41 @@ struct TxCursor {
     return handle_overflow(mem_table, allocator, into_new_block);
   }
 
+  /**
+   * @return the position of the entry in the tx history, which increases along
+   * the history; not dense, since the meta block holds fewer entries
+   */
+  [[nodiscard]] uint64_t get_seq() const {
+    uint32_t tx_seq = idx.is_inline() ? pmem::MetaBlock::get_tx_seq()
+                                      : block->get_tx_seq();
+    return static_cast<uint64_t>(tx_seq) * NUM_TX_ENTRY_PER_BLOCK +
+           idx.local_idx;
+  }
+
+  /**
+   * Move the cursor forward to the entry at position seq (see get_seq), which
+   * must be in the tx history already, or right after the end of a tx block,
+   * in which case the cursor is left in an overflow state
+   *
+   * @param[out] into_new_block if not nullptr, return whether the cursor is
+   * advanced into a new tx block
+   * @return false if the history ends before it
+   */
+  bool skip_to(MemTable* mem_table, uint64_t seq,
+               bool* into_new_block = nullptr) {
+    if (into_new_block) *into_new_block = false;
+    while (true) {
+      uint64_t block_seq = get_seq() - idx.local_idx;
+      if (seq <= block_seq + idx.get_capacity()) {
+        idx.local_idx = static_cast<TxLocalIdx>(seq - block_seq);
+        return true;
+      }
+      idx.local_idx = idx.get_capacity();
+      if (!handle_overflow(mem_table)) return false;
+      if (into_new_block) *into_new_block = true;
+    }
+  }
+
   /**
    * Try to commit a tx entry to the current cursor
    *
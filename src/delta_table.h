@@ -0,0 +1,479 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "const.h"
+#include "extent_table.h"
+#include "idx.h"
+#include "utils/table_array.h"
+#include "utils/utils.h"
+
+namespace madfs::dram {
+
+/**
+ * A delta (see pmem::LogEntry::Op::LOG_DELTA) copied from the log. Deltas of
+ * the same virtual block form a chain from the newest to the oldest. A node is
+ * immutable once published until its chain is dropped, after which it is
+ * reused for other deltas (see DeltaTable).
+ */
+struct DeltaNode {
+  // the previous node in the chain (see DeltaTable::get_prev); 0 if none.
+  // Once freed, the next node in the free list instead.
+  uint32_t prev;
+  // the number of deltas in the chain ending at this node. Once freed, the
+  // previous node in the free list instead.
+  uint32_t num_deltas;
+  uint16_t local_offset;
+  uint16_t size;
+  // the size of the node in units of 8 bytes (see DeltaTable::SLOT_WORDS)
+  uint16_t num_words;
+  char data[];
+};
+
+/**
+ * The deltas not yet folded into the mapped logical blocks, i.e., the newest
+ * DeltaNode of each virtual block.
+ *
+ * Like ExtentTable, there is a single writer and lock-free readers, and it can
+ * be placed in shared memory: the heads are grouped by the leaves of the
+ * ExtentTable, and the nodes are allocated from chunks and referred to by
+ * their offsets in units of 8 bytes.
+ *
+ * The nodes of a dropped chain (i.e., folded into a new mapping) are freed and
+ * reused, so the memory follows the deltas not yet folded rather than all the
+ * deltas ever written. A chunk is divided into slots, each of which holds one
+ * node of the largest size or is split into smaller nodes of the same size; a
+ * slot goes back to the pool once all of its nodes are free, so that no mix of
+ * sizes can leave the memory too fragmented for the next delta.
+ *
+ * A reader may still be walking a chain that is dropped. As with a seqlock,
+ * the writer bumps the generation before it changes any freed node, and the
+ * reader retries if the generation changes.
+ */
+class DeltaTable : noncopyable {
+ public:
+  static constexpr uint32_t CHUNK_SIZE = 64 << 10;
+  static constexpr uint32_t SLOT_WORDS = 72;
+  static constexpr uint32_t NUM_CLASSES = 4;
+
+  struct Chunk {
+    alignas(8) char data[CHUNK_SIZE];
+  };
+
+  struct Leaf {
+    std::atomic<uint32_t> heads[ExtentTable::LEAF_BLOCKS];
+  };
+
+  struct Counters {
+    std::atomic<uint32_t> num_slots;
+    std::atomic<uint32_t> num_leaves;
+    std::atomic<uint32_t> num_chunks;
+    // the number of virtual blocks with deltas, so that the common case of no
+    // deltas at all does not need to look up the heads; never lower than the
+    // actual number
+    std::atomic<uint32_t> num_blocks;
+    // the number of node slots ever carved from the chunks, and the number of
+    // those holding any node in use
+    std::atomic<uint32_t> num_node_slots;
+    std::atomic<uint32_t> num_used_node_slots;
+    // bumped before the nodes of a dropped chain are changed
+    std::atomic<uint64_t> generation;
+    // the free nodes of each class, as a doubly-linked list; 0 if empty. The
+    // free slots are in the one of the largest class.
+    std::atomic<uint32_t> free_nodes[NUM_CLASSES];
+  };
+
+  /**
+   * The number of nodes in use in each slot, which is unused for the slots
+   * holding a single node
+   */
+  using SlotUsage = uint8_t;
+
+  /**
+   * The layout of a table in shared memory, where up to MAX_HEADS of the
+   * MAX_LEAVES leaves of the ExtentTable have deltas; see ExtentTable::Shared
+   */
+  template <uint32_t MAX_LEAVES, uint32_t MAX_HEADS, uint32_t MAX_CHUNKS>
+  struct Shared {
+    Counters counters;
+    std::atomic<uint32_t> slots[MAX_LEAVES];
+    // index 0 is never used
+    Leaf leaves[MAX_HEADS + 1];
+    Chunk chunks[MAX_CHUNKS];
+    SlotUsage slot_usages[MAX_CHUNKS * (CHUNK_SIZE / 8 / SLOT_WORDS)];
+  };
+
+ private:
+  static constexpr uint32_t CHUNK_WORDS = CHUNK_SIZE / 8;
+  static constexpr uint32_t SLOTS_PER_CHUNK = CHUNK_WORDS / SLOT_WORDS;
+  // the nodes of class c take SLOT_WORDS >> c words, so a slot holds 1 << c
+  static_assert(sizeof(DeltaNode) + MAX_DELTA_SIZE <= SLOT_WORDS * 8);
+  static_assert((SLOT_WORDS >> (NUM_CLASSES - 1)) * 8 > sizeof(DeltaNode));
+  // a chain longer than this is torn, since a block gets no more deltas once
+  // it has MAX_NUM_DELTAS_PER_BLOCK
+  static constexpr uint32_t MAX_CHAIN_LENGTH = 1 << 16;
+
+  Counters own_counters{};
+  Counters* counters{&own_counters};
+  // the index of the heads of each ExtentTable leaf; 0 if none
+  TableArray<std::atomic<uint32_t>> slots{&own_counters.num_slots};
+  TableArray<Leaf> leaves{&own_counters.num_leaves};
+  TableArray<Chunk> chunks{&own_counters.num_chunks};
+  TableArray<SlotUsage> slot_usages{&own_counters.num_node_slots};
+  // the number of chunks that can be allocated; limited by the 32-bit offsets
+  // for the heap
+  uint32_t max_chunks{UINT32_MAX / CHUNK_WORDS};
+
+ public:
+  DeltaTable() = default;
+
+  /**
+   * Use a table in shared memory instead of the heap; this one must be empty
+   */
+  template <uint32_t MAX_LEAVES, uint32_t MAX_HEADS, uint32_t MAX_CHUNKS>
+  void attach(Shared<MAX_LEAVES, MAX_HEADS, MAX_CHUNKS>* shared) {
+    counters = &shared->counters;
+    slots.attach(shared->slots, MAX_LEAVES, &counters->num_slots);
+    leaves.attach(shared->leaves, MAX_HEADS + 1, &counters->num_leaves);
+    chunks.attach(shared->chunks, MAX_CHUNKS, &counters->num_chunks);
+    slot_usages.attach(shared->slot_usages, MAX_CHUNKS * SLOTS_PER_CHUNK,
+                       &counters->num_node_slots);
+    max_chunks = MAX_CHUNKS;
+  }
+
+  [[nodiscard]] uint32_t num_blocks() const {
+    return counters->num_blocks.load(std::memory_order_acquire);
+  }
+
+  /**
+   * @return whether more than three quarters of the memory for nodes is in
+   * use, in which case new deltas should be avoided until some are folded; the
+   * rest is left for the deltas already committed
+   */
+  [[nodiscard]] bool is_almost_full() const {
+    return counters->num_used_node_slots.load(std::memory_order_relaxed) >
+           max_chunks / 4 * 3 * SLOTS_PER_CHUNK;
+  }
+
+  /**
+   * @return the bytes of memory allocated for the nodes
+   */
+  [[nodiscard]] size_t get_memory() const {
+    return size_t{chunks.size()} * CHUNK_SIZE;
+  }
+
+  [[nodiscard]] bool has_deltas(VirtualBlockIdx vidx) const {
+    return load_head(vidx) != 0;
+  }
+
+  [[nodiscard]] uint32_t get_num_deltas(VirtualBlockIdx vidx) const {
+    while (true) {
+      uint64_t generation = begin_read();
+      uint32_t node_off = load_head(vidx);
+      if (node_off == 0) return 0;
+      const DeltaNode* node = get_node_checked(node_off);
+      uint32_t num_deltas = node ? node->num_deltas : 0;
+      if (end_read(generation) && node) return num_deltas;
+    }
+  }
+
+  /**
+   * Apply the deltas of the virtual block to a buffer holding bytes
+   * [begin, end) of the block, the older ones first
+   */
+  void apply(VirtualBlockIdx vidx, char* buf, size_t begin, size_t end) const {
+    // the bytes in range, the newer deltas first; they are copied out of the
+    // nodes before being applied, since the nodes may be reused meanwhile
+    struct Piece {
+      size_t begin;
+      size_t end;
+      size_t bytes_offset;
+    };
+    static thread_local std::vector<Piece> pieces;
+    static thread_local std::vector<char> bytes;
+
+    while (true) {
+      uint64_t generation = begin_read();
+      pieces.clear();
+      bytes.clear();
+      bool is_torn = false;
+      uint32_t node_off = load_head(vidx);
+      for (uint32_t i = 0; node_off != 0; ++i) {
+        const DeltaNode* node = get_node_checked(node_off);
+        if (!node || i == MAX_CHAIN_LENGTH) {
+          is_torn = true;
+          break;
+        }
+        size_t local_offset = node->local_offset;
+        size_t delta_begin = std::max(local_offset, begin);
+        size_t delta_end = std::min<size_t>(local_offset + node->size, end);
+        if (delta_begin < delta_end) {
+          const char* data = node->data + (delta_begin - local_offset);
+          pieces.push_back({delta_begin, delta_end, bytes.size()});
+          bytes.insert(bytes.end(), data, data + (delta_end - delta_begin));
+        }
+        node_off = node->prev;
+      }
+      if (!end_read(generation) || is_torn) continue;
+
+      for (auto it = pieces.rbegin(); it != pieces.rend(); ++it)
+        std::memcpy(buf + (it->begin - begin), bytes.data() + it->bytes_offset,
+                    it->end - it->begin);
+      return;
+    }
+  }
+
+  /**
+   * @return the newest delta of the virtual block; nullptr if none. The chain
+   * may be reused once dropped, so it must not race with the writer.
+   */
+  [[nodiscard]] const DeltaNode* get_head(VirtualBlockIdx vidx) const {
+    return get_node(load_head(vidx));
+  }
+
+  [[nodiscard]] const DeltaNode* get_prev(const DeltaNode* node) const {
+    return get_node(node->prev);
+  }
+
+  /**
+   * Add a delta to the virtual block; must be called by the single writer
+   *
+   * @return false if there is no memory left for it, in which case nothing is
+   * changed
+   */
+  [[nodiscard]] bool add(VirtualBlockIdx vidx, uint16_t local_offset,
+                         uint16_t size, const char* data) {
+    std::atomic<uint32_t>* head = get_or_create_head(vidx);
+    if (!head) return false;
+    uint32_t node_off = alloc_node(get_class(size));
+    if (node_off == 0) return false;
+
+    uint32_t prev = head->load(std::memory_order_relaxed);
+    DeltaNode* node = get_node(node_off);
+    node->prev = prev;
+    node->num_deltas = prev ? get_node(prev)->num_deltas + 1 : 1;
+    node->local_offset = local_offset;
+    node->size = size;
+    std::memcpy(node->data, data, size);
+
+    if (!prev) counters->num_blocks.fetch_add(1, std::memory_order_release);
+    head->store(node_off, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Drop the deltas of the virtual block, e.g., since a new mapping of it makes
+   * them obsolete, and free their nodes; must be called by the single writer
+   */
+  void clear(VirtualBlockIdx vidx) {
+    if (counters->num_blocks.load(std::memory_order_relaxed) == 0) return;
+    uint32_t slot = vidx >> ExtentTable::LEAF_SHIFT;
+    if (slot >= slots.size()) return;
+    uint32_t leaf_idx = slots[slot].load(std::memory_order_relaxed);
+    if (leaf_idx == 0) return;
+    auto& head =
+        leaves[leaf_idx].heads[vidx & (ExtentTable::LEAF_BLOCKS - 1)];
+    uint32_t node_off = head.load(std::memory_order_relaxed);
+    if (node_off == 0) return;
+    head.store(0, std::memory_order_relaxed);
+    counters->num_blocks.fetch_sub(1, std::memory_order_relaxed);
+
+    // a reader that sees the new generation does not see the chain, and one
+    // that does not must see it before any node is changed
+    counters->generation.fetch_add(1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_release);
+    while (node_off != 0) {
+      uint32_t prev = get_node(node_off)->prev;
+      free_node(node_off);
+      node_off = prev;
+    }
+  }
+
+  /**
+   * Call fn(vidx, head) on each virtual block with deltas, in the order of
+   * vidx; must not race with the writer
+   */
+  template <typename Fn>
+  void for_each_head(Fn&& fn) const {
+    if (num_blocks() == 0) return;
+    for (uint32_t slot = 0; slot < slots.size(); ++slot) {
+      uint32_t leaf_idx = slots[slot].load(std::memory_order_relaxed);
+      if (leaf_idx == 0) continue;
+      for (uint32_t i = 0; i < ExtentTable::LEAF_BLOCKS; ++i) {
+        uint32_t node =
+            leaves[leaf_idx].heads[i].load(std::memory_order_relaxed);
+        if (node)
+          fn(VirtualBlockIdx(slot << ExtentTable::LEAF_SHIFT | i),
+             get_node(node));
+      }
+    }
+  }
+
+ private:
+  // the smallest class whose nodes can hold size bytes
+  static uint32_t get_class(uint16_t size) {
+    uint32_t c = NUM_CLASSES - 1;
+    while (sizeof(DeltaNode) + size > get_num_words(c) * 8) --c;
+    return c;
+  }
+
+  static uint32_t get_num_words(uint32_t c) { return SLOT_WORDS >> c; }
+
+  static uint32_t get_slot_off(uint32_t slot_idx) {
+    return slot_idx / SLOTS_PER_CHUNK * CHUNK_WORDS +
+           slot_idx % SLOTS_PER_CHUNK * SLOT_WORDS;
+  }
+
+  static uint32_t get_slot_idx(uint32_t node_off) {
+    return node_off / CHUNK_WORDS * SLOTS_PER_CHUNK +
+           node_off % CHUNK_WORDS / SLOT_WORDS;
+  }
+
+  [[nodiscard]] uint64_t begin_read() const {
+    return counters->generation.load(std::memory_order_acquire);
+  }
+
+  // @return whether no node read since begin_read may have been changed
+  [[nodiscard]] bool end_read(uint64_t generation) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return counters->generation.load(std::memory_order_relaxed) == generation;
+  }
+
+  [[nodiscard]] uint32_t load_head(VirtualBlockIdx vidx) const {
+    if (num_blocks() == 0) return 0;
+    uint32_t slot = vidx >> ExtentTable::LEAF_SHIFT;
+    if (slot >= slots.size()) return 0;
+    uint32_t leaf_idx = slots[slot].load(std::memory_order_acquire);
+    if (leaf_idx == 0) return 0;
+    return leaves[leaf_idx]
+        .heads[vidx & (ExtentTable::LEAF_BLOCKS - 1)]
+        .load(std::memory_order_acquire);
+  }
+
+  [[nodiscard]] const DeltaNode* get_node(uint32_t node_off) const {
+    if (node_off == 0) return nullptr;
+    return reinterpret_cast<const DeltaNode*>(
+        chunks[node_off / CHUNK_WORDS].data + node_off % CHUNK_WORDS * 8);
+  }
+
+  DeltaNode* get_node(uint32_t node_off) {
+    return const_cast<DeltaNode*>(std::as_const(*this).get_node(node_off));
+  }
+
+  /**
+   * @return the node; nullptr if it is not a valid one, which is only possible
+   * if it is changed while being read
+   */
+  [[nodiscard]] const DeltaNode* get_node_checked(uint32_t node_off) const {
+    if (node_off / CHUNK_WORDS >= chunks.size()) return nullptr;
+    const DeltaNode* node = get_node(node_off);
+    uint32_t num_words = node->num_words;
+    uint32_t size = node->size;
+    if (num_words > SLOT_WORDS || sizeof(DeltaNode) + size > num_words * 8 ||
+        node->local_offset + size > BLOCK_SIZE)
+      return nullptr;
+    return node;
+  }
+
+  /**
+   * @return the offset of a free node of class c; 0 if there is no memory left
+   */
+  uint32_t alloc_node(uint32_t c) {
+    if (c > 0) {
+      if (uint32_t node_off = pop_free_node(c)) {
+        slot_usages[get_slot_idx(node_off)]++;
+        return node_off;
+      }
+    }
+
+    // take a free slot, or carve a new one
+    uint32_t slot_off = pop_free_node(0);
+    if (slot_off == 0) {
+      uint32_t slot_idx = std::max(slot_usages.size(), 1u);
+      if (slot_idx / SLOTS_PER_CHUNK >= max_chunks) return 0;
+      chunks.grow_to(slot_idx / SLOTS_PER_CHUNK + 1);
+      slot_usages.grow_to(slot_idx + 1);
+      slot_off = get_slot_off(slot_idx);
+    }
+    counters->num_used_node_slots.fetch_add(1, std::memory_order_relaxed);
+
+    // split the slot into nodes of class c and keep the first one
+    uint32_t num_words = get_num_words(c);
+    for (uint32_t i = 0; i < (1u << c); ++i)
+      get_node(slot_off + i * num_words)->num_words =
+          static_cast<uint16_t>(num_words);
+    for (uint32_t i = 1; i < (1u << c); ++i)
+      push_free_node(c, slot_off + i * num_words);
+    slot_usages[get_slot_idx(slot_off)] = 1;
+    return slot_off;
+  }
+
+  void free_node(uint32_t node_off) {
+    uint32_t num_words = get_node(node_off)->num_words;
+    uint32_t c = 0;
+    while (get_num_words(c) != num_words) ++c;
+    uint32_t slot_idx = get_slot_idx(node_off);
+    if (c > 0 && --slot_usages[slot_idx] > 0) {
+      push_free_node(c, node_off);
+      return;
+    }
+
+    // the slot is free as a whole: take its other nodes off their list
+    uint32_t slot_off = get_slot_off(slot_idx);
+    for (uint32_t i = 0; i < (1u << c); ++i)
+      if (slot_off + i * num_words != node_off)
+        unlink_free_node(c, slot_off + i * num_words);
+    get_node(slot_off)->num_words = SLOT_WORDS;
+    push_free_node(0, slot_off);
+    counters->num_used_node_slots.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  void push_free_node(uint32_t c, uint32_t node_off) {
+    std::atomic<uint32_t>& free_head = counters->free_nodes[c];
+    uint32_t next = free_head.load(std::memory_order_relaxed);
+    DeltaNode* node = get_node(node_off);
+    node->prev = next;
+    node->num_deltas = 0;
+    if (next) get_node(next)->num_deltas = node_off;
+    free_head.store(node_off, std::memory_order_relaxed);
+  }
+
+  uint32_t pop_free_node(uint32_t c) {
+    uint32_t node_off = counters->free_nodes[c].load(std::memory_order_relaxed);
+    if (node_off) unlink_free_node(c, node_off);
+    return node_off;
+  }
+
+  void unlink_free_node(uint32_t c, uint32_t node_off) {
+    DeltaNode* node = get_node(node_off);
+    uint32_t next = node->prev, prev = node->num_deltas;
+    if (prev)
+      get_node(prev)->prev = next;
+    else
+      counters->free_nodes[c].store(next, std::memory_order_relaxed);
+    if (next) get_node(next)->num_deltas = prev;
+  }
+
+  // @return the head of the virtual block; nullptr if there is no room left
+  std::atomic<uint32_t>* get_or_create_head(VirtualBlockIdx vidx) {
+    uint32_t slot = vidx >> ExtentTable::LEAF_SHIFT;
+    if (slot >= slots.capacity()) return nullptr;
+    if (slot >= slots.size())
+      slots.grow_to(std::min(next_pow2(slot), slots.capacity()));
+    uint32_t leaf_idx = slots[slot].load(std::memory_order_relaxed);
+    if (leaf_idx == 0) {
+      leaf_idx = std::max(leaves.size(), 1u);
+      if (leaf_idx >= leaves.capacity()) return nullptr;
+      leaves.grow_to(leaf_idx + 1);
+      slots[slot].store(leaf_idx, std::memory_order_release);
+    }
+    return &leaves[leaf_idx].heads[vidx & (ExtentTable::LEAF_BLOCKS - 1)];
+  }
+};
+
+}  // namespace madfs::dram
@@ -11,14 +11,35 @@
 
 namespace madfs::pmem {
 
+/**
+ * The payload of a LOG_DELTA log entry. It is placed right after the only
+ * element of begin_lidxs and carries the bytes written inline.
+ */
+struct LogDelta {
+  // the starting offset within the block
+  uint16_t local_offset;
+  // the number of bytes in data; at most MAX_DELTA_SIZE
+  uint16_t size;
+  char data[];
+};
+
+static_assert(sizeof(LogDelta) == 4);
+
 // NOTE: assume for a linked list of LogEntry is sorted by their virtual index
 // BlkTable uses some assumption to simply implementation
 struct LogEntry {
   /*** define LogEntry-specific struct ***/
-  enum class Op {
+  // the underlying type must be unsigned; otherwise, values >= 2 cannot be
+  // stored in the 2-bit field below
+  enum class Op : uint8_t {
     LOG_INVALID = 0,
     // we start the enum from 1 so that a LogOp with value 0 is invalid
     LOG_OVERWRITE = 1,
+    // a small byte range of a single block written inline in the log entry;
+    // the mapping of the block is not changed. num_blocks is always 1,
+    // begin_lidxs[0] is the logical block when the delta was written (only for
+    // debugging), and a LogDelta follows it.
+    LOG_DELTA = 2,
   };
 
   /*** define actual LogEntry layout ***/
@@ -79,8 +100,27 @@ struct LogEntry {
     return num_blocks % BITMAP_ENTRY_BLOCKS_CAPACITY;
   }
 
+  [[nodiscard]] bool is_delta() const { return op == Op::LOG_DELTA; }
+
+  [[nodiscard]] LogDelta* get_delta() {
+    assert(is_delta());
+    return reinterpret_cast<LogDelta*>(&begin_lidxs[1]);
+  }
+
+  [[nodiscard]] const LogDelta* get_delta() const {
+    assert(is_delta());
+    return reinterpret_cast<const LogDelta*>(&begin_lidxs[1]);
+  }
+
+  // the size of a LOG_DELTA entry carrying `size` bytes of data
+  constexpr static uint32_t get_delta_entry_size(uint16_t size) {
+    return FIXED_SIZE + sizeof(LogicalBlockIdx) + sizeof(LogDelta) + size;
+  }
+
   void persist() {
-    auto size = FIXED_SIZE + sizeof(LogicalBlockIdx) * get_lidxs_len();
+    auto size = is_delta()
+                    ? get_delta_entry_size(get_delta()->size)
+                    : FIXED_SIZE + sizeof(LogicalBlockIdx) * get_lidxs_len();
     persist_unfenced(this, size);
   }
 
@@ -90,6 +130,14 @@ struct LogEntry {
 
   friend std::ostream& operator<<(std::ostream& out, const LogEntry& entry) {
     out << "LogEntry{";
+    if (entry.is_delta()) {
+      const LogDelta* delta = entry.get_delta();
+      out << "delta, vidx=" << entry.begin_vidx << ", ";
+      out << "lidx=" << entry.begin_lidxs[0] << ", ";
+      out << "local_offset=" << delta->local_offset << ", ";
+      out << "size=" << delta->size << "}";
+      return out;
+    }
     out << "n_blk=" << entry.num_blocks << ", ";
     out << "vidx=" << entry.begin_vidx << ", ";
     out << "lidxs=[" << entry.begin_lidxs[0];
@@ -197,10 +245,39 @@ struct __attribute__((packed)) TxEntryInline {
 static_assert(sizeof(TxEntryInline) == TX_ENTRY_SIZE,
               "TxEntryInline must be 64 bits");
 
+/**
+ * Extends the file size without changing any mapping, e.g., after an in-place
+ * append into the last block. It is an inline entry with zero num_blocks, so
+ * a dummy entry is a size entry that never extends the file.
+ */
+struct __attribute__((packed)) TxEntrySize {
+  constexpr static const int FILE_SIZE_BITS = 57;
+
+  friend union TxEntry;
+
+ private:
+  bool is_inline : 1 = true;
+  uint32_t num_blocks : TxEntryInline::NUM_BLOCKS_BITS = 0;
+
+ public:
+  uint64_t file_size : FILE_SIZE_BITS;
+
+  explicit TxEntrySize(uint64_t file_size) : file_size(file_size) {}
+
+  friend std::ostream& operator<<(std::ostream& out, const TxEntrySize& entry) {
+    out << "TxEntrySize{" << entry.file_size << "}";
+    return out;
+  }
+};
+
+static_assert(sizeof(TxEntrySize) == TX_ENTRY_SIZE,
+              "TxEntrySize must be 64 bits");
+
 union TxEntry {
   uint64_t raw_bits;
   TxEntryIndirect indirect_entry;
   TxEntryInline inline_entry;
+  TxEntrySize size_entry;
   struct {
     bool is_inline : 1;
     uint64_t payload : 63;
@@ -212,13 +289,18 @@ union TxEntry {
   TxEntry(uint64_t raw_bits) : raw_bits(raw_bits) {}
   TxEntry(TxEntryIndirect indirect_entry) : indirect_entry(indirect_entry) {}
   TxEntry(TxEntryInline inline_entry) : inline_entry(inline_entry) {}
+  TxEntry(TxEntrySize size_entry) : size_entry(size_entry) {}
 
   [[nodiscard]] bool is_inline() const { return fields.is_inline; }
 
   [[nodiscard]] bool is_valid() const { return raw_bits != 0; }
 
-  [[nodiscard]] bool is_dummy() const {
+  [[nodiscard]] bool is_size() const {
     return is_inline() && inline_entry.num_blocks == 0;
+  }
+
+  [[nodiscard]] bool is_dummy() const {
+    return is_size() && size_entry.file_size == 0;
   };
 
   /**
@@ -238,13 +320,15 @@ union TxEntry {
   }
 
   // if we are touching a new cacheline, we must flush everything before it
-  // if only flush at fsync, always return false
+  // if only flush at fsync or never flush (eADR), always return false
   static bool need_flush(TxLocalIdx idx) {
-    if constexpr (BuildOptions::tx_flush_only_fsync) return false;
+    if (runtime_options.tx_flush_only_fsync) return false;
+    if (kernels.flush == Kernels::Flush::NONE) return false;
     return IS_ALIGNED(sizeof(TxEntry) * idx, CACHELINE_SIZE);
   }
 
   friend std::ostream& operator<<(std::ostream& out, const TxEntry& tx_entry) {
+    if (tx_entry.is_size()) return out << tx_entry.size_entry;
     return tx_entry.is_inline() ? out << tx_entry.inline_entry
                                 : out << tx_entry.indirect_entry;
   }
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+#include "const.h"
+#include "idx.h"
+#include "utils/table_array.h"
+#include "utils/utils.h"
+
+namespace madfs::dram {
+
+/**
+ * A run of virtual blocks mapped to contiguous logical blocks; lidx is 0 for
+ * a run of unmapped virtual blocks
+ */
+struct Extent {
+  LogicalBlockIdx lidx;
+  uint32_t num_blocks;
+};
+
+/**
+ * The mapping from virtual blocks to logical blocks, as a two-level radix tree.
+ *
+ * Each leaf covers LEAF_BLOCKS virtual blocks. It starts as a short sorted
+ * list of extents, so a file written in large runs costs a few words per leaf
+ * instead of one per block. A leaf that becomes too fragmented for the list is
+ * turned into a flat array of logical blocks for good.
+ *
+ * There is a single writer at a time (i.e., the one holding the lock of
+ * BlkTable), while readers take no lock. The list of a leaf is never modified
+ * in place: the writer fills in a free leaf and then swaps it into the slot,
+ * so a reader only checks that the leaf it read was not reused meanwhile. The
+ * flat array is modified and read entry by entry.
+ *
+ * Leaves refer to each other by indices rather than pointers, so that the
+ * table can also live in shared memory (see attach).
+ */
+class ExtentTable : noncopyable {
+ public:
+  static constexpr uint32_t LEAF_SHIFT = 9;
+  static constexpr uint32_t LEAF_BLOCKS = 1 << LEAF_SHIFT;
+
+ private:
+  // an extent within a leaf, packed so that it can be read atomically:
+  // lidx in the upper 32 bits, then the offset in the leaf and the length
+  using PackedExtent = uint64_t;
+  static constexpr uint32_t MAX_EXTENTS = 14;
+
+  struct LeafExtent {
+    uint32_t offset;
+    uint32_t num_blocks;
+    LogicalBlockIdx lidx;
+
+    [[nodiscard]] uint32_t end() const { return offset + num_blocks; }
+  };
+
+ public:
+  struct FlatLeaf {
+    std::atomic<LogicalBlockIdx> lidxs[LEAF_BLOCKS];
+  };
+
+  struct Leaf {
+    // odd while the leaf is being filled in; a reader retries if it changes
+    std::atomic<uint32_t> version;
+    std::atomic<uint32_t> num_extents;
+    // if non-zero, the index of the flat array and the list is not used
+    std::atomic<uint32_t> flat;
+    // the next leaf in the free list
+    uint32_t next_free;
+    // sorted by offset and non-overlapping; gaps are unmapped
+    std::atomic<PackedExtent> extents[MAX_EXTENTS];
+  };
+
+  static_assert(sizeof(Leaf) == 2 * CACHELINE_SIZE);
+
+  struct Counters {
+    std::atomic<uint32_t> num_slots;
+    std::atomic<uint32_t> num_leaves;
+    std::atomic<uint32_t> num_flats;
+    // the head of the free list of leaves; 0 if empty
+    std::atomic<uint32_t> free_leaf;
+  };
+
+  /**
+   * The layout of a table in shared memory, for up to MAX_LEAVES leaves (i.e.,
+   * MAX_LEAVES * LEAF_BLOCKS virtual blocks), of which up to MAX_FLATS are
+   * flat; zero-filled memory is an empty table
+   */
+  template <uint32_t MAX_LEAVES, uint32_t MAX_FLATS>
+  struct Shared {
+    Counters counters;
+    std::atomic<uint32_t> slots[MAX_LEAVES];
+    // index 0 is never used, and one more is being filled in at a time
+    Leaf leaves[MAX_LEAVES + 2];
+    FlatLeaf flats[MAX_FLATS + 1];
+  };
+
+ private:
+  Counters own_counters{};
+  Counters* counters{&own_counters};
+  // the index of the leaf of each LEAF_BLOCKS virtual blocks; 0 if none
+  TableArray<std::atomic<uint32_t>> slots{&own_counters.num_slots};
+  TableArray<Leaf> leaves{&own_counters.num_leaves};
+  TableArray<FlatLeaf> flats{&own_counters.num_flats};
+
+ public:
+  ExtentTable() = default;
+
+  /**
+   * Use a table in shared memory instead of the heap; this one must be empty
+   */
+  template <uint32_t MAX_LEAVES, uint32_t MAX_FLATS>
+  void attach(Shared<MAX_LEAVES, MAX_FLATS>* shared) {
+    counters = &shared->counters;
+    slots.attach(shared->slots, MAX_LEAVES, &counters->num_slots);
+    leaves.attach(shared->leaves, MAX_LEAVES + 2, &counters->num_leaves);
+    flats.attach(shared->flats, MAX_FLATS + 1, &counters->num_flats);
+  }
+
+  /**
+   * @return the logical block mapped to vidx; 0 if unmapped
+   */
+  [[nodiscard]] LogicalBlockIdx get(VirtualBlockIdx vidx) const {
+    uint32_t offset = vidx & (LEAF_BLOCKS - 1);
+    while (true) {
+      uint32_t leaf_idx = get_leaf_idx(vidx);
+      if (!leaf_idx) return 0;
+      const Leaf* leaf = &leaves[leaf_idx];
+      uint32_t version = leaf->version.load(std::memory_order_acquire);
+      if (version & 1) continue;
+
+      LogicalBlockIdx lidx = 0;
+      if (uint32_t flat = leaf->flat.load(std::memory_order_relaxed)) {
+        lidx = flats[flat].lidxs[offset].load(std::memory_order_relaxed);
+      } else {
+        uint32_t num_extents =
+            std::min(leaf->num_extents.load(std::memory_order_relaxed),
+                     MAX_EXTENTS);
+        for (uint32_t i = 0; i < num_extents; ++i) {
+          LeafExtent e = load_extent(leaf, i);
+          if (e.offset > offset) break;
+          if (offset < e.end()) {
+            lidx = e.lidx + (offset - e.offset);
+            break;
+          }
+        }
+      }
+      if (is_unchanged(vidx, leaf_idx, version)) return lidx;
+    }
+  }
+
+  /**
+   * @return the run that begins at vidx; it never crosses a leaf boundary
+   */
+  [[nodiscard]] Extent get_extent(VirtualBlockIdx vidx) const {
+    uint32_t offset = vidx & (LEAF_BLOCKS - 1);
+    while (true) {
+      uint32_t leaf_idx = get_leaf_idx(vidx);
+      if (!leaf_idx) return {0, LEAF_BLOCKS - offset};
+      const Leaf* leaf = &leaves[leaf_idx];
+      uint32_t version = leaf->version.load(std::memory_order_acquire);
+      if (version & 1) continue;
+
+      Extent extent{0, LEAF_BLOCKS - offset};
+      if (uint32_t flat = leaf->flat.load(std::memory_order_relaxed)) {
+        auto load = [&](uint32_t i) {
+          return flats[flat].lidxs[i].load(std::memory_order_relaxed);
+        };
+        LogicalBlockIdx lidx = load(offset);
+        uint32_t end = offset + 1;
+        while (end < LEAF_BLOCKS &&
+               load(end) == (lidx == 0 ? lidx : lidx + (end - offset)))
+          ++end;
+        extent = {lidx, end - offset};
+      } else {
+        uint32_t num_extents =
+            std::min(leaf->num_extents.load(std::memory_order_relaxed),
+                     MAX_EXTENTS);
+        for (uint32_t i = 0; i < num_extents; ++i) {
+          LeafExtent e = load_extent(leaf, i);
+          if (e.offset > offset) {
+            extent.num_blocks = e.offset - offset;
+            break;
+          }
+          if (offset < e.end()) {
+            extent = {e.lidx + (offset - e.offset), e.end() - offset};
+            break;
+          }
+        }
+      }
+      if (is_unchanged(vidx, leaf_idx, version)) return extent;
+    }
+  }
+
+  /**
+   * Map [vidx, vidx + num_blocks) to [lidx, lidx + num_blocks); must be called
+   * by the single writer
+   *
+   * @return false if a table in shared memory has no room left for it, in
+   * which case only the leaves before the one without room are mapped
+   */
+  bool map(VirtualBlockIdx vidx, LogicalBlockIdx lidx, uint32_t num_blocks) {
+    while (num_blocks > 0) {
+      uint32_t offset = vidx & (LEAF_BLOCKS - 1);
+      uint32_t len = std::min(num_blocks, LEAF_BLOCKS - offset);
+      if (!map_in_leaf(vidx >> LEAF_SHIFT, offset, lidx, len)) return false;
+      vidx += len;
+      lidx += len;
+      num_blocks -= len;
+    }
+    return true;
+  }
+
+  /**
+   * @return an upper bound of the mapped virtual blocks, which is a multiple
+   * of LEAF_BLOCKS
+   */
+  [[nodiscard]] uint32_t capacity() const {
+    return slots.size() * LEAF_BLOCKS;
+  }
+
+  /**
+   * Call fn(vidx, lidx, num_blocks) on each mapped run of the leaves in
+   * [begin, end), in the order of vidx; must not race with the writer
+   *
+   * @param begin the first virtual block, a multiple of LEAF_BLOCKS
+   * @param end the end of the virtual blocks, a multiple of LEAF_BLOCKS
+   */
+  template <typename Fn>
+  void for_each_extent(Fn&& fn, uint32_t begin = 0,
+                       uint32_t end = UINT32_MAX) const {
+    end = std::min(end, capacity());
+    for (uint32_t leaf_begin = begin; leaf_begin < end;
+         leaf_begin += LEAF_BLOCKS) {
+      const Leaf* leaf = get_leaf(leaf_begin);
+      if (!leaf) continue;
+      if (leaf->flat.load(std::memory_order_relaxed)) {
+        for (uint32_t offset = 0; offset < LEAF_BLOCKS;) {
+          Extent e = get_extent(leaf_begin + offset);
+          if (e.lidx != 0) fn(VirtualBlockIdx(leaf_begin + offset), e.lidx,
+                              e.num_blocks);
+          offset += e.num_blocks;
+        }
+        continue;
+      }
+      uint32_t num_extents = leaf->num_extents.load(std::memory_order_relaxed);
+      for (uint32_t i = 0; i < num_extents; ++i) {
+        LeafExtent e = load_extent(leaf, i);
+        fn(VirtualBlockIdx(leaf_begin + e.offset), e.lidx, e.num_blocks);
+      }
+    }
+  }
+
+ private:
+  static PackedExtent pack(LeafExtent e) {
+    return static_cast<uint64_t>(e.lidx.get()) << 32 | e.offset << 16 |
+           e.num_blocks;
+  }
+
+  static LeafExtent unpack(PackedExtent p) {
+    return {static_cast<uint32_t>(p >> 16) & 0xffff,
+            static_cast<uint32_t>(p) & 0xffff,
+            static_cast<uint32_t>(p >> 32)};
+  }
+
+  static LeafExtent load_extent(const Leaf* leaf, uint32_t i) {
+    return unpack(leaf->extents[i].load(std::memory_order_relaxed));
+  }
+
+  [[nodiscard]] uint32_t get_leaf_idx(VirtualBlockIdx vidx) const {
+    uint32_t slot = vidx >> LEAF_SHIFT;
+    if (slot >= slots.size()) return 0;
+    return slots[slot].load(std::memory_order_acquire);
+  }
+
+  [[nodiscard]] const Leaf* get_leaf(VirtualBlockIdx vidx) const {
+    uint32_t leaf_idx = get_leaf_idx(vidx);
+    return leaf_idx ? &leaves[leaf_idx] : nullptr;
+  }
+
+  /**
+   * @return whether the leaf read at the given version is still intact and
+   * still belongs to the slot of vidx; a leaf freed and reused for another
+   * slot in between can be intact at the same version
+   */
+  [[nodiscard]] bool is_unchanged(VirtualBlockIdx vidx, uint32_t leaf_idx,
+                                  uint32_t version) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (leaves[leaf_idx].version.load(std::memory_order_relaxed) != version)
+      return false;
+    // the version was loaded with acquire before, so the slot cannot be older
+    // than the remap that freed the leaf
+    return slots[vidx >> LEAF_SHIFT].load(std::memory_order_relaxed) ==
+           leaf_idx;
+  }
+
+  // @return the index of a free leaf; 0 if there is no room left
+  uint32_t alloc_leaf() {
+    uint32_t leaf_idx = counters->free_leaf.load(std::memory_order_relaxed);
+    if (leaf_idx) {
+      counters->free_leaf.store(leaves[leaf_idx].next_free,
+                                std::memory_order_relaxed);
+      return leaf_idx;
+    }
+    leaf_idx = std::max(leaves.size(), 1u);
+    if (leaf_idx >= leaves.capacity()) return 0;
+    leaves.grow_to(leaf_idx + 1);
+    return leaf_idx;
+  }
+
+  void free_leaf(uint32_t leaf_idx) {
+    leaves[leaf_idx].next_free =
+        counters->free_leaf.load(std::memory_order_relaxed);
+    counters->free_leaf.store(leaf_idx, std::memory_order_relaxed);
+  }
+
+  // @return false if there is no room left, in which case nothing is changed
+  bool map_in_leaf(uint32_t slot, uint32_t offset, LogicalBlockIdx lidx,
+                   uint32_t num_blocks) {
+    if (slot >= slots.capacity()) return false;
+    if (slot >= slots.size())
+      slots.grow_to(std::min(next_pow2(slot), slots.capacity()));
+    uint32_t old_leaf_idx = slots[slot].load(std::memory_order_relaxed);
+    const Leaf* old_leaf = old_leaf_idx ? &leaves[old_leaf_idx] : nullptr;
+    if (old_leaf) {
+      if (uint32_t flat = old_leaf->flat.load(std::memory_order_relaxed)) {
+        for (uint32_t i = 0; i < num_blocks; ++i)
+          flats[flat].lidxs[offset + i].store(lidx == 0 ? lidx : lidx + i,
+                                              std::memory_order_relaxed);
+        return true;
+      }
+    }
+
+    // the new list: the old extents cut around the new one, which is merged
+    // with its neighbors if they are contiguous
+    LeafExtent result[MAX_EXTENTS + 2];
+    uint32_t num_result = 0;
+    auto append = [&](LeafExtent e) {
+      if (e.num_blocks == 0 || e.lidx == 0) return;
+      if (num_result > 0) {
+        LeafExtent& prev = result[num_result - 1];
+        if (prev.end() == e.offset && prev.lidx + prev.num_blocks == e.lidx) {
+          prev.num_blocks += e.num_blocks;
+          return;
+        }
+      }
+      result[num_result++] = e;
+    };
+
+    const LeafExtent new_extent{offset, num_blocks, lidx};
+    bool inserted = false;
+    uint32_t num_extents =
+        old_leaf ? old_leaf->num_extents.load(std::memory_order_relaxed) : 0;
+    for (uint32_t i = 0; i < num_extents; ++i) {
+      LeafExtent e = load_extent(old_leaf, i);
+      if (!inserted && e.offset >= new_extent.offset) {
+        append(new_extent);
+        inserted = true;
+      }
+      if (e.end() <= new_extent.offset || e.offset >= new_extent.end()) {
+        append(e);
+        continue;
+      }
+      if (e.offset < new_extent.offset)
+        append({e.offset, new_extent.offset - e.offset, e.lidx});
+      if (!inserted) {
+        append(new_extent);
+        inserted = true;
+      }
+      if (e.end() > new_extent.end())
+        append({new_extent.end(), e.end() - new_extent.end(),
+                e.lidx + (new_extent.end() - e.offset)});
+    }
+    if (!inserted) append(new_extent);
+
+    uint32_t flat = 0;
+    if (num_result > MAX_EXTENTS) {
+      flat = std::max(flats.size(), 1u);
+      if (flat >= flats.capacity()) return false;
+    }
+    uint32_t leaf_idx = alloc_leaf();
+    if (leaf_idx == 0) return false;
+
+    Leaf& leaf = leaves[leaf_idx];
+    uint32_t version = leaf.version.load(std::memory_order_relaxed);
+    leaf.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (flat) {
+      flats.grow_to(flat + 1);
+      for (uint32_t i = 0; i < num_result; ++i)
+        for (uint32_t j = 0; j < result[i].num_blocks; ++j)
+          flats[flat].lidxs[result[i].offset + j].store(
+              result[i].lidx + j, std::memory_order_relaxed);
+      leaf.flat.store(flat, std::memory_order_relaxed);
+      leaf.num_extents.store(0, std::memory_order_relaxed);
+    } else {
+      for (uint32_t i = 0; i < num_result; ++i)
+        leaf.extents[i].store(pack(result[i]), std::memory_order_relaxed);
+      leaf.flat.store(0, std::memory_order_relaxed);
+      leaf.num_extents.store(num_result, std::memory_order_relaxed);
+    }
+    leaf.version.store(version + 2, std::memory_order_release);
+
+    slots[slot].store(leaf_idx, std::memory_order_release);
+    if (old_leaf_idx) free_leaf(old_leaf_idx);
+    return true;
+  }
+};
+
+}  // namespace madfs::dram
@@ -1,56 +1,134 @@
 #include "file.h"
 
 #include <cmath>
+#include <mutex>
 
 #include "cursor/tx_block.h"
 
 namespace madfs::dram {
 
 File::File(int fd, const struct stat& stat, int flags,
-           const char* pathname [[maybe_unused]])
+           const char* pathname [[maybe_unused]], bool shared_blk_table)
     : mem_table(fd, stat.st_size, (flags & O_ACCMODE) == O_RDONLY),
       offset_mgr(),
       blk_table(&mem_table),
       shm_mgr(fd, stat, mem_table.get_meta()),
       meta(mem_table.get_meta()),
+      lock(runtime_options.cc),
       fd(fd),
       can_read((flags & O_ACCMODE) == O_RDONLY ||
                (flags & O_ACCMODE) == O_RDWR),
       can_write((flags & O_ACCMODE) == O_WRONLY ||
-                (flags & O_ACCMODE) == O_RDWR) {
+                (flags & O_ACCMODE) == O_RDWR),
+      append_inplace((flags & O_APPEND) || runtime_options.append_inplace),
+      allocators(&mem_table, &bitmap_mgr, &shm_mgr),
+      append_claim(static_cast<std::atomic<LogicalBlockIdx>*>(
+          shm_mgr.get_append_claim_addr())) {
   if (stat.st_size == 0) meta->init();
 
-  uint64_t file_size;
-  bool file_size_updated = false;
-
   // only open shared memory if we may write
-  if (can_write) {
-    bitmap_mgr.entries = static_cast<BitmapEntry*>(shm_mgr.get_bitmap_addr());
+  if (can_write)
+    bitmap_mgr.attach(shm_mgr.get_bitmap_addr(),
+                      shm_mgr.get_bitmap_summary_addr());
+  if (can_write && lock.is_optimistic() && runtime_options.cc_adaptive)
+    range_locks.attach(shm_mgr.get_range_locks_addr());
+
+  if (!shared_blk_table || !attach_blk_table()) build_blk_table();
+
+  if (can_write && pmem::kernels.need_tune.load(std::memory_order_relaxed))
+    tune_kernels();
+
+  if (flags & O_APPEND) {
+    FileState state{};
+    blk_table.update(&state);
+    offset_mgr.seek_absolute(static_cast<off_t>(state.file_size));
+  }
+  if (can_write && runtime_options.tx_flush_interval_ms > 0)
+    tx_flusher = std::thread(&File::run_tx_flusher, this);
+  if constexpr (BuildOptions::debug) {
+    path = strdup(pathname);
+  }
+}
+
+void File::tune_kernels() {
+  static std::once_flag once;
+  std::call_once(once, [&] {
+    Allocator* allocator = get_local_allocator();
+    LogicalBlockIdx lidx = allocator->block.alloc(BITMAP_ENTRY_BLOCKS_CAPACITY);
+    pmem::tune_nt_threshold(mem_table.lidx_to_addr_rw(lidx)->data_rw(),
+                            BLOCK_NUM_TO_SIZE(BITMAP_ENTRY_BLOCKS_CAPACITY));
+    allocator->block.free(lidx, BITMAP_ENTRY_BLOCKS_CAPACITY);
+  });
+}
 
+void File::build_blk_table() {
+  if (can_write) {
     // The first bit corresponds to the meta block which should always be set
     // to 1. If it is not, then bitmap needs to be initialized.
     // BitmapEntry::is_allocated is not thread safe but we don't yet have
     // concurrency
     if (!bitmap_mgr.entries[0].is_allocated(0)) {
       meta->lock();
-      if (!bitmap_mgr.entries[0].is_allocated(0)) {
-        file_size = blk_table.update_unsafe(/*allocator=*/nullptr, &bitmap_mgr);
-        file_size_updated = true;
+      bool is_initialized = bitmap_mgr.entries[0].is_allocated(0);
+      if (!is_initialized) {
+        blk_table.replay_unsafe(&bitmap_mgr);
+        Checkpoint::mark_allocated(&mem_table, &bitmap_mgr);
         bitmap_mgr.entries[0].set_allocated(0);
       }
       meta->unlock();
+      if (!is_initialized) return;
     }
   }
 
-  if (!file_size_updated) file_size = blk_table.update_unsafe();
+  if (auto checkpoint = Checkpoint::load(&mem_table))
+    blk_table.restore_unsafe(*checkpoint);
+  blk_table.replay_unsafe();
+}
 
-  if (flags & O_APPEND) offset_mgr.seek_absolute(static_cast<off_t>(file_size));
-  if constexpr (BuildOptions::debug) {
-    path = strdup(pathname);
+bool File::attach_blk_table() {
+  bool is_reset;
+  auto shared_table = static_cast<SharedBlkTable*>(
+      shm_mgr.start_attach_blk_table(sizeof(SharedBlkTable), &is_reset));
+  bool is_attached = blk_table.attach(shared_table, is_reset,
+                                      [this] { build_blk_table(); });
+  shm_mgr.finish_attach_blk_table(blk_table.is_shared());
+  if (!is_attached) {
+    LOG_WARN("the shared block table is not built or full; use a private one");
+    return false;
+  }
+  LOG_DEBUG("attached to the shared block table (reset: %d, shared: %d)",
+            is_reset, blk_table.is_shared());
+
+  // the table may have been built by a process that cannot write, in which
+  // case the bitmap is not initialized along with it
+  if (can_write && !bitmap_mgr.entries[0].is_allocated(0)) {
+    meta->lock();
+    if (!bitmap_mgr.entries[0].is_allocated(0)) {
+      blk_table.init_bitmap(&bitmap_mgr);
+      Checkpoint::mark_allocated(&mem_table, &bitmap_mgr);
+      bitmap_mgr.entries[0].set_allocated(0);
+    }
+    meta->unlock();
   }
+  return true;
 }
 
 File::~File() {
+  if (tx_flusher.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(tx_flush_mutex);
+      tx_flusher_stop = true;
+    }
+    tx_flusher_cv.notify_one();
+    tx_flusher.join();
+  }
+  {
+    std::lock_guard<std::mutex> guard(tx_flush_mutex);
+    maybe_checkpoint();
+  }
+  // a block still claimed by an in-place append is leaked until the bitmap is
+  // rebuilt
+  if (has_deferred_free) recycle_blocks(get_local_allocator(), {});
   allocators.clear();
   if (fd >= 0) posix::close(fd);
   if constexpr (BuildOptions::debug) {
@@ -67,6 +145,7 @@ std::ostream& operator<<(std::ostream& out, File& f) {
   out << f.mem_table;
   if (f.can_write) {
     out << f.bitmap_mgr;
+    out << f.range_locks;
   }
   out << f.offset_mgr;
   {
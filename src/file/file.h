@@ -4,15 +4,22 @@
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/xattr.h>
-#include <tbb/concurrent_unordered_map.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <ctime>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include "alloc/alloc.h"
+#include "alloc/local.h"
 #include "bitmap.h"
 #include "blk_table.h"
 #include "block/block.h"
@@ -24,7 +31,9 @@
 #include "offset.h"
 #include "posix.h"
 #include "shm.h"
+#include "tx/group_commit.h"
 #include "tx/lock.h"
+#include "tx/range_lock.h"
 #include "utils/utils.h"
 
 namespace madfs::utility {
@@ -43,18 +52,56 @@ class File {
   ShmMgr shm_mgr;
   pmem::MetaBlock* const meta;
   Lock lock;         // nop lock is used by default
+  GroupCommit group_commit;
+  // only attached if runtime_options.cc_adaptive is set
+  RangeLockTable range_locks;
   const char* path;  // only set at debug mode
   int fd;            // only used in destructor, can set to -1 to prevent close
   const bool can_read;
   const bool can_write;
+  // whether appends may write into the free space of the last block in place
+  // (see AppendTx); set by O_APPEND or MADFS_APPEND_INPLACE
+  const bool append_inplace;
 
  private:
-  // each thread tid has its local allocator
+  // each thread has its local allocator
   // the allocator is a per-thread per-file data structure
-  tbb::concurrent_unordered_map<pid_t, Allocator> allocators;
+  LocalAllocators allocators;
+
+  // the last block claimed by an in-place append of any process, which is in
+  // the shared memory; a block replaced by a copy-on-write is not reused while
+  // it is claimed, so it is kept here until the claim is released
+  std::atomic<LogicalBlockIdx>* const append_claim;
+  std::atomic<bool> has_deferred_free{false};
+  std::mutex deferred_free_mutex;
+  std::vector<LogicalBlockIdx> deferred_free_lidxs;
+
+  // build the block table from the checkpoint and the tx history, and
+  // initialize the bitmap if it is not yet
+  void build_blk_table();
+  // use the block table in shared memory, building it if no other process
+  // uses it (as a private one if it does not fit); return false if it is not
+  // built
+  bool attach_blk_table();
+  // tune the copy kernels on free blocks of this file, if it is the first file
+  // opened for writing and tuning is enabled (see pmem::tune_nt_threshold)
+  void tune_kernels();
+
+  // serializes flushing the tx log between fsync and the background flusher
+  std::mutex tx_flush_mutex;
+  // the background flusher, if runtime_options.tx_flush_interval_ms is set
+  std::thread tx_flusher;
+  std::condition_variable tx_flusher_cv;
+  bool tx_flusher_stop{false};  // guarded by tx_flush_mutex
 
  public:
-  File(int fd, const struct stat& stat, int flags, const char* pathname);
+  /**
+   * @param shared_blk_table whether to use the block table in shared memory
+   * (see SharedBlkTable); a utility that accesses the block table directly
+   * must use a private one
+   */
+  File(int fd, const struct stat& stat, int flags, const char* pathname,
+       bool shared_blk_table = runtime_options.shared_blk_table);
   ~File();
 
   /*
@@ -64,25 +111,77 @@ class File {
   ssize_t write(const char* buf, size_t count);
   ssize_t pread(char* buf, size_t count, size_t offset);
   ssize_t read(char* buf, size_t count);
+  // vectored I/O: each call is a single transaction
+  ssize_t pwritev(const struct iovec* iov, int iovcnt, size_t offset);
+  ssize_t writev(const struct iovec* iov, int iovcnt);
+  ssize_t preadv(const struct iovec* iov, int iovcnt, size_t offset);
+  ssize_t readv(const struct iovec* iov, int iovcnt);
   off_t lseek(off_t offset, int whence);
-  void* mmap(void* addr, size_t length, int prot, int flags,
-             size_t offset) const;
+  void* mmap(void* addr, size_t length, int prot, int flags, size_t offset);
   int fsync();
   void stat(struct stat* buf) {
-    buf->st_size = static_cast<off_t>(blk_table.update_unsafe());
+    FileState state;
+    blk_table.update(&state);
+    buf->st_size = static_cast<off_t>(state.file_size);
   }
 
-  [[nodiscard]] Allocator* get_local_allocator() {
-    if (auto it = allocators.find(tid); it != allocators.end()) {
-      return &it->second;
+  [[nodiscard]] Allocator* get_local_allocator() { return allocators.get(); }
+
+  /**
+   * Claim the last block for an in-place append, so that no other append of
+   * any process writes into it in place, and it is not reused even if a
+   * copy-on-write replaces it. The caller must then check with a new snapshot
+   * of the block table that the block has not been replaced.
+   *
+   * If the holder dies, the appends fall back to copy-on-write until the
+   * shared memory is recreated.
+   *
+   * @return whether the block is claimed; false if another append holds a claim
+   */
+  bool claim_inplace_append(LogicalBlockIdx lidx) {
+    LogicalBlockIdx expected = 0;
+    return append_claim->compare_exchange_strong(expected, lidx,
+                                                 std::memory_order_seq_cst);
+  }
+  void release_inplace_append() {
+    append_claim->store(0, std::memory_order_release);
+  }
+
+  /**
+   * Free the data blocks replaced by a committed copy-on-write. The block
+   * claimed by an in-place append is kept until the claim is released.
+   *
+   * @param allocator the local allocator
+   * @param lidxs the blocks to free; zero entries are ignored
+   */
+  void recycle_blocks(Allocator* allocator,
+                      const std::vector<LogicalBlockIdx>& lidxs) {
+    // pairs with claim_inplace_append: either the claim is seen here, or the
+    // append sees the copy-on-write in its snapshot
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    LogicalBlockIdx claimed = append_claim->load(std::memory_order_relaxed);
+    bool is_claimed = claimed != 0 && std::find(lidxs.begin(), lidxs.end(),
+                                                claimed) != lidxs.end();
+    if (!is_claimed && !has_deferred_free.load(std::memory_order_relaxed)) {
+      allocator->block.free(lidxs);
+      return;
     }
 
-    auto [it, ok] = allocators.emplace(
-        std::piecewise_construct, std::forward_as_tuple(tid),
-        std::forward_as_tuple(&mem_table, &bitmap_mgr,
-                              shm_mgr.alloc_per_thread_data()));
-    PANIC_IF(!ok, "insert to thread-local allocators failed");
-    return &it->second;
+    std::vector<LogicalBlockIdx> image = lidxs;
+    std::lock_guard<std::mutex> guard(deferred_free_mutex);
+    for (auto& lidx : image) {
+      if (lidx != claimed) continue;
+      deferred_free_lidxs.push_back(lidx);
+      lidx = 0;
+    }
+    std::erase_if(deferred_free_lidxs, [&](LogicalBlockIdx lidx) {
+      if (lidx == claimed) return false;
+      image.push_back(lidx);
+      return true;
+    });
+    has_deferred_free.store(!deferred_free_lidxs.empty(),
+                            std::memory_order_relaxed);
+    allocator->block.free(image);
   }
 
   // try to open a file with checking whether the given file is in MadFS format
@@ -131,6 +230,23 @@ class File {
   }
 
   friend std::ostream& operator<<(std::ostream& out, File& f);
+
+ private:
+  /**
+   * Flush the tx log up to the current tail and advance the flushed tail in
+   * the meta block; must be called with tx_flush_mutex held
+   */
+  void flush_tx_log();
+
+  /**
+   * Checkpoint the block table if the tx history has grown by
+   * runtime_options.checkpoint_interval tx blocks since the last checkpoint;
+   * must be called with tx_flush_mutex held
+   */
+  void maybe_checkpoint();
+
+  // the body of the background flusher thread
+  void run_tx_flusher();
 };
 
 }  // namespace madfs::dram
@@ -4,12 +4,33 @@
 
 namespace madfs::dram {
 void* File::mmap(void* addr_hint, size_t length, int prot, int mmap_flags,
-                 size_t offset) const {
+                 size_t offset) {
   if (offset % BLOCK_SIZE != 0) {
     errno = EINVAL;
     return MAP_FAILED;
   }
 
+  VirtualBlockIdx vidx_begin = BLOCK_SIZE_TO_IDX(offset);
+  VirtualBlockIdx vidx_end =
+      BLOCK_SIZE_TO_IDX(ALIGN_UP(offset + length, BLOCK_SIZE));
+
+  // deltas only live in the log, so fold them into new blocks before exposing
+  // the blocks; if we cannot write, blocks with deltas are copied instead
+  if (can_write) {
+    alignas(CACHELINE_SIZE) char block_buf[BLOCK_SIZE];
+    bool folded = false;
+    for (VirtualBlockIdx vidx = vidx_begin; vidx < vidx_end; ++vidx) {
+      if (!blk_table.has_delta(vidx)) continue;
+      pwrite(blk_table.get_block_ro(vidx, block_buf), BLOCK_SIZE,
+             BLOCK_IDX_TO_SIZE(vidx));
+      folded = true;
+    }
+    if (folded) {
+      FileState state;
+      blk_table.update(&state);
+    }
+  }
+
   // reserve address space by memory-mapping /dev/zero
   static int zero_fd = posix::open("/dev/zero", O_RDONLY);
   if (zero_fd == -1) {
@@ -22,14 +43,13 @@ void* File::mmap(void* addr_hint, size_t length, int prot, int mmap_flags,
     return MAP_FAILED;
   }
   char* new_addr = reinterpret_cast<char*>(res);
-  char* old_addr = reinterpret_cast<char*>(meta);
-  // TODO: there is a kernel bug that when the old_addr is unmapped, accessing
-  //  new_addr results in kernel panic
-
-  auto remap = [&old_addr, &new_addr](LogicalBlockIdx lidx,
-                                      VirtualBlockIdx vidx,
-                                      uint32_t num_blocks) {
-    char* old_block_addr = old_addr + BLOCK_IDX_TO_SIZE(lidx);
+  // TODO: there is a kernel bug that when the old address is unmapped,
+  //  accessing new_addr results in kernel panic
+
+  auto remap = [&new_addr, this](LogicalBlockIdx lidx, VirtualBlockIdx vidx,
+                                 uint32_t num_blocks) {
+    char* old_block_addr =
+        mem_table.lidx_to_addr_rw(lidx, num_blocks)->data_rw();
     char* new_block_addr = new_addr + BLOCK_IDX_TO_SIZE(vidx);
     size_t len = BLOCK_NUM_TO_SIZE(num_blocks);
     int flag = MREMAP_MAYMOVE | MREMAP_FIXED;
@@ -38,29 +58,57 @@ void* File::mmap(void* addr_hint, size_t length, int prot, int mmap_flags,
     return ret == new_block_addr;
   };
 
+  // place a private copy of a block with deltas
+  auto copy = [&new_addr, &prot, this](VirtualBlockIdx vidx) {
+    char* new_block_addr = new_addr + BLOCK_IDX_TO_SIZE(vidx);
+    void* ret = posix::mmap(new_block_addr, BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (ret != new_block_addr) return false;
+    const char* src = blk_table.get_block_ro(vidx, new_block_addr);
+    if (src != new_block_addr) dram::memcpy(new_block_addr, src, BLOCK_SIZE);
+    return mprotect(new_block_addr, BLOCK_SIZE, prot) == 0;
+  };
+
   // remap the blocks in the file
-  VirtualBlockIdx vidx_end =
-      BLOCK_SIZE_TO_IDX(ALIGN_UP(offset + length, BLOCK_SIZE));
-  VirtualBlockIdx vidx_group_begin = BLOCK_SIZE_TO_IDX(offset);
+  VirtualBlockIdx vidx_group_begin = vidx_begin;
   LogicalBlockIdx lidx_group_begin = blk_table.vidx_to_lidx(vidx_group_begin);
   uint32_t num_blocks = 0;
+  Extent extent{0, 0};
   for (VirtualBlockIdx vidx = vidx_group_begin; vidx < vidx_end; ++vidx) {
-    LogicalBlockIdx lidx = blk_table.vidx_to_lidx(vidx);
+    // look up the mapping a run at a time
+    if (extent.num_blocks == 0) extent = blk_table.get_extent(vidx);
+    LogicalBlockIdx lidx = extent.lidx;
     if (lidx == 0) PANIC("hole vidx=%d in mmap", vidx.get());
+    ++extent.lidx;
+    --extent.num_blocks;
+
+    if (!can_write && blk_table.has_delta(vidx)) {
+      if (num_blocks > 0 &&
+          !remap(lidx_group_begin, vidx_group_begin, num_blocks))
+        goto error;
+      if (!copy(vidx)) goto error;
+      lidx_group_begin = 0;
+      vidx_group_begin = vidx + 1;
+      num_blocks = 0;
+      continue;
+    }
 
-    if (lidx == lidx_group_begin + num_blocks) {
+    if (num_blocks > 0 && lidx == lidx_group_begin + num_blocks) {
       num_blocks++;
       continue;
     }
 
-    if (!remap(lidx_group_begin, vidx_group_begin, num_blocks)) goto error;
+    if (num_blocks > 0 &&
+        !remap(lidx_group_begin, vidx_group_begin, num_blocks))
+      goto error;
 
     lidx_group_begin = lidx;
     vidx_group_begin = vidx;
     num_blocks = 1;
   }
 
-  if (!remap(lidx_group_begin, vidx_group_begin, num_blocks)) goto error;
+  if (num_blocks > 0 && !remap(lidx_group_begin, vidx_group_begin, num_blocks))
+    goto error;
 
   return new_addr;
 
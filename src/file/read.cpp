@@ -33,4 +33,39 @@ ssize_t File::read(char* buf, size_t count) {
   return Tx::exec_and_release_offset<ReadTx>(this, buf, count, offset, state,
                                              ticket);
 }
+
+ssize_t File::preadv(const struct iovec* iov, int iovcnt, size_t offset) {
+  if (unlikely(!can_read)) {
+    errno = EBADF;
+    return -1;
+  }
+  ssize_t len = get_iov_len(iov, iovcnt);
+  if (unlikely(len <= 0)) return len;
+  TimerGuard<Event::READ_TX> timer_guard;
+  timer.start<Event::READ_TX_CTOR>();
+  return ReadTx(this, ReadBuf(iov, iovcnt), static_cast<size_t>(len), offset)
+      .exec();
+}
+
+ssize_t File::readv(const struct iovec* iov, int iovcnt) {
+  if (unlikely(!can_read)) {
+    errno = EBADF;
+    return -1;
+  }
+  ssize_t len = get_iov_len(iov, iovcnt);
+  if (unlikely(len <= 0)) return len;
+  auto count = static_cast<size_t>(len);
+
+  FileState state;
+  uint64_t ticket;
+  uint64_t offset;
+  blk_table.update([&](const FileState& file_state) {
+    offset = offset_mgr.acquire(count, file_state.file_size,
+                                /*stop_at_boundary*/ true, ticket);
+    state = file_state;
+  });
+
+  return Tx::exec_and_release_offset<ReadTx>(this, ReadBuf(iov, iovcnt), count,
+                                             offset, state, ticket);
+}
 }  // namespace madfs::dram
@@ -1,7 +1,16 @@
+#include <chrono>
+
 #include "file/file.h"
 
 namespace madfs::dram {
 int File::fsync() {
+  std::lock_guard<std::mutex> guard(tx_flush_mutex);
+  flush_tx_log();
+  maybe_checkpoint();
+  return 0;
+}
+
+void File::flush_tx_log() {
   FileState state;
   blk_table.update(&state);
   TxCursor::flush_up_to(&mem_table, meta, state.cursor);
@@ -14,6 +23,47 @@ int File::fsync() {
   if (unlikely(state.cursor.idx.local_idx >= capacity))
     state.cursor.idx.local_idx = static_cast<uint16_t>(capacity - 1);
   meta->set_flushed_tx_tail(state.cursor.idx);
-  return 0;
+}
+
+void File::run_tx_flusher() {
+  const auto interval =
+      std::chrono::milliseconds(runtime_options.tx_flush_interval_ms);
+  LOG_DEBUG("tx flusher started for fd %d: interval = %d ms", fd,
+            runtime_options.tx_flush_interval_ms);
+  std::unique_lock<std::mutex> lock(tx_flush_mutex);
+  while (!tx_flusher_cv.wait_for(lock, interval,
+                                 [this] { return tx_flusher_stop; })) {
+    flush_tx_log();
+    maybe_checkpoint();
+  }
+}
+
+void File::maybe_checkpoint() {
+  if (!can_write || runtime_options.checkpoint_interval <= 0) return;
+  FileState state;
+  blk_table.update(&state);
+  uint32_t tx_seq = state.cursor.idx.is_inline()
+                        ? pmem::MetaBlock::get_tx_seq()
+                        : state.cursor.block->get_tx_seq();
+  auto interval = static_cast<uint32_t>(runtime_options.checkpoint_interval);
+  if (tx_seq < Checkpoint::get_tx_seq(&mem_table) + interval) return;
+
+  TimerGuard<Event::CHECKPOINT> timer_guard;
+  // a garbage collection that starts after this may free the tx blocks before
+  // the tail seen here, but it invalidates the checkpoint at the same time
+  pmem::CheckpointRef ref = meta->get_checkpoint();
+  Checkpoint checkpoint = blk_table.get_checkpoint();
+  // the checkpoint must not cover a tx entry that may be lost on a crash
+  flush_tx_log();
+
+  meta->lock();
+  if (meta->get_checkpoint() == ref) {
+    // not the local allocator, which may be gone if the file is closed by the
+    // destructors at exit
+    BlockAllocator allocator(&mem_table, &bitmap_mgr, /*shard_idx*/ 0);
+    checkpoint.store(&mem_table, &allocator);
+    LOG_DEBUG("checkpoint fd %d at tx_seq %u", fd, checkpoint.header.tx_seq);
+  }
+  meta->unlock();
 }
 }  // namespace madfs::dram
@@ -1,5 +1,7 @@
 #include "file/file.h"
 #include "tx/write_aligned.h"
+#include "tx/write_append.h"
+#include "tx/write_delta.h"
 #include "tx/write_unaligned.h"
 
 namespace madfs::dram {
@@ -16,8 +18,22 @@ ssize_t File::pwrite(const char* buf, size_t count, size_t offset) {
     return AlignedTx(this, buf, count, offset).exec();
   }
 
+  // append into the free space of the last block in place
+  if (append_inplace && !IS_ALIGNED(offset, BLOCK_SIZE)) {
+    TimerGuard<Event::APPEND_TX> timer_guard;
+    if (ssize_t ret = AppendTx(this, buf, count, offset).exec(); ret >= 0)
+      return ret;
+  }
+
   // another special case where range is within a single block
   if ((BLOCK_SIZE_TO_IDX(offset)) == BLOCK_SIZE_TO_IDX(offset + count - 1)) {
+    // small overwrite: log the bytes instead of copying the whole block
+    if (count <= MAX_DELTA_SIZE && runtime_options.enable_delta &&
+        blk_table.can_add_delta()) {
+      TimerGuard<Event::DELTA_TX> timer_guard;
+      if (ssize_t ret = DeltaTx(this, buf, count, offset).exec(); ret >= 0)
+        return ret;
+    }
     TimerGuard<Event::SINGLE_BLOCK_TX> timer_guard;
     return SingleBlockTx(this, buf, count, offset).exec();
   }
@@ -52,8 +68,24 @@ ssize_t File::write(const char* buf, size_t count) {
                                                   state, ticket);
   }
 
+  // append into the free space of the last block in place; on failure, the
+  // ticket is still held and the fallback tx below releases it
+  if (append_inplace && AppendTx::can_apply(&blk_table, state, offset)) {
+    TimerGuard<Event::APPEND_TX> timer_guard;
+    if (ssize_t ret = Tx::exec_and_release_offset<AppendTx>(
+            this, buf, count, offset, state, ticket);
+        ret >= 0)
+      return ret;
+  }
+
   // another special case where range is within a single block
   if (BLOCK_SIZE_TO_IDX(offset) == BLOCK_SIZE_TO_IDX(offset + count - 1)) {
+    if (runtime_options.enable_delta && blk_table.can_add_delta() &&
+        DeltaTx::can_apply(&blk_table, state, count, offset)) {
+      TimerGuard<Event::DELTA_TX> timer_guard;
+      return Tx::exec_and_release_offset<DeltaTx>(this, buf, count, offset,
+                                                  state, ticket);
+    }
     TimerGuard<Event::SINGLE_BLOCK_TX> timer_guard;
     return Tx::exec_and_release_offset<SingleBlockTx>(this, buf, count, offset,
                                                       state, ticket);
@@ -66,4 +98,66 @@ ssize_t File::write(const char* buf, size_t count) {
                                                      state, ticket);
   }
 }
+
+ssize_t File::pwritev(const struct iovec* iov, int iovcnt, size_t offset) {
+  if (unlikely(!can_write)) {
+    errno = EBADF;
+    return -1;
+  }
+  ssize_t len = get_iov_len(iov, iovcnt);
+  if (unlikely(len <= 0)) return len;
+  auto count = static_cast<size_t>(len);
+  // a single segment can take the fast paths for a contiguous buffer
+  if (iovcnt == 1)
+    return pwrite(static_cast<const char*>(iov[0].iov_base), count, offset);
+
+  WriteBuf buf(iov, iovcnt);
+  if (count % BLOCK_SIZE == 0 && offset % BLOCK_SIZE == 0) {
+    TimerGuard<Event::ALIGNED_TX> timer_guard;
+    timer.start<Event::ALIGNED_TX_CTOR>();
+    return AlignedTx(this, buf, count, offset).exec();
+  }
+  if (BLOCK_SIZE_TO_IDX(offset) == BLOCK_SIZE_TO_IDX(offset + count - 1)) {
+    TimerGuard<Event::SINGLE_BLOCK_TX> timer_guard;
+    return SingleBlockTx(this, buf, count, offset).exec();
+  }
+  TimerGuard<Event::MULTI_BLOCK_TX> timer_guard;
+  return MultiBlockTx(this, buf, count, offset).exec();
+}
+
+ssize_t File::writev(const struct iovec* iov, int iovcnt) {
+  if (unlikely(!can_write)) {
+    errno = EBADF;
+    return -1;
+  }
+  ssize_t len = get_iov_len(iov, iovcnt);
+  if (unlikely(len <= 0)) return len;
+  auto count = static_cast<size_t>(len);
+  if (iovcnt == 1)
+    return write(static_cast<const char*>(iov[0].iov_base), count);
+
+  FileState state;
+  uint64_t ticket;
+  uint64_t offset;
+  blk_table.update([&](const FileState& file_state) {
+    offset = offset_mgr.acquire(count, file_state.file_size,
+                                /*stop_at_boundary*/ false, ticket);
+    state = file_state;
+  });
+
+  WriteBuf buf(iov, iovcnt);
+  if (count % BLOCK_SIZE == 0 && offset % BLOCK_SIZE == 0) {
+    TimerGuard<Event::ALIGNED_TX> timer_guard;
+    return Tx::exec_and_release_offset<AlignedTx>(this, buf, count, offset,
+                                                  state, ticket);
+  }
+  if (BLOCK_SIZE_TO_IDX(offset) == BLOCK_SIZE_TO_IDX(offset + count - 1)) {
+    TimerGuard<Event::SINGLE_BLOCK_TX> timer_guard;
+    return Tx::exec_and_release_offset<SingleBlockTx>(this, buf, count, offset,
+                                                      state, ticket);
+  }
+  TimerGuard<Event::MULTI_BLOCK_TX> timer_guard;
+  return Tx::exec_and_release_offset<MultiBlockTx>(this, buf, count, offset,
+                                                   state, ticket);
+}
 }  // namespace madfs::dram
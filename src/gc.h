@@ -38,7 +38,8 @@ class GarbageCollector {
             PANIC("Fail to open file \"%s\"", pathname);
           }
 
-          return std::make_unique<dram::File>(fd, stat_buf, O_RDWR, pathname);
+          return std::make_unique<dram::File>(fd, stat_buf, O_RDWR, pathname,
+                                              /*shared_blk_table*/ false);
         }()),
         file_size(file->blk_table.get_state_unsafe().file_size),
         old_tail(file->blk_table.get_state_unsafe().cursor),
@@ -88,6 +89,10 @@ class GarbageCollector {
   }
 
   [[nodiscard]] bool create_new_linked_list() const {
+    // the new tx history only has mappings, so deltas must be folded first
+    std::vector<LogicalBlockIdx> folded_lidxs =
+        file->blk_table.fold_deltas_unsafe(allocator);
+
     uint32_t tx_seq = 1;
     auto first_tx_block_idx = allocator->block.alloc(1);
     auto new_block = file->mem_table.lidx_to_addr_rw(first_tx_block_idx);
@@ -166,11 +171,16 @@ class GarbageCollector {
         free_tx_log_entry_blocks({new_tx_blk_idx, &file->mem_table});
         new_tx_blk_idx = next_tx_blk_idx;
       } while (new_tx_blk_idx != old_tail.idx && new_tx_blk_idx != 0);
+      allocator->block.free(folded_lidxs);
       allocator->block.return_free_list();
       return false;
     }
     pmem::persist_fenced(new_cursor.block, BLOCK_SIZE);
+    // the checkpoint may refer to the old tx history, so it goes away with it
+    file->meta->lock();
+    dram::Checkpoint::invalidate(&file->mem_table, &allocator->block);
     file->meta->set_next_tx_block(first_tx_block_idx);
+    file->meta->unlock();
 
     // invalidate tx in meta block, so we can free the log blocks they point to
     file->meta->invalidate_tx_entries();
@@ -1,4 +1,5 @@
 #include "lib.h"
+#include "madfs.h"
 #include "utils/timer.h"
 
 namespace madfs {
@@ -7,20 +8,36 @@ int close(int fd) {
   if (auto file = get_file(fd)) {
     TimerGuard<Event::CLOSE> guard;
     LOG_DEBUG("madfs::close(%s)", file->path);
-    files.unsafe_erase(fd);
-    return 0;
+    // the file uses its own duplicate of fd (see add_file), so fd is released
+    // now, although the file is only released once no thread uses it
+    files.remove(fd);
+    return posix::close(fd);
   } else {
     LOG_DEBUG("posix::close(%d)", fd);
     return posix::close(fd);
   }
 }
 
+int madfs_close(madfs_file* file) {
+  int rc = 0;
+  if (file->file) {
+    TimerGuard<Event::CLOSE> guard;
+    LOG_DEBUG("madfs::madfs_close(%s)", file->file->path);
+    files.remove(file->fd);
+    rc = posix::close(file->fd);
+  } else {
+    LOG_DEBUG("posix::madfs_close(%d)", file->fd);
+    rc = posix::close(file->fd);
+  }
+  delete file;
+  return rc;
+}
+
 int fclose(FILE* stream) {
   int fd = fileno(stream);
   if (auto file = get_file(fd)) {
     LOG_DEBUG("madfs::fclose(%s)", file->path);
-    file->fd = -1;
-    files.unsafe_erase(fd);
+    files.remove(fd);
     return posix::fclose(stream);
   } else {
     LOG_DEBUG("posix::fclose(%p)", stream);
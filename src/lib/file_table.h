@@ -0,0 +1,128 @@
+#pragma once
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+
+#include "file/file.h"
+#include "utils/epoch.h"
+
+namespace madfs {
+
+/**
+ * The mapping from fd to the in-memory file handle, shared across threads
+ * within the same process.
+ *
+ * It is a flat array indexed by fd, so checking that an fd is not a MadFS file
+ * is a single load. A lookup holds no reference to the file; instead, it is an
+ * epoch-protected critical section, and a file removed from the table is only
+ * released once every lookup that may still see it is over.
+ */
+class FileTable : noncopyable {
+  struct Entry {
+    const std::shared_ptr<dram::File> file;
+  };
+
+  const int capacity;
+  // zero-filled by calloc, so the pages are only touched if an fd is used
+  std::atomic<Entry*>* const entries;
+  EpochDomain<Entry> epoch;
+
+ public:
+  /**
+   * A file found in the table; the file is valid while the Ref is alive.
+   * Must not be held across a blocking wait, since it delays the release of
+   * all the closed files in the process.
+   */
+  class Ref {
+    std::optional<EpochDomain<Entry>::Guard> guard;
+    Entry* entry{nullptr};
+
+    friend class FileTable;
+
+   public:
+    Ref() = default;
+
+    explicit operator bool() const { return entry != nullptr; }
+    dram::File* get() const { return entry ? entry->file.get() : nullptr; }
+    dram::File* operator->() const { return entry->file.get(); }
+    dram::File& operator*() const { return *entry->file; }
+
+    /**
+     * @return a reference to the file that outlives this Ref
+     */
+    [[nodiscard]] std::shared_ptr<dram::File> share() const {
+      return entry ? entry->file : nullptr;
+    }
+  };
+
+  FileTable()
+      : capacity(get_capacity()),
+        entries(static_cast<std::atomic<Entry*>*>(
+            std::calloc(static_cast<size_t>(capacity), sizeof(Entry*)))) {
+    PANIC_IF(entries == nullptr, "failed to allocate the file table");
+  }
+
+  ~FileTable() {
+    for (int fd = 0; fd < capacity; ++fd)
+      delete entries[fd].load(std::memory_order_relaxed);
+    std::free(entries);
+  }
+
+  Ref get(int fd) {
+    if (static_cast<unsigned>(fd) >= static_cast<unsigned>(capacity))
+      return {};
+    if (entries[fd].load(std::memory_order_relaxed) == nullptr) return {};
+
+    Ref ref;
+    ref.guard.emplace(&epoch);
+    // pairs with the epoch announced by the guard (see EpochDomain)
+    ref.entry = entries[fd].load(std::memory_order_seq_cst);
+    return ref;
+  }
+
+  /**
+   * Register a file under fd, replacing the previous one if any (e.g., if the
+   * fd has been closed through a call that we do not intercept)
+   *
+   * @return false if fd is beyond the capacity of the table
+   */
+  bool add(int fd, std::shared_ptr<dram::File> file) {
+    if (static_cast<unsigned>(fd) >= static_cast<unsigned>(capacity))
+      return false;
+    auto entry = new Entry{std::move(file)};
+    if (Entry* old = entries[fd].exchange(entry, std::memory_order_seq_cst)) {
+      LOG_WARN("fd %d is replaced in the file table", fd);
+      epoch.retire(old);
+    }
+    return true;
+  }
+
+  /**
+   * Remove the file registered under fd; it is released once no lookup can
+   * still see it
+   */
+  void remove(int fd) {
+    if (static_cast<unsigned>(fd) >= static_cast<unsigned>(capacity)) return;
+    if (Entry* old = entries[fd].exchange(nullptr, std::memory_order_seq_cst))
+      epoch.retire(old);
+  }
+
+ private:
+  static int get_capacity() {
+    constexpr rlim_t default_capacity = 1 << 16;
+    constexpr rlim_t max_capacity = 1 << 20;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 ||
+        limit.rlim_max == RLIM_INFINITY)
+      return default_capacity;
+    return static_cast<int>(
+        std::clamp(limit.rlim_max, default_capacity, max_capacity));
+  }
+};
+
+}  // namespace madfs
@@ -4,6 +4,7 @@
 #include <iostream>
 
 #include "config.h"
+#include "utils/persist.h"
 
 namespace madfs {
 extern "C" {
@@ -17,6 +18,7 @@ void __attribute__((constructor)) madfs_ctor() {
   initialized = true;
   std::cerr << build_options << std::endl;
   std::cerr << runtime_options << std::endl;
+  std::cerr << pmem::kernels << std::endl;
   if (runtime_options.log_file) {
     log_file = fopen(runtime_options.log_file, "a");
   }
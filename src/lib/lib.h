@@ -1,10 +1,11 @@
 #pragma once
 
-#include <tbb/concurrent_unordered_map.h>
+#include <fcntl.h>
 
 #include <memory>
 
 #include "file/file.h"
+#include "file_table.h"
 
 namespace madfs {
 
@@ -12,19 +13,42 @@ inline bool initialized = false;
 
 // mapping between fd and in-memory file handle
 // shared across threads within the same process
-inline tbb::concurrent_unordered_map<int, std::shared_ptr<dram::File>> files;
+inline FileTable files;
 
-static std::shared_ptr<dram::File> get_file(int fd) {
+static FileTable::Ref get_file(int fd) {
   if (!initialized) return {};
-  if (fd < 0) return {};
-  auto it = files.find(fd);
-  if (it != files.end()) return it->second;
-  return {};
+  return files.get(fd);
 }
 
+/**
+ * Create the in-memory file handle for fd and register it. The file keeps its
+ * own duplicate of fd, so that closing fd releases it right away even if other
+ * threads still use the file (see close).
+ *
+ * @return false if the file cannot be registered, in which case fd is left
+ * open and shall be accessed through the syscalls
+ */
 template <typename... Args>
-static auto add_file(int fd, Args&&... args) {
-  return files.emplace(
-      fd, std::make_shared<dram::File>(fd, std::forward<Args>(args)...));
+static bool add_file(int fd, Args&&... args) {
+  int file_fd = posix::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (file_fd < 0) return false;
+  std::shared_ptr<dram::File> file;
+  try {
+    file = std::make_shared<dram::File>(file_fd, std::forward<Args>(args)...);
+  } catch (...) {
+    posix::close(file_fd);
+    throw;
+  }
+  return files.add(fd, std::move(file));
 }
 }  // namespace madfs
+
+/**
+ * A handle returned by madfs_open (see madfs.h); `file` is null if the file is
+ * not in MadFS format. The handle holds its own reference to the file, so the
+ * I/O calls use the raw pointer without touching the fd table.
+ */
+struct madfs_file {
+  const int fd;
+  const std::shared_ptr<madfs::dram::File> file;
+};
@@ -1,6 +1,7 @@
 #include <cstdarg>
 
 #include "lib.h"
+#include "madfs.h"
 #include "utils/timer.h"
 
 namespace madfs {
@@ -17,8 +18,12 @@ static int open_impl(const char* pathname, int flags, mode_t mode) {
   }
 
   try {
-    add_file(fd, stat_buf, flags, pathname);
-    LOG_INFO("madfs::open(%s, %x, %x) = %d", pathname, flags, mode, fd);
+    if (add_file(fd, stat_buf, flags, pathname)) {
+      LOG_INFO("madfs::open(%s, %x, %x) = %d", pathname, flags, mode, fd);
+    } else {
+      LOG_WARN("File \"%s\": fd %d cannot be added to the file table. "
+               "Fallback to syscall", pathname, fd);
+    }
   } catch (const FileInitException& e) {
     LOG_WARN("File \"%s\": madfs::open failed: %s. Fallback to syscall",
              pathname, e.what());
@@ -68,6 +73,14 @@ int openat64([[maybe_unused]] int dirfd, const char* pathname, int flags, ...) {
   return open_impl(pathname, flags, mode);
 }
 
+madfs_file* madfs_open(const char* pathname, int flags, mode_t mode) {
+  int fd = open_impl(pathname, flags, mode);
+  if (fd < 0) return nullptr;
+  return new madfs_file{.fd = fd, .file = get_file(fd).share()};
+}
+
+int madfs_fileno(const madfs_file* file) { return file->fd; }
+
 FILE* fopen(const char* filename, const char* mode) {
   FILE* file = posix::fopen(filename, mode);
   LOG_DEBUG("posix::fopen(%s, %s) = %p", filename, mode, file);
@@ -1,4 +1,5 @@
 #include "lib.h"
+#include "madfs.h"
 #include "utils/timer.h"
 
 namespace madfs {
@@ -37,6 +38,70 @@ ssize_t pread64(int fd, void* buf, size_t count, off64_t offset) {
   return pread(fd, buf, count, offset);
 }
 
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+  if (auto file = get_file(fd)) {
+    TimerGuard<Event::READV> timer_guard;
+    auto res = file->readv(iov, iovcnt);
+    LOG_DEBUG("madfs::readv(%s, iov, %d) = %zu", file->path, iovcnt, res);
+    return res;
+  } else {
+    auto res = posix::readv(fd, iov, iovcnt);
+    LOG_DEBUG("posix::readv(%d, iov, %d) = %zu", fd, iovcnt, res);
+    return res;
+  }
+}
+
+ssize_t preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset) {
+  if (auto file = get_file(fd)) {
+    TimerGuard<Event::PREADV> timer_guard;
+    auto res = file->preadv(iov, iovcnt, static_cast<size_t>(offset));
+    LOG_DEBUG("madfs::preadv(%s, iov, %d, %ld) = %zu", file->path, iovcnt,
+              offset, res);
+    return res;
+  } else {
+    auto res = posix::preadv(fd, iov, iovcnt, offset);
+    LOG_DEBUG("posix::preadv(%d, iov, %d, %ld) = %zu", fd, iovcnt, offset,
+              res);
+    return res;
+  }
+}
+
+ssize_t preadv64(int fd, const struct iovec* iov, int iovcnt, off64_t offset) {
+  return preadv(fd, iov, iovcnt, offset);
+}
+
+ssize_t preadv2(int fd, const struct iovec* iov, int iovcnt, off_t offset,
+                int flags) {
+  if (auto file = get_file(fd)) {
+    // the flags are only hints for reads
+    auto res = offset == -1 ? readv(fd, iov, iovcnt)
+                            : preadv(fd, iov, iovcnt, offset);
+    LOG_DEBUG("madfs::preadv2(%s, iov, %d, %ld, %d) = %zu", file->path,
+              iovcnt, offset, flags, res);
+    return res;
+  } else {
+    auto res = posix::preadv2(fd, iov, iovcnt, offset, flags);
+    LOG_DEBUG("posix::preadv2(%d, iov, %d, %ld, %d) = %zu", fd, iovcnt,
+              offset, flags, res);
+    return res;
+  }
+}
+
+ssize_t preadv64v2(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+                   int flags) {
+  return preadv2(fd, iov, iovcnt, offset, flags);
+}
+
+ssize_t madfs_pread(madfs_file* file, void* buf, size_t count, off_t offset) {
+  if (dram::File* f = file->file.get()) {
+    TimerGuard<Event::PREAD> timer_guard(count);
+    return f->pread(static_cast<char*>(buf), count,
+                    static_cast<size_t>(offset));
+  } else {
+    return posix::pread(file->fd, buf, count, offset);
+  }
+}
+
 ssize_t __read_chk(int fd, void* buf, size_t count,
                    [[maybe_unused]] size_t buflen) {
   if (buflen >= count) {
@@ -0,0 +1,256 @@
+#include <immintrin.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "lib.h"
+#include "madfs.h"
+#include "utils/timer.h"
+
+/**
+ * The SQ and the CQ have the same capacity. The application thread fills SQEs
+ * at `sq_tail_local` and publishes them at submission; workers claim SQEs from
+ * `sq_head` under a spinlock and post the CQE to the next slot of the CQ, which
+ * is marked ready once written. The application thread consumes CQEs in slot
+ * order. All indices are free-running and masked on access.
+ *
+ * At most `entries` operations are filled but not yet reaped, so a CQ slot is
+ * always free when a worker takes it, and an SQ slot is only refilled after
+ * the SQE in it has been claimed (and copied).
+ */
+struct madfs_ring : madfs::noncopyable {
+  const uint32_t mask;
+  const std::unique_ptr<madfs_sqe[]> sqes;
+  const std::unique_ptr<madfs_cqe[]> cqes;
+  const std::unique_ptr<std::atomic_bool[]> cqe_ready;
+
+  // only accessed by the application thread
+  uint32_t sq_tail_local{0};
+  uint32_t cq_head{0};
+
+  // shared with the workers
+  std::atomic<uint32_t> sq_tail{0};
+  pthread_spinlock_t sq_lock;
+  uint32_t sq_head{0};  // guarded by sq_lock
+  std::atomic<uint32_t> cq_tail{0};
+  // the number of times the ring is queued or being drained in the pool
+  std::atomic<uint32_t> refs{0};
+
+  explicit madfs_ring(uint32_t entries)
+      : mask(entries - 1),
+        sqes(new madfs_sqe[entries]),
+        cqes(new madfs_cqe[entries]),
+        cqe_ready(new std::atomic_bool[entries]) {
+    for (uint32_t i = 0; i < entries; ++i) cqe_ready[i] = false;
+    pthread_spin_init(&sq_lock, PTHREAD_PROCESS_PRIVATE);
+  }
+  ~madfs_ring() { pthread_spin_destroy(&sq_lock); }
+
+  [[nodiscard]] uint32_t capacity() const { return mask + 1; }
+
+  /**
+   * Take the next submitted SQE; called by workers
+   *
+   * @return false if there is no submitted SQE left
+   */
+  bool claim(madfs_sqe& sqe) {
+    pthread_spin_lock(&sq_lock);
+    bool ok = sq_head != sq_tail.load(std::memory_order_acquire);
+    if (ok) sqe = sqes[sq_head++ & mask];
+    pthread_spin_unlock(&sq_lock);
+    return ok;
+  }
+
+  void complete(uint64_t user_data, ssize_t res) {
+    uint32_t slot = cq_tail.fetch_add(1, std::memory_order_relaxed) & mask;
+    cqes[slot] = {.user_data = user_data, .res = res};
+    cqe_ready[slot].store(true, std::memory_order_release);
+  }
+};
+
+namespace madfs {
+
+namespace {
+
+ssize_t ring_exec(const madfs_sqe& sqe) {
+  ssize_t res;
+  if (auto file = get_file(sqe.fd)) {
+    switch (sqe.opcode) {
+      case MADFS_OP_NOP:
+        return 0;
+      case MADFS_OP_PREAD:
+        res = file->pread(static_cast<char*>(sqe.buf), sqe.len,
+                          static_cast<size_t>(sqe.offset));
+        break;
+      case MADFS_OP_PWRITE:
+        res = file->pwrite(static_cast<const char*>(sqe.buf), sqe.len,
+                           static_cast<size_t>(sqe.offset));
+        break;
+      case MADFS_OP_FSYNC:
+        res = file->fsync();
+        break;
+      default:
+        return -EINVAL;
+    }
+  } else {
+    switch (sqe.opcode) {
+      case MADFS_OP_NOP:
+        return 0;
+      case MADFS_OP_PREAD:
+        res = posix::pread(sqe.fd, sqe.buf, sqe.len, sqe.offset);
+        break;
+      case MADFS_OP_PWRITE:
+        res = posix::pwrite(sqe.fd, sqe.buf, sqe.len, sqe.offset);
+        break;
+      case MADFS_OP_FSYNC:
+        res = posix::fsync(sqe.fd);
+        break;
+      default:
+        return -EINVAL;
+    }
+  }
+  return res < 0 ? -errno : res;
+}
+
+/**
+ * The worker threads shared by all rings in the process. A submission queues
+ * the ring once per worker it wants; a worker takes a ring from the queue and
+ * executes its SQEs until none is left.
+ */
+class RingWorkerPool : noncopyable {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<madfs_ring*> queue;  // guarded by mutex
+  bool stop{false};               // guarded by mutex
+  std::vector<std::thread> workers;
+
+ public:
+  RingWorkerPool() {
+    int num_workers = std::max(runtime_options.ring_workers, 1);
+    for (int i = 0; i < num_workers; ++i)
+      workers.emplace_back(&RingWorkerPool::run, this);
+    LOG_DEBUG("ring worker pool started: %d workers", num_workers);
+  }
+
+  ~RingWorkerPool() {
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      stop = true;
+    }
+    cv.notify_all();
+    for (auto& worker : workers) worker.join();
+  }
+
+  [[nodiscard]] uint32_t size() const {
+    return static_cast<uint32_t>(workers.size());
+  }
+
+  void enqueue(madfs_ring* ring, uint32_t num_workers) {
+    ring->refs.fetch_add(num_workers, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      for (uint32_t i = 0; i < num_workers; ++i) queue.push_back(ring);
+    }
+    if (num_workers == 1)
+      cv.notify_one();
+    else
+      cv.notify_all();
+  }
+
+ private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [this] { return stop || !queue.empty(); });
+      if (queue.empty()) return;
+      madfs_ring* ring = queue.front();
+      queue.pop_front();
+      lock.unlock();
+
+      madfs_sqe sqe;
+      while (ring->claim(sqe)) {
+        TimerGuard<Event::RING_OP> timer_guard;
+        ring->complete(sqe.user_data, ring_exec(sqe));
+      }
+      ring->refs.fetch_sub(1, std::memory_order_release);
+
+      lock.lock();
+    }
+  }
+};
+
+RingWorkerPool& get_ring_worker_pool() {
+  static RingWorkerPool pool;
+  return pool;
+}
+
+}  // namespace
+
+extern "C" {
+int madfs_ring_setup(unsigned entries, madfs_ring** ring) {
+  constexpr unsigned max_entries = 1u << 15;
+  if (entries == 0 || entries > max_entries) return -EINVAL;
+  if (!std::has_single_bit(entries)) entries = next_pow2(entries);
+  try {
+    *ring = new madfs_ring(entries);
+  } catch (const std::bad_alloc&) {
+    return -ENOMEM;
+  }
+  get_ring_worker_pool();  // start the workers on first use
+  LOG_DEBUG("madfs_ring_setup(%u) = %p", entries, *ring);
+  return 0;
+}
+
+void madfs_ring_exit(madfs_ring* ring) {
+  // no worker will touch the ring once all the queued references are dropped
+  while (ring->refs.load(std::memory_order_acquire) != 0)
+    std::this_thread::yield();
+  LOG_DEBUG("madfs_ring_exit(%p)", ring);
+  delete ring;
+}
+
+madfs_sqe* madfs_ring_get_sqe(madfs_ring* ring) {
+  if (ring->sq_tail_local - ring->cq_head >= ring->capacity()) return nullptr;
+  return &ring->sqes[ring->sq_tail_local++ & ring->mask];
+}
+
+int madfs_ring_submit(madfs_ring* ring) {
+  uint32_t num_submitted =
+      ring->sq_tail_local - ring->sq_tail.load(std::memory_order_relaxed);
+  if (num_submitted == 0) return 0;
+  ring->sq_tail.store(ring->sq_tail_local, std::memory_order_release);
+  auto& pool = get_ring_worker_pool();
+  pool.enqueue(ring, std::min(num_submitted, pool.size()));
+  return static_cast<int>(num_submitted);
+}
+
+int madfs_ring_peek_cqe(madfs_ring* ring, madfs_cqe** cqe) {
+  uint32_t slot = ring->cq_head & ring->mask;
+  if (!ring->cqe_ready[slot].load(std::memory_order_acquire)) return -EAGAIN;
+  *cqe = &ring->cqes[slot];
+  return 0;
+}
+
+int madfs_ring_wait_cqe(madfs_ring* ring, madfs_cqe** cqe) {
+  if (ring->sq_tail.load(std::memory_order_relaxed) == ring->cq_head)
+    return -EAGAIN;
+  while (madfs_ring_peek_cqe(ring, cqe) != 0) _mm_pause();
+  return 0;
+}
+
+void madfs_ring_cqe_seen(madfs_ring* ring, madfs_cqe* cqe) {
+  assert(cqe == &ring->cqes[ring->cq_head & ring->mask]);
+  ring->cqe_ready[ring->cq_head & ring->mask].store(false,
+                                                     std::memory_order_relaxed);
+  ++ring->cq_head;
+}
+}  // extern "C"
+}  // namespace madfs
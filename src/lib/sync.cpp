@@ -1,4 +1,5 @@
 #include "lib.h"
+#include "madfs.h"
 #include "utils/timer.h"
 
 namespace madfs {
@@ -24,5 +25,14 @@ int fdatasync(int fd) {
     return posix::fdatasync(fd);
   }
 }
+
+int madfs_fsync(madfs_file* file) {
+  if (dram::File* f = file->file.get()) {
+    TimerGuard<Event::FSYNC> timer_guard;
+    return f->fsync();
+  } else {
+    return posix::fsync(file->fd);
+  }
+}
 }
 }  // namespace madfs
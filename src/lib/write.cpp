@@ -1,4 +1,5 @@
 #include "lib.h"
+#include "madfs.h"
 #include "utils/timer.h"
 
 namespace madfs {
@@ -34,5 +35,75 @@ ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset) {
 ssize_t pwrite64(int fd, const void* buf, size_t count, off64_t offset) {
   return pwrite(fd, buf, count, offset);
 }
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+  if (auto file = get_file(fd)) {
+    TimerGuard<Event::WRITEV> timer_guard;
+    ssize_t res = file->writev(iov, iovcnt);
+    LOG_DEBUG("madfs::writev(%s, iov, %d) = %zu", file->path, iovcnt, res);
+    return res;
+  } else {
+    LOG_DEBUG("posix::writev(%d, iov, %d)", fd, iovcnt);
+    return posix::writev(fd, iov, iovcnt);
+  }
+}
+
+ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset) {
+  if (auto file = get_file(fd)) {
+    TimerGuard<Event::PWRITEV> timer_guard;
+    ssize_t res = file->pwritev(iov, iovcnt, static_cast<size_t>(offset));
+    LOG_DEBUG("madfs::pwritev(%s, iov, %d, %ld) = %zu", file->path, iovcnt,
+              offset, res);
+    return res;
+  } else {
+    LOG_DEBUG("posix::pwritev(%d, iov, %d, %ld)", fd, iovcnt, offset);
+    return posix::pwritev(fd, iov, iovcnt, offset);
+  }
+}
+
+ssize_t pwritev64(int fd, const struct iovec* iov, int iovcnt,
+                  off64_t offset) {
+  return pwritev(fd, iov, iovcnt, offset);
+}
+
+ssize_t pwritev2(int fd, const struct iovec* iov, int iovcnt, off_t offset,
+                 int flags) {
+  if (auto file = get_file(fd)) {
+    // appending regardless of the offset is not supported
+    if (flags & RWF_APPEND) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+    ssize_t res = offset == -1 ? writev(fd, iov, iovcnt)
+                               : pwritev(fd, iov, iovcnt, offset);
+    // every write is durable once it returns, so RWF_DSYNC and RWF_SYNC only
+    // need the tx log flushed; other flags are only hints
+    if (res >= 0 && (flags & (RWF_DSYNC | RWF_SYNC)) && file->fsync() != 0)
+      res = -1;
+    LOG_DEBUG("madfs::pwritev2(%s, iov, %d, %ld, %d) = %zu", file->path,
+              iovcnt, offset, flags, res);
+    return res;
+  } else {
+    LOG_DEBUG("posix::pwritev2(%d, iov, %d, %ld, %d)", fd, iovcnt, offset,
+              flags);
+    return posix::pwritev2(fd, iov, iovcnt, offset, flags);
+  }
+}
+
+ssize_t pwritev64v2(int fd, const struct iovec* iov, int iovcnt,
+                    off64_t offset, int flags) {
+  return pwritev2(fd, iov, iovcnt, offset, flags);
+}
+
+ssize_t madfs_pwrite(madfs_file* file, const void* buf, size_t count,
+                     off_t offset) {
+  if (dram::File* f = file->file.get()) {
+    TimerGuard<Event::PWRITE> timer_guard(count);
+    return f->pwrite(static_cast<const char*>(buf), count,
+                     static_cast<size_t>(offset));
+  } else {
+    return posix::pwrite(file->fd, buf, count, offset);
+  }
+}
 }
 }  // namespace madfs
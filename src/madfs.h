@@ -0,0 +1,182 @@
+#pragma once
+
+/*
+ * The public API of MadFS beyond the intercepted POSIX calls
+ *
+ * The functions are exported by libmadfs.so with C linkage.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Direct file handles
+ *
+ * A handle refers to an open file without going through the fd table or the
+ * symbol interposition, so an I/O call costs no table lookup and no reference
+ * counting. The file is also registered under its fd as usual, so that the
+ * intercepted POSIX calls on madfs_fileno(handle) see the same file.
+ *
+ * The functions follow their POSIX counterparts: they return -1 and set errno
+ * on failure. A file that is not in MadFS format is accessed through the
+ * syscalls.
+ */
+
+typedef struct madfs_file madfs_file;
+
+/**
+ * Open a file like open(2)
+ *
+ * @return the handle; NULL with errno set on failure
+ */
+madfs_file* madfs_open(const char* pathname, int flags, mode_t mode);
+
+/**
+ * Close the handle and its fd
+ */
+int madfs_close(madfs_file* file);
+
+/**
+ * @return the fd of the handle
+ */
+int madfs_fileno(const madfs_file* file);
+
+ssize_t madfs_pread(madfs_file* file, void* buf, size_t count, off_t offset);
+ssize_t madfs_pwrite(madfs_file* file, const void* buf, size_t count,
+                     off_t offset);
+int madfs_fsync(madfs_file* file);
+
+/*
+ * Asynchronous submission/completion rings
+ *
+ * A ring lets a thread keep multiple reads, writes and fsyncs in flight. The
+ * thread fills submission queue entries (SQEs) and submits them in a batch; a
+ * small pool of library worker threads executes them as ordinary MadFS
+ * transactions and posts completion queue entries (CQEs), which the thread
+ * polls from memory without a syscall. Concurrent commits from the workers are
+ * combined by the group commit as usual.
+ *
+ * A ring must only be used by one application thread at a time. Operations in
+ * flight may complete in any order; use user_data to tell them apart.
+ *
+ * Example:
+ *
+ *   struct madfs_ring* ring;
+ *   madfs_ring_setup(64, &ring);
+ *   struct madfs_sqe* sqe = madfs_ring_get_sqe(ring);
+ *   madfs_prep_pwrite(sqe, fd, buf, len, offset, user_data);
+ *   madfs_ring_submit(ring);
+ *   struct madfs_cqe* cqe;
+ *   madfs_ring_wait_cqe(ring, &cqe);
+ *   // cqe->res is the return value of pwrite, or -errno on failure
+ *   madfs_ring_cqe_seen(ring, cqe);
+ *   madfs_ring_exit(ring);
+ */
+
+enum madfs_op {
+  MADFS_OP_NOP,
+  MADFS_OP_PREAD,
+  MADFS_OP_PWRITE,
+  MADFS_OP_FSYNC,
+};
+
+struct madfs_sqe {
+  uint8_t opcode;  // enum madfs_op
+  int fd;
+  void* buf;
+  size_t len;
+  off_t offset;
+  uint64_t user_data;  // passed back in the CQE
+};
+
+struct madfs_cqe {
+  uint64_t user_data;
+  ssize_t res;  // the return value of the operation; -errno on failure
+};
+
+struct madfs_ring;
+
+/**
+ * Create a ring with at most `entries` operations in flight
+ *
+ * @return 0 on success; -errno on failure
+ */
+int madfs_ring_setup(unsigned entries, struct madfs_ring** ring);
+
+/**
+ * Wait for all operations in flight to complete and destroy the ring
+ */
+void madfs_ring_exit(struct madfs_ring* ring);
+
+/**
+ * @return the next free SQE; NULL if `entries` operations are already pending
+ * or in flight
+ */
+struct madfs_sqe* madfs_ring_get_sqe(struct madfs_ring* ring);
+
+/**
+ * Hand all SQEs filled since the last submission to the worker threads
+ *
+ * @return the number of SQEs submitted
+ */
+int madfs_ring_submit(struct madfs_ring* ring);
+
+/**
+ * Get the next completion without blocking
+ *
+ * @return 0 on success; -EAGAIN if no completion is available
+ */
+int madfs_ring_peek_cqe(struct madfs_ring* ring, struct madfs_cqe** cqe);
+
+/**
+ * Get the next completion, busy-waiting until one is available
+ *
+ * @return 0 on success; -EAGAIN if no operation is in flight
+ */
+int madfs_ring_wait_cqe(struct madfs_ring* ring, struct madfs_cqe** cqe);
+
+/**
+ * Mark the CQE returned by peek/wait as consumed, so that its slot is reused
+ */
+void madfs_ring_cqe_seen(struct madfs_ring* ring, struct madfs_cqe* cqe);
+
+static inline void madfs_prep_pread(struct madfs_sqe* sqe, int fd, void* buf,
+                                    size_t len, off_t offset,
+                                    uint64_t user_data) {
+  sqe->opcode = MADFS_OP_PREAD;
+  sqe->fd = fd;
+  sqe->buf = buf;
+  sqe->len = len;
+  sqe->offset = offset;
+  sqe->user_data = user_data;
+}
+
+static inline void madfs_prep_pwrite(struct madfs_sqe* sqe, int fd,
+                                     const void* buf, size_t len, off_t offset,
+                                     uint64_t user_data) {
+  sqe->opcode = MADFS_OP_PWRITE;
+  sqe->fd = fd;
+  sqe->buf = (void*)buf;
+  sqe->len = len;
+  sqe->offset = offset;
+  sqe->user_data = user_data;
+}
+
+static inline void madfs_prep_fsync(struct madfs_sqe* sqe, int fd,
+                                    uint64_t user_data) {
+  sqe->opcode = MADFS_OP_FSYNC;
+  sqe->fd = fd;
+  sqe->buf = NULL;
+  sqe->len = 0;
+  sqe->offset = 0;
+  sqe->user_data = user_data;
+}
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
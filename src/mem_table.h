@@ -1,12 +1,15 @@
 #pragma once
 
 #include <linux/mman.h>
-#include <tbb/concurrent_vector.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <cstdint>
 #include <iosfwd>
+#include <mutex>
 #include <tuple>
+#include <vector>
 
 #include "block/block.h"
 #include "config.h"
@@ -14,7 +17,6 @@
 #include "idx.h"
 #include "posix.h"
 #include "utils/logging.h"
-#include "utils/tbb.h"
 #include "utils/timer.h"
 #include "utils/utils.h"
 
@@ -25,6 +27,10 @@ constexpr static uint32_t GROW_UNIT_IN_BLOCK_SHIFT =
 constexpr static uint32_t GROW_UNIT_IN_BLOCK_MASK =
     (1 << GROW_UNIT_IN_BLOCK_SHIFT) - 1;
 
+// the largest file the bitmap can manage, in blocks
+constexpr static uint32_t MAX_NUM_BLOCKS =
+    NUM_BITMAP_ENTRIES * BITMAP_ENTRY_BLOCKS_CAPACITY;
+
 // map LogicalBlockIdx into memory address
 // this is a more low-level data structure than Allocator
 // it should maintain the virtualization of infinite large of file
@@ -34,24 +40,29 @@ constexpr static uint32_t GROW_UNIT_IN_BLOCK_MASK =
 //   the addr
 // - if this block is not even allocated from kernel filesystem, grow_to_fit and
 //   map it, and return the address
+//
+// The file is mapped at the same offset in a reservation of address space
+// aligned to a grow unit, so that the address of a block is computed rather
+// than looked up, and the kernel may map each grow unit with a huge page. The
+// file is mapped from the beginning up to the last block used so far. The
+// reservation is a few times the size of the file; once the file outgrows it,
+// the file is mapped again into one twice as large.
 class MemTable : noncopyable {
   pmem::MetaBlock* meta;
   int fd;
   int prot;
 
-  // immutable after ctor
-  pmem::Block* first_region;
-  uint32_t first_region_num_blocks;
-
-  // map a chunk_idx to addr, where chunk_idx =
-  // (lidx - first_region_num_blocks) >> GROW_UNIT_IN_BLOCK_SHIFT
-  tbb::concurrent_vector<std::atomic<pmem::Block*>,
-                         zero_allocator<std::atomic<pmem::Block*>>>
-      table;
-  static_assert(std::atomic<pmem::Block*>::is_always_lock_free);
+  // the blocks [0, num_mapped_blocks) are mapped at base; both only change
+  // under the mutex, and a new base is published before the blocks it maps
+  std::atomic<pmem::Block*> base;
+  std::atomic<uint32_t> num_mapped_blocks;
+  uint32_t num_reserved_blocks;
+  std::mutex mutex;
 
-  // a vector of <addr, length> pairs
-  tbb::concurrent_vector<std::tuple<void*, size_t>> mmap_regions;
+  // the reservations and the mappings in them; the old ones are kept until the
+  // file is closed, since the pointers into them may still be in use
+  std::vector<std::tuple<void*, size_t>> reserved_regions;
+  std::vector<std::tuple<void*, size_t>> mmap_regions;
 
  public:
   MemTable(int fd, off_t init_file_size, bool read_only)
@@ -68,22 +79,25 @@ class MemTable : noncopyable {
       PANIC_IF(ret < 0, "fallocate failed");
     }
 
-    first_region = mmap_file(static_cast<size_t>(file_size), 0, 0);
-    first_region_num_blocks = BLOCK_SIZE_TO_IDX(file_size);
-    meta = &first_region[0].meta_block;
+    uint32_t num_blocks = BLOCK_SIZE_TO_IDX(file_size);
+    pmem::Block* blocks = reserve(num_blocks);
+    mmap_file(blocks, 0, num_blocks, 0);
+    base.store(blocks, std::memory_order_relaxed);
+    num_mapped_blocks.store(num_blocks, std::memory_order_relaxed);
+    meta = &blocks[0].meta_block;
     if (!is_empty && !meta->is_valid())
       throw FileInitException("invalid meta block");
 
     // update the mata block if necessary
     if (should_grow)
-      meta->set_num_logical_blocks_if_larger(first_region_num_blocks);
+      meta->set_num_logical_blocks_if_larger(BLOCK_SIZE_TO_IDX(file_size));
   }
 
   ~MemTable() {
-    for (const auto& [addr, length] : mmap_regions) {
-      munmap(addr, length);
+    for (const auto& [addr, length] : mmap_regions)
       VALGRIND_PMC_REMOVE_PMEM_MAPPING(addr, length);
-    }
+    for (const auto& [addr, length] : reserved_regions)
+      posix::munmap(addr, length);
   }
 
   [[nodiscard]] pmem::MetaBlock* get_meta() const { return meta; }
@@ -94,41 +108,50 @@ class MemTable : noncopyable {
    * data block, it allocates from the kernel.
    *
    * @param idx the logical block index
+   * @param num_blocks the number of blocks from idx that must be mapped
+   * contiguously after the returned pointer
    * @return the Block pointer if idx is not 0; nullptr for idx == 0, and the
    * caller should handle this case
    */
-  pmem::Block* lidx_to_addr_rw(LogicalBlockIdx idx) {
+  pmem::Block* lidx_to_addr_rw(LogicalBlockIdx idx, uint32_t num_blocks = 1) {
     if (unlikely(idx == 0)) return nullptr;
-    // super fast path: within first_region, no need touch concurrent vector
-    if (idx < first_region_num_blocks) return &first_region[idx.get()];
-
-    // fast path: just look up
-    uint32_t chunk_idx =
-        (idx - first_region_num_blocks) >> GROW_UNIT_IN_BLOCK_SHIFT;
-    uint32_t chunk_local_idx = idx & GROW_UNIT_IN_BLOCK_MASK;
-    if (chunk_idx < table.size()) {
-      pmem::Block* chunk_addr = table[chunk_idx];
-      if (chunk_addr) return chunk_addr + chunk_local_idx;
-    } else {
-      table.grow_to_at_least(next_pow2(chunk_idx));
-    }
+    uint32_t last = idx.get() + num_blocks - 1;
+    // fast path: already mapped
+    if (likely(last < num_mapped_blocks.load(std::memory_order_acquire)))
+      return &base.load(std::memory_order_acquire)[idx.get()];
+
+    std::lock_guard<std::mutex> guard(mutex);
+    uint32_t begin = num_mapped_blocks.load(std::memory_order_relaxed);
+    if (last < begin)
+      return &base.load(std::memory_order_relaxed)[idx.get()];
+    PANIC_IF(last >= MAX_NUM_BLOCKS, "block %u is out of range", last);
 
     // ensure this idx has real blocks allocated; do allocation if not
-    grow_to_fit(idx);
-
-    LogicalBlockIdx chunk_begin_lidx = idx & ~GROW_UNIT_IN_BLOCK_MASK;
-    pmem::Block* chunk_addr = mmap_file(
-        GROW_UNIT_SIZE, static_cast<off_t>(BLOCK_IDX_TO_SIZE(chunk_begin_lidx)),
-        MAP_POPULATE);
-    table[chunk_idx] = chunk_addr;
-    return chunk_addr + chunk_local_idx;
+    grow_to_fit(last);
+
+    // map up to the grow unit of the last block, including the ones skipped
+    // before idx, but only populate the grow units asked for
+    uint32_t end = ALIGN_UP(last + 1, NUM_BLOCKS_PER_GROW);
+    uint32_t populate_begin =
+        std::max(begin, ALIGN_DOWN(idx.get(), NUM_BLOCKS_PER_GROW));
+    pmem::Block* blocks = base.load(std::memory_order_relaxed);
+    if (end > num_reserved_blocks) {
+      blocks = reserve(end);
+      mmap_file(blocks, 0, begin, 0);
+    }
+    mmap_file(blocks, begin, populate_begin - begin, 0);
+    mmap_file(blocks, populate_begin, end - populate_begin, MAP_POPULATE);
+    base.store(blocks, std::memory_order_release);
+    num_mapped_blocks.store(end, std::memory_order_release);
+    return &blocks[idx.get()];
   }
 
-  [[nodiscard]] const pmem::Block* lidx_to_addr_ro(LogicalBlockIdx lidx) {
+  [[nodiscard]] const pmem::Block* lidx_to_addr_ro(LogicalBlockIdx lidx,
+                                                   uint32_t num_blocks = 1) {
     constexpr static const char __attribute__((aligned(BLOCK_SIZE)))
     empty_block[BLOCK_SIZE]{};
     if (lidx == 0) return reinterpret_cast<const pmem::Block*>(&empty_block);
-    return lidx_to_addr_rw(lidx);
+    return lidx_to_addr_rw(lidx, num_blocks);
   }
 
  private:
@@ -150,27 +173,50 @@ class MemTable : noncopyable {
   }
 
   /**
-   * a private helper function that calls mmap internally
-   * @return the pointer to the first block on the persistent memory
+   * reserve the address space for a file of num_blocks blocks and some room to
+   * grow; it takes no memory until mapped
+   * @return the first block of the reservation, aligned to a grow unit
    */
-  pmem::Block* mmap_file(size_t length, off_t offset, int flags = 0) {
+  pmem::Block* reserve(uint32_t num_blocks) {
+    num_reserved_blocks = std::min(next_pow2(num_blocks) * 2, MAX_NUM_BLOCKS);
+    size_t length = BLOCK_NUM_TO_SIZE(num_reserved_blocks) + GROW_UNIT_SIZE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    void* addr = posix::mmap(nullptr, length, PROT_NONE, flags, -1, 0);
+    PANIC_IF(addr == MAP_FAILED, "reserve address space failed");
+    reserved_regions.emplace_back(addr, length);
+    return reinterpret_cast<pmem::Block*>(
+        ALIGN_UP(reinterpret_cast<uintptr_t>(addr),
+                 static_cast<uintptr_t>(GROW_UNIT_SIZE)));
+  }
+
+  /**
+   * a private helper function that calls mmap internally to map the blocks
+   * [lidx, lidx + num_blocks) at their place in the reservation at blocks
+   */
+  void mmap_file(pmem::Block* blocks, uint32_t lidx, uint32_t num_blocks,
+                 int flags = 0) {
+    if (num_blocks == 0) return;
     TimerGuard<Event::MMAP> guard;
-    if constexpr (BuildOptions::map_sync)
+    if (runtime_options.map_sync)
       flags |= MAP_SHARED_VALIDATE | MAP_SYNC;
     else
       flags |= MAP_SHARED;
-    if constexpr (BuildOptions::map_populate) flags |= MAP_POPULATE;
+    if (runtime_options.map_populate) flags |= MAP_POPULATE;
+    flags |= MAP_FIXED;
 
-    void* addr = posix::mmap(nullptr, length, prot, flags, fd, offset);
+    void* addr_hint = &blocks[lidx];
+    size_t length = BLOCK_NUM_TO_SIZE(num_blocks);
+    auto offset = static_cast<off_t>(BLOCK_NUM_TO_SIZE(lidx));
+    void* addr = posix::mmap(addr_hint, length, prot, flags, fd, offset);
 
     if (unlikely(addr == MAP_FAILED)) {
-      if constexpr (BuildOptions::map_sync) {
+      if (runtime_options.map_sync) {
         if (errno == EOPNOTSUPP) {
           LOG_WARN("MAP_SYNC not supported for fd = %d. Retry w/o MAP_SYNC",
                    fd);
           flags &= ~(MAP_SHARED_VALIDATE | MAP_SYNC);
           flags |= MAP_SHARED;
-          addr = posix::mmap(nullptr, length, prot, flags, fd, offset);
+          addr = posix::mmap(addr_hint, length, prot, flags, fd, offset);
         }
       }
 
@@ -178,22 +224,14 @@ class MemTable : noncopyable {
     }
     VALGRIND_PMC_REGISTER_PMEM_MAPPING(addr, length);
     mmap_regions.emplace_back(addr, length);
-    return static_cast<pmem::Block*>(addr);
   }
 
  public:
   friend std::ostream& operator<<(std::ostream& out, const MemTable& m) {
     out << "MemTable:\n";
-    out << "\t" << 0 << " - " << m.first_region_num_blocks << ": "
-        << m.first_region << "\n";
-
-    uint32_t chunk_idx = m.first_region_num_blocks >> GROW_UNIT_IN_BLOCK_SHIFT;
-    for (const auto& mem_addr : m.table) {
-      LogicalBlockIdx chunk_begin_lidx = chunk_idx << GROW_UNIT_IN_BLOCK_SHIFT;
-      out << "\t" << chunk_begin_lidx << " - "
-          << chunk_begin_lidx + NUM_BLOCKS_PER_GROW << ": " << mem_addr << "\n";
-      ++chunk_idx;
-    }
+    out << "\t" << 0 << " - "
+        << m.num_mapped_blocks.load(std::memory_order_relaxed) << ": "
+        << m.base.load(std::memory_order_relaxed) << "\n";
     return out;
   }
 };
@@ -6,6 +6,7 @@
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <cassert>
@@ -45,6 +46,12 @@ DEFINE_FN(write);
 DEFINE_FN(pwrite);
 DEFINE_FN(read);
 DEFINE_FN(pread);
+DEFINE_FN(writev);
+DEFINE_FN(pwritev);
+DEFINE_FN(pwritev2);
+DEFINE_FN(readv);
+DEFINE_FN(preadv);
+DEFINE_FN(preadv2);
 DEFINE_FN(open);
 DEFINE_FN(fopen);
 DEFINE_FN(close);
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <fcntl.h>
 #include <pthread.h>
 #include <sys/xattr.h>
 
+#include <array>
 #include <atomic>
 #include <ostream>
 
@@ -108,6 +110,8 @@ class alignas(SHM_PER_THREAD_SIZE) PerThreadData {
     return tx_block_idx.load(std::memory_order_relaxed);
   }
 
+  [[nodiscard]] size_t get_index() const { return index; }
+
  private:
   /**
    * Check the robust mutex to see if the thread is alive.
@@ -156,9 +160,15 @@ class alignas(SHM_PER_THREAD_SIZE) PerThreadData {
 static_assert(sizeof(PerThreadData) == SHM_PER_THREAD_SIZE);
 
 class ShmMgr {
+  // the bytes of the shared memory locked to coordinate the processes that
+  // use the shared block table (see attach_blk_table)
+  enum BlkTableLock : off_t { SETUP, USERS };
+
   pmem::MetaBlock* meta;
   int fd = -1;
   void* addr = nullptr;
+  void* blk_table_addr = nullptr;
+  size_t blk_table_size = 0;
   char path[SHM_PATH_LEN]{};
 
  public:
@@ -201,6 +211,10 @@ class ShmMgr {
   }
 
   ~ShmMgr() {
+    if (blk_table_addr != nullptr) {
+      release_blk_table();
+      posix::munmap(blk_table_addr, blk_table_size);
+    }
     if (fd >= 0) posix::close(fd);
     if (addr != nullptr) posix::munmap(addr, SHM_SIZE);
   }
@@ -220,6 +234,32 @@ class ShmMgr {
     return reinterpret_cast<PerThreadData*>(starting_addr) + idx;
   }
 
+  /**
+   * @return the address of the range locks (see RangeLockTable), which follow
+   * the per-thread data
+   */
+  [[nodiscard]] void* get_range_locks_addr() const {
+    return static_cast<char*>(addr) + TOTAL_NUM_BITMAP_BYTES + SHM_GC_SIZE;
+  }
+
+  /**
+   * @return the address of the summary of the bitmap (see BitmapSummary),
+   * which follows the range locks
+   */
+  [[nodiscard]] void* get_bitmap_summary_addr() const {
+    return static_cast<char*>(addr) + TOTAL_NUM_BITMAP_BYTES + SHM_GC_SIZE +
+           SHM_RANGE_LOCK_SIZE;
+  }
+
+  /**
+   * @return the address of the last block claimed by an in-place append (see
+   * File::claim_inplace_append), which follows the summary of the bitmap
+   */
+  [[nodiscard]] void* get_append_claim_addr() const {
+    return static_cast<char*>(addr) + TOTAL_NUM_BITMAP_BYTES + SHM_GC_SIZE +
+           SHM_RANGE_LOCK_SIZE + SHM_BITMAP_SUMMARY_SIZE;
+  }
+
   /**
    * Allocate a new per-thread data for the current thread.
    * @return the address of the per-thread data
@@ -238,6 +278,70 @@ class ShmMgr {
     PANIC("No empty per-thread data");
   }
 
+  /**
+   * Map the block table shared across processes, which follows the bitmap, the
+   * per-thread data, the range locks, the summary of the bitmap, and the claim
+   * of in-place appends, and start attaching to it. The caller must then call
+   * finish_attach_blk_table; in between, no other process can attach to it.
+   *
+   * The shared memory lives longer than any process using it. If no other
+   * process is attached, the table may be stale (e.g., the tx history may have
+   * been rewritten by garbage collection since), so it is reset here and the
+   * caller shall build it again.
+   *
+   * @param size the size of the table, which is zero-filled when reset
+   * @param[out] is_reset whether the table has been reset
+   * @return the address of the table
+   */
+  void* start_attach_blk_table(size_t size, bool* is_reset) {
+    blk_table_size = ALIGN_UP(size, BLOCK_SIZE);
+    auto end = static_cast<off_t>(SHM_SIZE + blk_table_size);
+    // only the pages touched take memory
+    int rc = 0;
+    if (posix::lseek(fd, 0, SEEK_END) < end) {
+      rc = posix::ftruncate(fd, end);
+      PANIC_IF(rc < 0, "ftruncate on shared memory failed");
+    }
+    blk_table_addr =
+        posix::mmap(nullptr, blk_table_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_NORESERVE, fd, SHM_SIZE);
+    PANIC_IF(blk_table_addr == MAP_FAILED, "mmap shared block table failed");
+
+    // each attached process holds a read lock on USERS through its own open
+    // file description, which the kernel releases if the process dies
+    lock_byte(SETUP, F_WRLCK, true);
+    *is_reset = lock_byte(USERS, F_WRLCK, false);
+    if (*is_reset) {
+      rc = posix::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            SHM_SIZE, static_cast<off_t>(blk_table_size));
+      PANIC_IF(rc < 0, "fallocate on shared memory failed");
+    }
+    return blk_table_addr;
+  }
+
+  /**
+   * @param is_attached whether this process uses the table, or gave up
+   */
+  void finish_attach_blk_table(bool is_attached) {
+    lock_byte(USERS, is_attached ? F_RDLCK : F_UNLCK, false);
+    lock_byte(SETUP, F_UNLCK, false);
+  }
+
+  /**
+   * Free the memory of the shared block table if no other process is attached
+   * to it, since the next one to attach resets it anyway
+   */
+  void release_blk_table() const {
+    lock_byte(SETUP, F_WRLCK, true);
+    if (lock_byte(USERS, F_WRLCK, false)) {
+      int rc = posix::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                SHM_SIZE, static_cast<off_t>(blk_table_size));
+      if (rc < 0) LOG_WARN("fallocate on shared memory failed");
+      lock_byte(USERS, F_UNLCK, false);
+    }
+    lock_byte(SETUP, F_UNLCK, false);
+  }
+
   /**
    * Remove the shared memory object associated.
    */
@@ -319,6 +423,25 @@ class ShmMgr {
     unlink_by_shm_path(shm_path);
   }
 
+ private:
+  /**
+   * Lock a byte of the shared memory with an open file description lock
+   * @return whether the lock is acquired; always true if wait
+   */
+  bool lock_byte(BlkTableLock byte, short type, bool wait) const {
+    struct flock lock {};
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = byte;
+    lock.l_len = 1;
+    int rc = posix::fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+    if (rc == 0) return true;
+    PANIC_IF(wait || (errno != EAGAIN && errno != EACCES),
+             "fcntl on shared memory failed");
+    return false;
+  }
+
+ public:
   friend std::ostream& operator<<(std::ostream& os, const ShmMgr& mgr) {
     __msan_scoped_disable_interceptor_checks();
     os << "ShmMgr:\n"
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <atomic>
+
+#include "cursor/log.h"
+#include "cursor/tx_entry.h"
+#include "utils/logging.h"
+
+namespace madfs::dram {
+
+/**
+ * Flat-combining commit of tx entries. Instead of every writer racing for the
+ * tail with its own CAS and then walking over the entries that beat it, a
+ * writer publishes its entry in a slot, and whoever holds the combiner lock
+ * appends all published entries to consecutive tx slots in one pass.
+ *
+ * Since the entries are placed after entries that their writers have not
+ * seen, an entry whose content depends on the blocks it writes (e.g., a
+ * copy-on-write that copies the rest of a block) is only combined if none of
+ * the entries committed since its snapshot may have changed those blocks;
+ * "blind" entries (e.g., an aligned overwrite or a delta) are always combined.
+ * The writer must catch up with the entries between its snapshot and the
+ * assigned slot afterwards (see Tx::group_commit).
+ */
+class GroupCommit {
+ public:
+  constexpr static uint32_t NUM_SLOTS = 64;
+
+ private:
+  enum Status : uint32_t {
+    EMPTY = 0,
+    PENDING,
+    // committed; `cursor` points to the entry
+    DONE,
+    // not committed; the writer shall commit it itself
+    REJECTED,
+  };
+
+  struct alignas(CACHELINE_SIZE) Slot {
+    std::atomic<uint32_t> status{EMPTY};
+    pmem::TxEntry entry;
+    // in: where to start looking for the tail; out: where the entry is
+    TxCursor cursor;
+    // the tx block the log entries of an indirect entry are allocated for; the
+    // entry must be committed into this block (see LogEntryAllocator::reset)
+    LogicalBlockIdx tx_block_idx;
+    // if the entry is not blind, the blocks it depends on
+    bool is_blind;
+    VirtualBlockIdx first_vidx;
+    VirtualBlockIdx last_vidx;
+  };
+
+  Slot slots[NUM_SLOTS];
+  // one bit per slot that has a published entry
+  static_assert(NUM_SLOTS <= 64);
+  std::atomic<uint64_t> pending_mask{0};
+  pthread_spinlock_t combiner_lock;
+
+ public:
+  GroupCommit() { pthread_spin_init(&combiner_lock, PTHREAD_PROCESS_PRIVATE); }
+  ~GroupCommit() { pthread_spin_destroy(&combiner_lock); }
+
+  /**
+   * Commit an entry together with the entries published by other threads
+   *
+   * @param[in] entry the entry to commit
+   * @param[in] tx_block_idx for an indirect entry, the tx block it must be
+   * committed into; ignored for an inline entry
+   * @param[in] is_blind whether the entry does not depend on the blocks it
+   * writes; if not, it is only committed if no entry since the cursor may have
+   * changed [first_vidx, last_vidx]
+   * @param[in] first_vidx the first block the entry depends on
+   * @param[in] last_vidx the last block the entry depends on
+   * @param[in,out] cursor in: a cursor no later than the tail; out: where the
+   * entry is committed on success
+   * @param[in] mem_table used to find the memory address of tx blocks
+   * @param[in] allocator used to allocate new tx blocks on overflow
+   * @return true on success; false if the entry is not committed and the
+   * caller shall commit it with TxCursor::try_commit instead
+   */
+  bool commit(pmem::TxEntry entry, LogicalBlockIdx tx_block_idx, bool is_blind,
+              VirtualBlockIdx first_vidx, VirtualBlockIdx last_vidx,
+              TxCursor& cursor, MemTable* mem_table, Allocator* allocator) {
+    const uint32_t slot_idx = static_cast<uint32_t>(tid) % NUM_SLOTS;
+    Slot& slot = slots[slot_idx];
+
+    // the slot is shared by threads with the same tid modulo NUM_SLOTS; fall
+    // back to committing on our own if it is taken
+    uint32_t expected = EMPTY;
+    if (!slot.status.compare_exchange_strong(expected, PENDING,
+                                             std::memory_order_acquire))
+      return false;
+    slot.entry = entry;
+    slot.cursor = cursor;
+    slot.tx_block_idx = tx_block_idx;
+    slot.is_blind = is_blind;
+    slot.first_vidx = first_vidx;
+    slot.last_vidx = last_vidx;
+    pending_mask.fetch_or(uint64_t{1} << slot_idx, std::memory_order_release);
+
+    uint32_t status;
+    while ((status = slot.status.load(std::memory_order_acquire)) == PENDING) {
+      if (pthread_spin_trylock(&combiner_lock) == 0) {
+        combine(mem_table, allocator);
+        pthread_spin_unlock(&combiner_lock);
+      } else {
+        __builtin_ia32_pause();
+      }
+    }
+
+    cursor = slot.cursor;
+    slot.status.store(EMPTY, std::memory_order_release);
+    return status == DONE;
+  }
+
+ private:
+  /**
+   * Commit all published entries; must be called with combiner_lock held
+   */
+  void combine(MemTable* mem_table, Allocator* allocator) {
+    uint64_t mask = pending_mask.exchange(0, std::memory_order_acquire);
+    if (mask == 0) return;
+
+    // every published cursor is no later than the tail, so any of them works
+    TxCursor tail = slots[__builtin_ctzll(mask)].cursor;
+    uint32_t num_committed = 0;
+    while (mask != 0) {
+      Slot& slot = slots[__builtin_ctzll(mask)];
+      mask &= mask - 1;
+      bool success = append(slot, tail, mem_table, allocator);
+      num_committed += success;
+      slot.status.store(success ? DONE : REJECTED, std::memory_order_release);
+    }
+    LOG_TRACE("GroupCommit: committed %u entries", num_committed);
+  }
+
+  /**
+   * Append the entry in the slot at or after the tail
+   *
+   * @param[in] slot the slot to commit
+   * @param[in,out] tail the cursor to start from; advanced past the entry
+   * @return whether the entry is committed
+   */
+  static bool append(Slot& slot, TxCursor& tail, MemTable* mem_table,
+                     Allocator* allocator) {
+    // the entries from the snapshot of the writer on that have been checked
+    TxCursor checked = slot.cursor;
+    while (true) {
+      tail.handle_overflow(mem_table, allocator);
+      // skip the taken slots first so that the block check below is made
+      // against the real tail
+      if (!tail.get_entry().is_valid()) {
+        if (!slot.entry.is_inline() && tail.idx.block_idx != slot.tx_block_idx)
+          return false;
+        if (!slot.is_blind && !check_unchanged(slot, checked, tail, mem_table))
+          return false;
+        pmem::TxEntry conflict_entry =
+            tail.try_commit(slot.entry, mem_table, allocator);
+        if (!conflict_entry.is_valid()) {
+          slot.cursor = tail;
+          tail.advance(mem_table);
+          return true;
+        }
+      }
+      tail.advance(mem_table);
+    }
+  }
+
+  /**
+   * Check the entries from checked up to the tail for whether any may have
+   * changed the blocks the entry in the slot depends on
+   *
+   * @param[in,out] checked the first entry not yet checked; advanced to tail
+   * @return true if none has
+   */
+  static bool check_unchanged(const Slot& slot, TxCursor& checked,
+                              const TxCursor& tail, MemTable* mem_table) {
+    while (true) {
+      // the next tx block must exist since the tail is after it
+      checked.handle_overflow(mem_table);
+      if (checked == tail) return true;
+      if (may_change(checked.get_entry(), slot.first_vidx, slot.last_vidx,
+                     mem_table))
+        return false;
+      checked.advance(mem_table);
+    }
+  }
+
+  /**
+   * @return whether a committed entry may have changed any block in
+   * [first_vidx, last_vidx]; a size entry always may, since the bytes it adds
+   * were written in place
+   */
+  static bool may_change(pmem::TxEntry entry, VirtualBlockIdx first_vidx,
+                         VirtualBlockIdx last_vidx, MemTable* mem_table) {
+    if (entry.is_size()) return true;
+    if (entry.is_inline()) {
+      VirtualBlockIdx begin_vidx = entry.inline_entry.begin_virtual_idx;
+      return begin_vidx <= last_vidx &&
+             begin_vidx + entry.inline_entry.num_blocks > first_vidx;
+    }
+    LogCursor log_cursor(entry.indirect_entry, mem_table);
+    do {
+      if (log_cursor->begin_vidx <= last_vidx &&
+          log_cursor->begin_vidx + log_cursor->num_blocks > first_vidx)
+        return true;
+    } while (log_cursor.advance(mem_table));
+    return false;
+  }
+};
+
+}  // namespace madfs::dram
@@ -2,80 +2,118 @@
 
 #include <pthread.h>
 
-namespace madfs::dram {
+#include "config.h"
+#include "utils/utils.h"
 
-namespace detail {
+namespace madfs::dram {
 
 /**
- * @brief A nop lock struct.
- *
- * By default, the concurrency control is non-blocking, and this struct is used
- * as a dummy lock.
+ * @brief The lock of a file, whose kind is fixed by the concurrency control
+ * chosen when the file is opened (see RuntimeOptions::cc).
  *
- * This struct does not occupy any space if embedded in another class or struct.
+ * With the default optimistic concurrency control, it is never taken. The
+ * other kinds use a robust mutex (MUTEX), a pthread_spinlock_t (SPINLOCK), or
+ * a pthread_rwlock_t (RWLOCK). Since the kind never changes afterwards, the
+ * branches on it are always predicted.
  */
-struct NopLock {
-  void rdlock(){};
-  void wrlock(){};
-  void unlock(){};
-};
+class Lock {
+  const ConcurrencyControl cc;
+  union {
+    pthread_mutex_t mutex;
+    pthread_spinlock_t spinlock;
+    pthread_rwlock_t rwlock;
+  };
 
-/**
- * @brief A lock struct that uses pthread_mutex_t.
- *
- * Used when MADFS_CC_MUTEX is set.
- */
-struct MutexLock {
-  pthread_mutex_t mutex;
-  MutexLock() {  // NOLINT(cppcoreguidelines-pro-type-member-init)
-    init_robust_mutex(&mutex);
+ public:
+  explicit Lock(ConcurrencyControl cc) : cc(cc) {
+    switch (cc) {
+      case ConcurrencyControl::OCC:
+        break;
+      case ConcurrencyControl::MUTEX:
+        init_robust_mutex(&mutex);
+        break;
+      case ConcurrencyControl::SPINLOCK:
+        pthread_spin_init(&spinlock, PTHREAD_PROCESS_PRIVATE);
+        break;
+      case ConcurrencyControl::RWLOCK:
+        pthread_rwlock_init(&rwlock, nullptr);
+        break;
+    }
   }
-  ~MutexLock() { pthread_mutex_destroy(&mutex); }
-  void rdlock() { pthread_mutex_lock(&mutex); };
-  void wrlock() { pthread_mutex_lock(&mutex); };
-  void unlock() { pthread_mutex_unlock(&mutex); };
-};
 
-/**
- * @brief A lock struct that uses pthread_spinlock_t.
- *
- * Used when MADFS_CC_SPINLOCK is set.
- */
-struct Spinlock {
-  pthread_spinlock_t spinlock;
-  Spinlock() {  // NOLINT(cppcoreguidelines-pro-type-member-init)
-    pthread_spin_init(&spinlock, PTHREAD_PROCESS_PRIVATE);
+  ~Lock() {
+    switch (cc) {
+      case ConcurrencyControl::OCC:
+        break;
+      case ConcurrencyControl::MUTEX:
+        pthread_mutex_destroy(&mutex);
+        break;
+      case ConcurrencyControl::SPINLOCK:
+        pthread_spin_destroy(&spinlock);
+        break;
+      case ConcurrencyControl::RWLOCK:
+        pthread_rwlock_destroy(&rwlock);
+        break;
+    }
   }
-  ~Spinlock() { pthread_spin_destroy(&spinlock); }
-  void rdlock() { pthread_spin_lock(&spinlock); };
-  void wrlock() { pthread_spin_lock(&spinlock); };
-  void unlock() { pthread_spin_unlock(&spinlock); };
-};
 
-/**
- * @brief A lock struct that uses pthread_rwlock_t.
- *
- * Used when MADFS_CC_RWLOCK is set.
- */
-struct RwLock {
-  pthread_rwlock_t rwlock;
-  RwLock() {  // NOLINT(cppcoreguidelines-pro-type-member-init)
-    pthread_rwlock_init(&rwlock, nullptr);
+  Lock(const Lock&) = delete;
+  Lock& operator=(const Lock&) = delete;
+
+  /**
+   * @return whether the txs commit optimistically, i.e., the lock is a nop
+   */
+  [[nodiscard]] bool is_optimistic() const {
+    return cc == ConcurrencyControl::OCC;
   }
-  ~RwLock() { pthread_rwlock_destroy(&rwlock); }
-  void rdlock() { pthread_rwlock_rdlock(&rwlock); };
-  void wrlock() { pthread_rwlock_wrlock(&rwlock); };
-  void unlock() { pthread_rwlock_unlock(&rwlock); };
-};
 
-static auto make_cc_lock() {
-  if constexpr (BuildOptions::cc_occ) return NopLock{};
-  if constexpr (BuildOptions::cc_mutex) return MutexLock{};
-  if constexpr (BuildOptions::cc_spinlock) return Spinlock{};
-  if constexpr (BuildOptions::cc_rwlock) return RwLock{};
-}
+  void rdlock() {
+    switch (cc) {
+      case ConcurrencyControl::OCC:
+        break;
+      case ConcurrencyControl::MUTEX:
+        pthread_mutex_lock(&mutex);
+        break;
+      case ConcurrencyControl::SPINLOCK:
+        pthread_spin_lock(&spinlock);
+        break;
+      case ConcurrencyControl::RWLOCK:
+        pthread_rwlock_rdlock(&rwlock);
+        break;
+    }
+  }
+
+  void wrlock() {
+    switch (cc) {
+      case ConcurrencyControl::OCC:
+        break;
+      case ConcurrencyControl::MUTEX:
+        pthread_mutex_lock(&mutex);
+        break;
+      case ConcurrencyControl::SPINLOCK:
+        pthread_spin_lock(&spinlock);
+        break;
+      case ConcurrencyControl::RWLOCK:
+        pthread_rwlock_wrlock(&rwlock);
+        break;
+    }
+  }
 
-}  // namespace detail
+  void unlock() {
+    switch (cc) {
+      case ConcurrencyControl::OCC:
+        break;
+      case ConcurrencyControl::MUTEX:
+        pthread_mutex_unlock(&mutex);
+        break;
+      case ConcurrencyControl::SPINLOCK:
+        pthread_spin_unlock(&spinlock);
+        break;
+      case ConcurrencyControl::RWLOCK:
+        pthread_rwlock_unlock(&rwlock);
+        break;
+    }
+  }
+};
 
-using Lock = decltype(detail::make_cc_lock());
 }  // namespace madfs::dram
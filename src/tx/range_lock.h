@@ -0,0 +1,220 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+
+#include "const.h"
+#include "idx.h"
+#include "utils/logging.h"
+#include "utils/timer.h"
+
+namespace madfs::dram {
+
+/**
+ * A range lock in shared memory; all zeros is a free lock of a cold range
+ */
+struct alignas(CACHELINE_SIZE) RangeLock {
+  // the time (see RangeLockTable::now) until which the lock is held; the lock
+  // is free once it has passed
+  std::atomic<uint64_t> lease;
+  // the number of txs on the range so far, and the number of those in the
+  // current window that copied a block again or waited for the lock
+  std::atomic<uint32_t> num_txs;
+  std::atomic<uint32_t> num_conflicts;
+  // whether the txs on the range take the lock
+  std::atomic<bool> is_hot;
+};
+
+static_assert(sizeof(RangeLock) == CACHELINE_SIZE);
+
+/**
+ * Locks that copy-on-write txs on hot blocks take before their snapshot (see
+ * RuntimeOptions::cc_adaptive).
+ *
+ * Under optimistic concurrency control, a copy-on-write tx that loses the race
+ * for a block copies the block again (see SingleBlockTx), which wastes
+ * bandwidth if many threads write the block. Each tx records per range whether
+ * it had to, and once enough of them did, the txs on the range take its lock
+ * and wait for each other instead. The range gets cold again once the lock is
+ * rarely waited for.
+ *
+ * A lock is only a hint: the txs still commit optimistically, so it is harmless
+ * if a tx does not hold the lock (long enough). A lock is leased for a short
+ * time, so that a holder that dies or is slow is not waited for long.
+ *
+ * Since conflicts are per block, the virtual blocks are hashed into the ranges
+ * one by one rather than in runs; the ranges are in the shared memory of the
+ * file, so that all processes writing to it agree.
+ */
+class RangeLockTable {
+ public:
+  static constexpr uint32_t NUM_RANGES =
+      SHM_RANGE_LOCK_SIZE / sizeof(RangeLock);
+  static constexpr uint64_t LEASE_NS = 100'000;
+  // a range gets hot once a quarter of the txs in a window conflicted, and
+  // cold once fewer than 1/16 did
+  static constexpr uint32_t WINDOW_SIZE = 64;
+  static constexpr uint32_t HOT_THRESHOLD = WINDOW_SIZE / 4;
+  static constexpr uint32_t COLD_THRESHOLD = WINDOW_SIZE / 16;
+
+  /**
+   * The ranges of the blocks a tx may copy again, held while the tx runs
+   */
+  class Guard {
+    RangeLockTable* table{nullptr};
+    uint32_t ranges[2]{};
+    uint32_t num_ranges{0};
+    bool is_locked[2]{};
+    // the leases installed, so that a tx only ever releases its own
+    uint64_t leases[2]{};
+    bool has_conflict{false};
+
+   public:
+    /**
+     * Enter the ranges of the blocks first and last, and lock those that are
+     * hot; nop if the table is not attached
+     */
+    void enter(RangeLockTable* range_locks, VirtualBlockIdx first,
+               VirtualBlockIdx last) {
+      if (!range_locks->is_attached()) return;
+      table = range_locks;
+      uint32_t first_range = get_range(first), last_range = get_range(last);
+      // lock in order, so that two txs never wait for each other
+      ranges[0] = std::min(first_range, last_range);
+      ranges[1] = std::max(first_range, last_range);
+      num_ranges = first_range == last_range ? 1 : 2;
+      for (uint32_t i = 0; i < num_ranges; ++i) {
+        if (!table->is_hot(ranges[i])) continue;
+        bool has_waited;
+        leases[i] = table->lock(ranges[i], has_waited);
+        has_conflict |= has_waited;
+        is_locked[i] = true;
+      }
+    }
+
+    /**
+     * Record that the tx has to copy a block again
+     */
+    void add_conflict() { has_conflict = true; }
+
+    /**
+     * Unlock the ranges and record whether the tx conflicted
+     */
+    void exit() {
+      for (uint32_t i = 0; i < num_ranges; ++i) {
+        if (is_locked[i]) table->unlock(ranges[i], leases[i]);
+        table->record(ranges[i], has_conflict);
+      }
+      num_ranges = 0;
+    }
+  };
+
+ private:
+  RangeLock* locks{nullptr};
+
+ public:
+  /**
+   * Use the locks at addr; until then, no range is ever locked
+   */
+  void attach(void* addr) { locks = static_cast<RangeLock*>(addr); }
+
+  [[nodiscard]] bool is_attached() const { return locks != nullptr; }
+
+  [[nodiscard]] static uint32_t get_range(VirtualBlockIdx vidx) {
+    return vidx.get() % NUM_RANGES;
+  }
+
+  [[nodiscard]] bool is_hot(uint32_t range) const {
+    return locks[range].is_hot.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @param[out] has_waited whether the lock was held by someone else
+   * @return the lease installed, to be passed to unlock
+   */
+  uint64_t lock(uint32_t range, bool& has_waited) {
+    timer.count<Event::RANGE_LOCK>();
+    std::atomic<uint64_t>& lease = locks[range].lease;
+    for (uint32_t i = 0;; ++i) {
+      uint64_t curr_time = now();
+      uint64_t curr_lease = lease.load(std::memory_order_relaxed);
+      uint64_t new_lease = curr_time + LEASE_NS;
+      if (curr_lease <= curr_time &&
+          lease.compare_exchange_weak(curr_lease, new_lease,
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed)) {
+        if (i > 0) timer.count<Event::RANGE_LOCK_WAIT>();
+        has_waited = i > 0;
+        return new_lease;
+      }
+      // the holder may be descheduled if the threads outnumber the cores
+      if (i % 64 == 63)
+        std::this_thread::yield();
+      else
+        _mm_pause();
+    }
+  }
+
+  /**
+   * Release the lease installed by lock, unless it has expired and someone
+   * else has taken the lock since
+   */
+  void unlock(uint32_t range, uint64_t own_lease) {
+    locks[range].lease.compare_exchange_strong(own_lease, 0,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed);
+  }
+
+  /**
+   * Record whether a tx on the range conflicted; the one that completes a
+   * window decides whether the range is hot in the next one
+   */
+  void record(uint32_t range, bool has_conflict) {
+    RangeLock& range_lock = locks[range];
+    if (has_conflict)
+      range_lock.num_conflicts.fetch_add(1, std::memory_order_relaxed);
+    uint32_t num_txs =
+        range_lock.num_txs.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (num_txs % WINDOW_SIZE != 0) return;
+
+    uint32_t num_conflicts =
+        range_lock.num_conflicts.exchange(0, std::memory_order_relaxed);
+    bool is_hot = range_lock.is_hot.load(std::memory_order_relaxed);
+    if (!is_hot && num_conflicts >= HOT_THRESHOLD) {
+      range_lock.is_hot.store(true, std::memory_order_relaxed);
+      LOG_DEBUG("range %u is hot: %u conflicts", range, num_conflicts);
+    } else if (is_hot && num_conflicts < COLD_THRESHOLD) {
+      range_lock.is_hot.store(false, std::memory_order_relaxed);
+      LOG_DEBUG("range %u is cold: %u conflicts", range, num_conflicts);
+    }
+  }
+
+  friend std::ostream& operator<<(std::ostream& out,
+                                  const RangeLockTable& table) {
+    if (!table.is_attached()) return out;
+    out << "RangeLockTable: hot ranges = [";
+    for (uint32_t range = 0, n = 0; range < NUM_RANGES; ++range)
+      if (table.is_hot(range)) out << (n++ ? ", " : "") << range;
+    out << "]\n";
+    return out;
+  }
+
+ private:
+  /**
+   * @return the time in nanoseconds; the clock is the same for all processes
+   */
+  static uint64_t now() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+};
+
+}  // namespace madfs::dram
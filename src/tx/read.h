@@ -1,20 +1,21 @@
 #pragma once
 
 #include "tx.h"
+#include "user_buf.h"
 
 namespace madfs::dram {
 class ReadTx : public Tx {
  protected:
-  char* const buf;
+  const ReadBuf buf;
 
  public:
-  ReadTx(File* file, char* buf, size_t count, size_t offset)
+  ReadTx(File* file, ReadBuf buf, size_t count, size_t offset)
       : Tx(file, count, offset), buf(buf) {
     lock->rdlock();  // nop lock is used by default
   }
 
-  ReadTx(File* file, char* buf, size_t count, size_t offset, FileState state,
-         uint64_t ticket)
+  ReadTx(File* file, ReadBuf buf, size_t count, size_t offset,
+         FileState state, uint64_t ticket)
       : ReadTx(file, buf, count, offset) {
     is_offset_depend = true;
     this->state = state;
@@ -48,31 +49,42 @@ class ReadTx : public Tx {
       end_vidx = BLOCK_SIZE_TO_IDX(ALIGN_UP(end_offset, BLOCK_SIZE));
     }
 
+  copy:
     // copy the blocks
     {
       TimerGuard<Event::READ_TX_COPY> timer_guard;
 
-      const char* addr =
-          mem_table->lidx_to_addr_ro(blk_table->vidx_to_lidx(begin_vidx))
-              ->data_ro();
-      addr += first_block_offset;
-      size_t contiguous_bytes = first_block_size;
+      const char* addr = nullptr;
+      size_t contiguous_bytes = 0;
       size_t buf_offset = 0;
-
-      for (VirtualBlockIdx vidx = begin_vidx + 1; vidx < end_vidx; ++vidx) {
-        const pmem::Block* curr_block =
-            mem_table->lidx_to_addr_ro(blk_table->vidx_to_lidx(vidx));
-        if (addr + contiguous_bytes == curr_block->data_ro()) {
-          contiguous_bytes += BLOCK_SIZE;
+      size_t skip_bytes = first_block_offset;
+
+      // copy run by run; each hole maps to the same block
+      for (VirtualBlockIdx vidx = begin_vidx; vidx < end_vidx;) {
+        auto [lidx, num_blocks] = blk_table->get_extent(vidx);
+        num_blocks = std::min(num_blocks, end_vidx - vidx);
+        if (lidx == 0) num_blocks = 1;
+        vidx += num_blocks;
+
+        const char* run_addr =
+            mem_table->lidx_to_addr_ro(lidx, num_blocks)->data_ro() +
+            skip_bytes;
+        size_t run_bytes = BLOCK_NUM_TO_SIZE(num_blocks) - skip_bytes;
+        skip_bytes = 0;
+        if (addr && addr + contiguous_bytes == run_addr) {
+          contiguous_bytes += run_bytes;
           continue;
         }
-        dram::memcpy(buf + buf_offset, addr, contiguous_bytes);
-        buf_offset += contiguous_bytes;
-        contiguous_bytes = BLOCK_SIZE;
-        addr = curr_block->data_ro();
+        if (addr) {
+          buf.copy_from(buf_offset, addr, contiguous_bytes);
+          buf_offset += contiguous_bytes;
+        }
+        addr = run_addr;
+        contiguous_bytes = run_bytes;
       }
-      dram::memcpy(buf + buf_offset, addr,
-                   std::min(contiguous_bytes, count - buf_offset));
+      buf.copy_from(buf_offset, addr,
+                    std::min(contiguous_bytes, count - buf_offset));
+      apply_delta();
     }
 
   redo:
@@ -89,6 +101,15 @@ class ReadTx : public Tx {
       if (!handle_conflict(curr_entry, begin_vidx, end_vidx - 1, redo_image))
         break;
 
+      // a delta cannot be redone from the redo image alone; copy everything
+      // again from the latest block table
+      if (has_inplace_conflict) {
+        std::fill(redo_image.begin(), redo_image.end(), 0);
+        blk_table->update(&state);
+        timer.stop<Event::READ_TX_VALIDATE>();
+        goto copy;
+      }
+
       // redo:
       LogicalBlockIdx redo_lidx;
 
@@ -96,8 +117,8 @@ class ReadTx : public Tx {
       redo_lidx = redo_image[0];
       if (redo_lidx != 0) {
         const pmem::Block* curr_block = mem_table->lidx_to_addr_ro(redo_lidx);
-        dram::memcpy(buf, curr_block->data_ro() + first_block_offset,
-                     first_block_size);
+        buf.copy_from(0, curr_block->data_ro() + first_block_offset,
+                      first_block_size);
         redo_image[0] = 0;
       }
       size_t buf_offset = first_block_size;
@@ -108,7 +129,7 @@ class ReadTx : public Tx {
         redo_lidx = redo_image[curr_vidx - begin_vidx];
         if (redo_lidx != 0) {
           const pmem::Block* curr_block = mem_table->lidx_to_addr_ro(redo_lidx);
-          dram::memcpy(buf + buf_offset, curr_block->data_ro(), BLOCK_SIZE);
+          buf.copy_from(buf_offset, curr_block->data_ro(), BLOCK_SIZE);
           redo_image[curr_vidx - begin_vidx] = 0;
         }
         buf_offset += BLOCK_SIZE;
@@ -119,8 +140,7 @@ class ReadTx : public Tx {
         redo_lidx = redo_image[curr_vidx - begin_vidx];
         if (redo_lidx != 0) {
           const pmem::Block* curr_block = mem_table->lidx_to_addr_ro(redo_lidx);
-          dram::memcpy(buf + buf_offset, curr_block->data_ro(),
-                       count - buf_offset);
+          buf.copy_from(buf_offset, curr_block->data_ro(), count - buf_offset);
           redo_image[curr_vidx - begin_vidx] = 0;
         }
       }
@@ -142,5 +162,26 @@ class ReadTx : public Tx {
     allocator->tx_block.pin(state.get_tx_block_idx());
     return static_cast<ssize_t>(count);
   }
+
+ private:
+  // apply the deltas of the blocks in range to buf
+  void apply_delta() const {
+    char* contiguous_buf = buf.get_contiguous();
+    size_t buf_offset = 0;
+    for (VirtualBlockIdx vidx = begin_vidx; vidx < end_vidx; ++vidx) {
+      size_t block_begin = BLOCK_IDX_TO_SIZE(vidx);
+      size_t begin = std::max(offset, block_begin) - block_begin;
+      size_t end = std::min(end_offset, block_begin + BLOCK_SIZE) - block_begin;
+      if (contiguous_buf) {
+        blk_table->apply_delta(vidx, contiguous_buf + buf_offset, begin, end);
+      } else if (blk_table->has_delta(vidx)) {
+        // copy the range again from a materialized copy of the block
+        alignas(CACHELINE_SIZE) static thread_local char scratch[BLOCK_SIZE];
+        const char* block = blk_table->get_block_ro(vidx, scratch);
+        buf.copy_from(buf_offset, block + begin, end - begin);
+      }
+      buf_offset += end - begin;
+    }
+  }
 };
 }  // namespace madfs::dram
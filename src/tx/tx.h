@@ -49,6 +49,12 @@ class Tx {
 
   FileState state;
 
+  // set by handle_conflict if a tx that changes the content of a block in
+  // [first_vidx, last_vidx] without remapping it (i.e., a delta or an in-place
+  // append) has been committed; the conflict image cannot describe it, so the
+  // caller must catch up with the block table instead (see refresh_state)
+  bool has_inplace_conflict;
+
   Tx(File* file, size_t count, size_t offset)
       : file(file),
         lock(&file->lock),
@@ -66,7 +72,8 @@ class Tx {
         begin_vidx(BLOCK_SIZE_TO_IDX(offset)),
         end_vidx(BLOCK_SIZE_TO_IDX(ALIGN_UP(end_offset, BLOCK_SIZE))),
         num_blocks(end_vidx - begin_vidx),
-        is_offset_depend(false) {}
+        is_offset_depend(false),
+        has_inplace_conflict(false) {}
 
   ~Tx() { lock->unlock(); }
 
@@ -75,7 +82,9 @@ class Tx {
   static ssize_t exec_and_release_offset(Params&&... params) {
     TX tx(std::forward<Params>(params)...);
     ssize_t ret = tx.exec();
-    tx.offset_mgr->release(tx.ticket, tx.state.cursor);
+    // a negative return means the tx is not applicable and nothing is done; the
+    // caller will retry with another tx, which releases the ticket instead
+    if (ret >= 0) tx.offset_mgr->release(tx.ticket, tx.state.cursor);
     return ret;
   }
 
@@ -99,48 +108,15 @@ class Tx {
                        std::vector<LogicalBlockIdx>& conflict_image,
                        bool* into_new_block = nullptr) {
     bool has_conflict = false;
+    has_inplace_conflict = false;
     if (into_new_block) *into_new_block = false;
     do {
-      if (curr_entry.is_inline()) {  // inline tx entry
-        has_conflict |= get_conflict_image(
-            first_vidx, last_vidx, curr_entry.inline_entry.begin_virtual_idx,
-            curr_entry.inline_entry.begin_logical_idx,
-            curr_entry.inline_entry.num_blocks, conflict_image);
-        VirtualBlockIdx end_vidx = curr_entry.inline_entry.begin_virtual_idx +
-                                   curr_entry.inline_entry.num_blocks;
-        uint64_t possible_file_size = BLOCK_IDX_TO_SIZE(end_vidx);
-        if (possible_file_size > state.file_size)
-          state.file_size = possible_file_size;
-      } else {  // non-inline tx entry
-        LogCursor log_cursor(curr_entry.indirect_entry, mem_table);
-
-        do {
-          uint32_t i;
-          for (i = 0; i < log_cursor->get_lidxs_len() - 1; ++i) {
-            has_conflict |= get_conflict_image(
-                first_vidx, last_vidx,
-                log_cursor->begin_vidx +
-                    (i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT),
-                log_cursor->begin_lidxs[i], BITMAP_ENTRY_BLOCKS_CAPACITY,
-                conflict_image);
-          }
-          has_conflict |= get_conflict_image(
-              first_vidx, last_vidx,
-              log_cursor->begin_vidx +
-                  (i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT),
-              log_cursor->begin_lidxs[i],
-              log_cursor->get_last_lidx_num_blocks(), conflict_image);
-          VirtualBlockIdx end_vidx = log_cursor->begin_vidx +
-                                     (i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT) +
-                                     log_cursor->get_last_lidx_num_blocks();
-          uint64_t possible_file_size =
-              BLOCK_IDX_TO_SIZE(end_vidx) - log_cursor->leftover_bytes;
-          if (possible_file_size > state.file_size)
-            state.file_size = possible_file_size;
-
-        } while (log_cursor.advance(mem_table));
+      if (skip_unrelated(first_vidx, last_vidx, into_new_block)) {
+        curr_entry = state.cursor.get_entry();
+        if (!curr_entry.is_valid()) break;
       }
-      // only update into_new_block if it is not nullptr and not set true yet
+      has_conflict |= handle_conflict_entry(curr_entry, first_vidx, last_vidx,
+                                            conflict_image);
       if (!state.cursor.advance(
               mem_table,
               /*allocator=*/nullptr,
@@ -152,7 +128,158 @@ class Tx {
     return has_conflict;
   }
 
+  /**
+   * Commit an entry through group commit (see GroupCommit). The entries
+   * committed between the snapshot and the assigned slot are handled as
+   * conflicts, e.g., to update recycle image and file_size.
+   *
+   * @param[in] entry the entry to commit
+   * @param[in] first_vidx the first block's virtual idx
+   * @param[in] last_vidx the last block's virtual idx
+   * @param[out] conflict_image a list of lidx that conflict with the current tx
+   * @param[in] is_blind whether the content of the entry does not depend on the
+   * entries committed after the snapshot; if not, it is only committed if none
+   * of them may have changed [first_vidx, last_vidx]
+   * @return true if committed, in which case state.cursor points to the entry;
+   * false if the caller shall commit it with try_commit instead
+   */
+  bool group_commit(pmem::TxEntry entry, VirtualBlockIdx first_vidx,
+                    VirtualBlockIdx last_vidx,
+                    std::vector<LogicalBlockIdx>& conflict_image,
+                    bool is_blind = true) {
+    if (!runtime_options.group_commit) return false;
+    TxCursor cursor = state.cursor;
+    if (!file->group_commit.commit(entry, state.get_tx_block_idx(), is_blind,
+                                   first_vidx, last_vidx, cursor, mem_table,
+                                   allocator))
+      return false;
+    has_inplace_conflict = false;
+    // the snapshot may be left at the end of a tx block, as in handle_conflict;
+    // the next block must exist since the entry is committed after it
+    state.cursor.handle_overflow(mem_table);
+    while (state.cursor != cursor) {
+      handle_conflict_entry(state.cursor.get_entry(), first_vidx, last_vidx,
+                            conflict_image);
+      // the next block must exist since the entry is committed after it
+      state.cursor.advance(mem_table);
+    }
+    return true;
+  }
+
+  /**
+   * Catch up with the latest block table after an in-place conflict. The caller
+   * must rebuild everything derived from the block table afterwards.
+   *
+   * @return whether the cursor has been advanced into a new tx block
+   */
+  bool refresh_state() {
+    LogicalBlockIdx prev_tx_block_idx = state.get_tx_block_idx();
+    blk_table->update(&state, allocator);
+    return prev_tx_block_idx != state.get_tx_block_idx();
+  }
+
  private:
+  /**
+   * Move the cursor past the committed entries that cannot conflict with
+   * [first_vidx, last_vidx] without reading them from the log, using the
+   * summary of the entries applied recently (see BlkTable::find_conflict);
+   * update file_size as handle_conflict_entry would
+   *
+   * @param[out] into_new_block if not nullptr, set if the cursor has been
+   * advanced into a new tx block
+   * @return whether the cursor has been moved to another entry; false if it
+   * is left in an overflow state at the end of the history
+   */
+  bool skip_unrelated(VirtualBlockIdx first_vidx, VirtualBlockIdx last_vidx,
+                      bool* into_new_block) {
+    uint64_t seq, file_size;
+    if (!blk_table->find_conflict(state.cursor, first_vidx, last_vidx, &seq,
+                                  &file_size) ||
+        seq == state.cursor.get_seq())
+      return false;
+    if (file_size > state.file_size) state.file_size = file_size;
+    bool is_new_block = false, is_overflow_handled = false;
+    // the entries before seq are applied, so the history does not end earlier
+    [[maybe_unused]] bool success =
+        state.cursor.skip_to(mem_table, seq, &is_new_block);
+    assert(success);
+    success = state.cursor.handle_overflow(mem_table, /*allocator=*/nullptr,
+                                           &is_overflow_handled);
+    if (into_new_block && (is_new_block || is_overflow_handled))
+      *into_new_block = true;
+    return success;
+  }
+
+  /**
+   * Handle a single committed entry for handle_conflict; update file_size if
+   * necessary
+   *
+   * @return whether the entry conflicts with [first_vidx, last_vidx]
+   */
+  bool handle_conflict_entry(pmem::TxEntry curr_entry,
+                             VirtualBlockIdx first_vidx,
+                             VirtualBlockIdx last_vidx,
+                             std::vector<LogicalBlockIdx>& conflict_image) {
+    bool has_conflict = false;
+    if (curr_entry.is_size()) {  // size tx entry
+      // the bytes between the old and the new file size were written in
+      // place, so the last block may have changed
+      uint64_t new_file_size = curr_entry.size_entry.file_size;
+      if (new_file_size > state.file_size) {
+        VirtualBlockIdx le_first_vidx = BLOCK_SIZE_TO_IDX(state.file_size);
+        VirtualBlockIdx le_last_vidx = BLOCK_SIZE_TO_IDX(new_file_size - 1);
+        if (le_first_vidx <= last_vidx && le_last_vidx >= first_vidx) {
+          has_conflict = true;
+          has_inplace_conflict = true;
+        }
+        state.file_size = new_file_size;
+      }
+    } else if (curr_entry.is_inline()) {  // inline tx entry
+      has_conflict |= get_conflict_image(
+          first_vidx, last_vidx, curr_entry.inline_entry.begin_virtual_idx,
+          curr_entry.inline_entry.begin_logical_idx,
+          curr_entry.inline_entry.num_blocks, conflict_image);
+      VirtualBlockIdx end_vidx = curr_entry.inline_entry.begin_virtual_idx +
+                                 curr_entry.inline_entry.num_blocks;
+      uint64_t possible_file_size = BLOCK_IDX_TO_SIZE(end_vidx);
+      if (possible_file_size > state.file_size)
+        state.file_size = possible_file_size;
+    } else if (LogCursor log_cursor(curr_entry.indirect_entry, mem_table);
+               log_cursor->is_delta()) {  // delta, never changes file size
+      if (log_cursor->begin_vidx >= first_vidx &&
+          log_cursor->begin_vidx <= last_vidx) {
+        has_conflict = true;
+        has_inplace_conflict = true;
+      }
+    } else {  // non-inline tx entry
+      do {
+        uint32_t i;
+        for (i = 0; i < log_cursor->get_lidxs_len() - 1; ++i) {
+          has_conflict |= get_conflict_image(
+              first_vidx, last_vidx,
+              log_cursor->begin_vidx +
+                  (i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT),
+              log_cursor->begin_lidxs[i], BITMAP_ENTRY_BLOCKS_CAPACITY,
+              conflict_image);
+        }
+        has_conflict |= get_conflict_image(
+            first_vidx, last_vidx,
+            log_cursor->begin_vidx + (i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT),
+            log_cursor->begin_lidxs[i], log_cursor->get_last_lidx_num_blocks(),
+            conflict_image);
+        VirtualBlockIdx end_vidx = log_cursor->begin_vidx +
+                                   (i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT) +
+                                   log_cursor->get_last_lidx_num_blocks();
+        uint64_t possible_file_size =
+            BLOCK_IDX_TO_SIZE(end_vidx) - log_cursor->leftover_bytes;
+        if (possible_file_size > state.file_size)
+          state.file_size = possible_file_size;
+
+      } while (log_cursor.advance(mem_table));
+    }
+    return has_conflict;
+  }
+
   /**
    * Check if [first_vidx, last_vidx] has any overlap with [le_first_vidx,
    * le_first_vidx + num_blocks - 1]; populate overlapped mapping if any
@@ -181,10 +308,9 @@ class Tx {
     VirtualBlockIdx overlap_last_vidx = std::min(le_last_vidx, last_vidx);
 
     for (VirtualBlockIdx vidx = overlap_first_vidx; vidx <= overlap_last_vidx;
-         ++vidx) {
-      auto offset = vidx - first_vidx;
-      conflict_image[offset] = le_begin_lidx + offset;
-    }
+         ++vidx)
+      conflict_image[vidx - first_vidx] =
+          le_begin_lidx + (vidx - le_first_vidx);
     return true;
   }
 };
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+
+#include "utils/persist.h"
+
+namespace madfs::dram {
+
+namespace detail {
+/**
+ * Call fn(segment, length) for each non-empty piece of [buf_offset, buf_offset
+ * + size) in the concatenation of the given iovec array; the range must be
+ * within the array, but the walk never goes past its iovcnt entries
+ */
+template <typename Fn>
+static void for_each_segment(const struct iovec* iov, int iovcnt,
+                             size_t buf_offset, size_t size, Fn&& fn) {
+  const struct iovec* const iov_end = iov + iovcnt;
+  while (iov != iov_end && buf_offset >= iov->iov_len)
+    buf_offset -= (iov++)->iov_len;
+  for (; size > 0 && iov != iov_end; ++iov) {
+    size_t len = std::min(iov->iov_len - buf_offset, size);
+    if (len > 0) fn(static_cast<char*>(iov->iov_base) + buf_offset, len);
+    size -= len;
+    buf_offset = 0;
+  }
+  assert(size == 0);
+}
+}  // namespace detail
+
+/**
+ * @return the total length of an iovec array; -1 with errno set if the array
+ * is invalid as defined by readv(2)
+ */
+static inline ssize_t get_iov_len(const struct iovec* iov, int iovcnt) {
+  if (iovcnt < 0 || iovcnt > IOV_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len > SSIZE_MAX - len) {
+      errno = EINVAL;
+      return -1;
+    }
+    len += iov[i].iov_len;
+  }
+  return static_cast<ssize_t>(len);
+}
+
+/**
+ * The user buffer of a write: either a contiguous buffer or an iovec array,
+ * whose segments are copied to PM directly without gathering them first
+ */
+class WriteBuf {
+  const char* const buf;
+  const struct iovec* const iov;
+  const int iovcnt;
+
+ public:
+  WriteBuf(const char* buf)  // NOLINT(google-explicit-constructor)
+      : buf(buf), iov(nullptr), iovcnt(0) {}
+  WriteBuf(const struct iovec* iov, int iovcnt)
+      : buf(nullptr), iov(iov), iovcnt(iovcnt) {}
+
+  /**
+   * Copy [buf_offset, buf_offset + size) of the buffer to dst; do persist but
+   * not fenced
+   */
+  void copy_persist(char* dst, size_t buf_offset, size_t size) const {
+    if (iov == nullptr) {
+      pmem::memcpy_persist(dst, buf + buf_offset, size);
+      return;
+    }
+    detail::for_each_segment(iov, iovcnt, buf_offset, size,
+                             [&](const char* src, size_t len) {
+                               pmem::memcpy_persist(dst, src, len);
+                               dst += len;
+                             });
+  }
+};
+
+/**
+ * The user buffer of a read: either a contiguous buffer or an iovec array,
+ * which is filled directly without an intermediate buffer
+ */
+class ReadBuf {
+  char* const buf;
+  const struct iovec* const iov;
+  const int iovcnt;
+
+ public:
+  ReadBuf(char* buf)  // NOLINT(google-explicit-constructor)
+      : buf(buf), iov(nullptr), iovcnt(0) {}
+  ReadBuf(const struct iovec* iov, int iovcnt)
+      : buf(nullptr), iov(iov), iovcnt(iovcnt) {}
+
+  /**
+   * @return the buffer if it is contiguous; nullptr otherwise
+   */
+  [[nodiscard]] char* get_contiguous() const { return buf; }
+
+  /**
+   * Copy size bytes from src to [buf_offset, buf_offset + size) of the buffer
+   */
+  void copy_from(size_t buf_offset, const char* src, size_t size) const {
+    if (iov == nullptr) {
+      dram::memcpy(buf + buf_offset, src, size);
+      return;
+    }
+    detail::for_each_segment(iov, iovcnt, buf_offset, size,
+                             [&](char* dst, size_t len) {
+                               dram::memcpy(dst, src, len);
+                               src += len;
+                             });
+  }
+};
+
+}  // namespace madfs::dram
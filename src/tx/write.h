@@ -1,6 +1,7 @@
 #pragma once
 
 #include "tx.h"
+#include "user_buf.h"
 
 namespace madfs::dram {
 
@@ -16,7 +17,7 @@ inline thread_local std::vector<pmem::Block*> local_buf_dst_blocks;
 
 class WriteTx : public Tx {
  protected:
-  const char* const buf;
+  const WriteBuf buf;
   std::vector<LogicalBlockIdx>& recycle_image;
 
   // the logical index of the destination data block
@@ -29,7 +30,7 @@ class WriteTx : public Tx {
   LogCursor log_cursor;
   uint16_t leftover_bytes;
 
-  WriteTx(File* file, const char* buf, size_t count, size_t offset)
+  WriteTx(File* file, WriteBuf buf, size_t count, size_t offset)
       : Tx(file, count, offset),
         buf(buf),
         recycle_image(local_buf_image_lidxs),
@@ -45,14 +46,7 @@ class WriteTx : public Tx {
     // for overwrite, "leftover_bytes" is zero; only in append we care
     // append log without fence because we only care flush completion
     // before try_commit
-    uint32_t rest_num_blocks = num_blocks;
-    while (rest_num_blocks > 0) {
-      uint32_t chunk_num_blocks =
-          std::min(rest_num_blocks, BITMAP_ENTRY_BLOCKS_CAPACITY);
-      auto lidx = allocator->block.alloc(chunk_num_blocks);
-      dst_lidxs.push_back(lidx);
-      rest_num_blocks -= chunk_num_blocks;
-    }
+    allocator->block.alloc_chunks(num_blocks, dst_lidxs);
     assert(!dst_lidxs.empty());
 
     for (auto lidx : dst_lidxs)
@@ -60,7 +54,7 @@ class WriteTx : public Tx {
     assert(!dst_blocks.empty());
   }
 
-  WriteTx(File* file, const char* buf, size_t count, size_t offset,
+  WriteTx(File* file, WriteBuf buf, size_t count, size_t offset,
           FileState state, uint64_t ticket)
       : WriteTx(file, buf, count, offset) {
     is_offset_depend = true;
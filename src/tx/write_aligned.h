@@ -3,10 +3,10 @@
 namespace madfs::dram {
 class AlignedTx : public WriteTx {
  public:
-  AlignedTx(File* file, const char* buf, size_t count, size_t offset)
+  AlignedTx(File* file, WriteBuf buf, size_t count, size_t offset)
       : WriteTx(file, buf, count, offset) {}
 
-  AlignedTx(File* file, const char* buf, size_t count, size_t offset,
+  AlignedTx(File* file, WriteBuf buf, size_t count, size_t offset,
             FileState state, uint64_t ticket)
       : WriteTx(file, buf, count, offset, state, ticket) {}
 
@@ -18,13 +18,13 @@ class AlignedTx : public WriteTx {
       TimerGuard<Event::ALIGNED_TX_COPY> timer_guard;
 
       // since everything is block-aligned, we can copy data directly
-      const char* rest_buf = buf;
+      size_t buf_offset = 0;
       size_t rest_count = count;
 
       for (auto block : dst_blocks) {
         size_t num_bytes = std::min(rest_count, BITMAP_ENTRY_BYTES_CAPACITY);
-        pmem::memcpy_persist(block->data_rw(), rest_buf, num_bytes);
-        rest_buf += num_bytes;
+        buf.copy_persist(block->data_rw(), buf_offset, num_bytes);
+        buf_offset += num_bytes;
         rest_count -= num_bytes;
       }
       fence();
@@ -58,12 +58,16 @@ class AlignedTx : public WriteTx {
       if (is_offset_depend) offset_mgr->wait(ticket);
     }
 
-    if constexpr (BuildOptions::cc_occ) {
+    if (lock->is_optimistic()) {
       TimerGuard<Event::ALIGNED_TX_COMMIT> timer_guard;
-      while (true) {
+      // an aligned overwrite does not depend on the blocks it overwrites
+      bool committed =
+          group_commit(commit_entry, begin_vidx, end_vidx - 1, recycle_image);
+      while (!committed) {
         pmem::TxEntry conflict_entry =
             state.cursor.try_commit(commit_entry, mem_table, allocator);
         if (!conflict_entry.is_valid()) break;
+        timer.count<Event::TX_ABORT>();
 
         bool into_new_block = false;
         // we don't check the return value of handle_conflict here because we
@@ -89,7 +93,7 @@ class AlignedTx : public WriteTx {
     {
       TimerGuard<Event::ALIGNED_TX_FREE> timer_guard;
       // recycle the data blocks being overwritten
-      allocator->block.free(recycle_image);
+      file->recycle_blocks(allocator, recycle_image);
     }
 
     // update the pinned tx block
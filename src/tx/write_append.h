@@ -0,0 +1,196 @@
+#pragma once
+
+#include "write.h"
+
+namespace madfs::dram {
+
+/**
+ * An append starting in the middle of the last block. Nobody reads beyond the
+ * end of file, so the bytes that fit into the free space of the last block are
+ * written there in place instead of copy-on-write; only the blocks after it (if
+ * any) are newly allocated. If the append fits into the last block, the commit
+ * entry is a TxEntrySize that merely extends the file size, so the whole write
+ * costs one data persist and one 8-byte CAS.
+ *
+ * The last block is claimed in the shared memory first (see
+ * File::claim_inplace_append), so that only one append of all processes writes
+ * into it in place at a time, and the block is not reused even if a
+ * copy-on-write replaces it meanwhile. If the block is claimed by another
+ * append, is remapped, or the file is extended beyond the offset before it
+ * commits, nothing is committed and the caller shall fall back to
+ * copy-on-write.
+ */
+class AppendTx : public Tx {
+  const char* const buf;
+  // the starting offset within the last block
+  const size_t local_offset;
+  // the number of bytes written in place into the last block
+  const size_t inplace_count;
+
+  // the new blocks after the last block; one per 64-block chunk
+  std::vector<LogicalBlockIdx>& dst_lidxs;
+
+  pmem::TxEntry commit_entry;
+  LogCursor log_cursor;
+
+ public:
+  AppendTx(File* file, const char* buf, size_t count, size_t offset)
+      : Tx(file, count, offset),
+        buf(buf),
+        local_offset(offset - BLOCK_IDX_TO_SIZE(begin_vidx)),
+        inplace_count(std::min(count, BLOCK_SIZE - local_offset)),
+        dst_lidxs(local_buf_dst_lidxs) {
+    lock->wrlock();  // nop lock is used by default
+  }
+
+  AppendTx(File* file, const char* buf, size_t count, size_t offset,
+           FileState state, uint64_t ticket)
+      : AppendTx(file, buf, count, offset) {
+    is_offset_depend = true;
+    this->state = state;
+    this->ticket = ticket;
+  }
+
+  /**
+   * @return whether a write at offset can start in place given the file state
+   */
+  static bool can_apply(const BlkTable* blk_table, const FileState& state,
+                        size_t offset) {
+    // there is no free space to write into if the offset is aligned
+    if (IS_ALIGNED(offset, BLOCK_SIZE)) return false;
+    if (offset < state.file_size) return false;
+    VirtualBlockIdx vidx = BLOCK_SIZE_TO_IDX(offset);
+    // gc folds the deltas into a new block that would miss the in-place bytes
+    return blk_table->vidx_to_lidx(vidx) != 0 && !blk_table->has_delta(vidx);
+  }
+
+  /**
+   * @return the number of bytes written; -1 if this write cannot be done in
+   * place and nothing has been committed, in which case the caller shall fall
+   * back to copy-on-write
+   */
+  ssize_t exec() {
+    timer.count<Event::APPEND_TX_START>();
+
+    LogicalBlockIdx pinned_tx_block_idx = allocator->tx_block.get_pinned_idx();
+    if (pinned_tx_block_idx == 0) allocator->tx_block.pin(0);
+
+    blk_table->update(&state, allocator);
+    if (!can_apply(blk_table, state, offset)) return -1;
+    const LogicalBlockIdx tail_lidx = blk_table->vidx_to_lidx(begin_vidx);
+    if (!file->claim_inplace_append(tail_lidx)) return -1;
+    // the snapshot must be taken again after the claim, so that the last block
+    // cannot be reused by the time we write into it
+    blk_table->update(&state, allocator);
+    if (!can_apply(blk_table, state, offset) ||
+        blk_table->vidx_to_lidx(begin_vidx) != tail_lidx) {
+      file->release_inplace_append();
+      return -1;
+    }
+
+    pmem::memcpy_persist(mem_table->lidx_to_addr_rw(tail_lidx)->data_rw() +
+                             local_offset,
+                         buf, inplace_count);
+    alloc_and_copy_rest();
+    fence();
+
+    if (pinned_tx_block_idx != state.get_tx_block_idx())
+      allocator->log_entry.reset();
+    prepare_commit_entry();
+
+    if (is_offset_depend) offset_mgr->wait(ticket);
+
+    static thread_local std::vector<LogicalBlockIdx> conflict_image(1);
+    while (true) {
+      // the bytes between the end of file and the offset must have been
+      // written by an earlier append that we have not seen yet
+      if (state.file_size < offset) {
+        if (refresh_state() && !commit_entry.is_inline()) {
+          allocator->log_entry.free(log_cursor);
+          allocator->log_entry.reset();
+          prepare_commit_entry();
+        }
+        if (blk_table->vidx_to_lidx(begin_vidx) != tail_lidx) goto abort;
+      }
+      if (state.file_size != offset) goto abort;
+
+      timer.count<Event::APPEND_TX_COMMIT>();
+      pmem::TxEntry conflict_entry =
+          state.cursor.try_commit(commit_entry, mem_table, allocator);
+      if (!conflict_entry.is_valid()) break;
+
+      conflict_image[0] = 0;
+      bool into_new_block = false;
+      handle_conflict(conflict_entry, begin_vidx, begin_vidx, conflict_image,
+                      commit_entry.is_inline() ? nullptr : &into_new_block);
+      if (conflict_image[0] != 0) goto abort;
+      if (into_new_block) {
+        allocator->log_entry.free(log_cursor);
+        allocator->log_entry.reset();
+        prepare_commit_entry();
+      }
+    }
+
+    allocator->tx_block.pin(state.get_tx_block_idx());
+    file->release_inplace_append();
+    return static_cast<ssize_t>(count);
+
+  abort:
+    if (!commit_entry.is_inline()) allocator->log_entry.free(log_cursor);
+    free_rest();
+    allocator->tx_block.pin(state.get_tx_block_idx());
+    file->release_inplace_append();
+    return -1;
+  }
+
+ private:
+  // the number of new blocks after the last block
+  [[nodiscard]] uint32_t num_rest_blocks() const { return num_blocks - 1; }
+
+  void alloc_and_copy_rest() {
+    dst_lidxs.clear();
+    const char* rest_buf = buf + inplace_count;
+    size_t rest_count = count - inplace_count;
+    allocator->block.alloc_chunks(num_rest_blocks(), dst_lidxs);
+    for (LogicalBlockIdx lidx : dst_lidxs) {
+      size_t num_bytes = std::min(rest_count, BITMAP_ENTRY_BYTES_CAPACITY);
+      pmem::memcpy_persist(mem_table->lidx_to_addr_rw(lidx)->data_rw(),
+                           rest_buf, num_bytes);
+      rest_buf += num_bytes;
+      rest_count -= num_bytes;
+    }
+  }
+
+  void free_rest() {
+    uint32_t rest_num_blocks = num_rest_blocks();
+    for (auto lidx : dst_lidxs) {
+      uint32_t chunk_num_blocks =
+          std::min(rest_num_blocks, BITMAP_ENTRY_BLOCKS_CAPACITY);
+      allocator->block.free(lidx, chunk_num_blocks);
+      rest_num_blocks -= chunk_num_blocks;
+    }
+  }
+
+  void prepare_commit_entry() {
+    if (dst_lidxs.empty()) {
+      commit_entry = pmem::TxEntrySize(end_offset);
+      return;
+    }
+    // the new blocks are always at the end of file
+    auto leftover_bytes =
+        static_cast<uint16_t>(ALIGN_UP(end_offset, BLOCK_SIZE) - end_offset);
+    VirtualBlockIdx rest_begin_vidx = begin_vidx + 1;
+    if (leftover_bytes == 0 &&
+        pmem::TxEntryInline::can_inline(num_rest_blocks(), rest_begin_vidx,
+                                        dst_lidxs[0])) {
+      commit_entry = pmem::TxEntryInline(num_rest_blocks(), rest_begin_vidx,
+                                         dst_lidxs[0]);
+    } else {
+      log_cursor = allocator->log_entry.append(
+          pmem::LogEntry::Op::LOG_OVERWRITE, leftover_bytes, num_rest_blocks(),
+          rest_begin_vidx, dst_lidxs);
+      commit_entry = pmem::TxEntryIndirect(log_cursor.idx);
+    }
+  }
+};
+}  // namespace madfs::dram
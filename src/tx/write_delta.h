@@ -0,0 +1,118 @@
+#pragma once
+
+#include "tx.h"
+
+namespace madfs::dram {
+
+/**
+ * A small write within a single existing block. Instead of copy-on-write of
+ * the whole block, the bytes are logged inline in a LOG_DELTA log entry and the
+ * block table overlays them onto the mapped block. Once a block has
+ * accumulated MAX_NUM_DELTAS_PER_BLOCK deltas, the next write to it falls back
+ * to copy-on-write, which folds the deltas into the new block.
+ */
+class DeltaTx : public Tx {
+  const char* const buf;
+  // the starting offset within the block
+  const uint16_t local_offset;
+
+  pmem::TxEntry commit_entry;
+  LogCursor log_cursor;
+
+ public:
+  DeltaTx(File* file, const char* buf, size_t count, size_t offset)
+      : Tx(file, count, offset),
+        buf(buf),
+        local_offset(static_cast<uint16_t>(offset & (BLOCK_SIZE - 1))) {
+    assert(num_blocks == 1 && count <= MAX_DELTA_SIZE);
+    lock->wrlock();  // nop lock is used by default
+  }
+
+  DeltaTx(File* file, const char* buf, size_t count, size_t offset,
+          FileState state, uint64_t ticket)
+      : DeltaTx(file, buf, count, offset) {
+    is_offset_depend = true;
+    this->state = state;
+    this->ticket = ticket;
+  }
+
+  /**
+   * @return whether a write of [offset, offset + count) can be logged as a
+   * delta given the file state
+   */
+  static bool can_apply(const BlkTable* blk_table, const FileState& state,
+                        size_t count, size_t offset) {
+    if (count > MAX_DELTA_SIZE) return false;
+    VirtualBlockIdx vidx = BLOCK_SIZE_TO_IDX(offset);
+    if (vidx != BLOCK_SIZE_TO_IDX(offset + count - 1)) return false;
+    // a delta never extends the file, and it needs a block to overlay onto
+    if (offset + count > state.file_size) return false;
+    if (blk_table->vidx_to_lidx(vidx) == 0) return false;
+    return blk_table->get_num_deltas(vidx) < MAX_NUM_DELTAS_PER_BLOCK;
+  }
+
+  /**
+   * @return the number of bytes written; -1 if this write cannot be logged as
+   * a delta (see can_apply) and nothing has been done, in which case the
+   * caller shall fall back to copy-on-write
+   */
+  ssize_t exec() {
+    timer.count<Event::DELTA_TX_START>();
+
+    LogicalBlockIdx pinned_tx_block_idx = allocator->tx_block.get_pinned_idx();
+    if (pinned_tx_block_idx == 0) allocator->tx_block.pin(0);
+
+    if (!is_offset_depend) {
+      blk_table->update(&state, allocator);
+      if (!can_apply(blk_table, state, count, offset)) return -1;
+    }
+    assert(can_apply(blk_table, state, count, offset));
+
+    if (pinned_tx_block_idx != state.get_tx_block_idx())
+      allocator->log_entry.reset();
+
+    prepare_commit_entry();
+    fence();
+
+    if (is_offset_depend) offset_mgr->wait(ticket);
+
+    if (lock->is_optimistic()) {
+      static thread_local std::vector<LogicalBlockIdx> conflict_image(1);
+      bool committed =
+          group_commit(commit_entry, begin_vidx, begin_vidx, conflict_image);
+      while (!committed) {
+        timer.count<Event::DELTA_TX_COMMIT>();
+        pmem::TxEntry conflict_entry =
+            state.cursor.try_commit(commit_entry, mem_table, allocator);
+        if (!conflict_entry.is_valid()) break;
+
+        // a delta overwrites the given bytes regardless of the content of the
+        // block, so a conflict only moves the cursor forward and never requires
+        // redo
+        bool into_new_block = false;
+        handle_conflict(conflict_entry, begin_vidx, begin_vidx, conflict_image,
+                        &into_new_block);
+        if (into_new_block) {
+          allocator->log_entry.free(log_cursor);
+          allocator->log_entry.reset();
+          prepare_commit_entry();
+          fence();
+        }
+      }
+    } else {
+      state.cursor.try_commit(commit_entry, mem_table, allocator);
+    }
+
+    allocator->tx_block.pin(state.get_tx_block_idx());
+    return static_cast<ssize_t>(count);
+  }
+
+ private:
+  void prepare_commit_entry() {
+    log_cursor = allocator->log_entry.append_delta(
+        begin_vidx, blk_table->vidx_to_lidx(begin_vidx), local_offset, buf,
+        static_cast<uint16_t>(count));
+    commit_entry = pmem::TxEntryIndirect(log_cursor.idx);
+  }
+};
+}  // namespace madfs::dram
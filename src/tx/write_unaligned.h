@@ -13,17 +13,46 @@ class CoWTx : public WriteTx {
   // copying the src data
   const size_t num_full_blocks;
 
-  CoWTx(File* file, const char* buf, size_t count, size_t offset)
+  // the ranges of the blocks to copy, if runtime_options.cc_adaptive is set
+  RangeLockTable::Guard range_guard;
+
+  CoWTx(File* file, WriteBuf buf, size_t count, size_t offset)
       : WriteTx(file, buf, count, offset),
         begin_full_vidx(BLOCK_SIZE_TO_IDX(ALIGN_UP(offset, BLOCK_SIZE))),
         end_full_vidx(BLOCK_SIZE_TO_IDX(end_offset)),
         num_full_blocks(end_full_vidx - begin_full_vidx) {}
-  CoWTx(File* file, const char* buf, size_t count, size_t offset,
+  CoWTx(File* file, WriteBuf buf, size_t count, size_t offset,
         FileState state, uint64_t ticket)
       : WriteTx(file, buf, count, offset, state, ticket),
         begin_full_vidx(BLOCK_SIZE_TO_IDX(ALIGN_UP(offset, BLOCK_SIZE))),
         end_full_vidx(BLOCK_SIZE_TO_IDX(end_offset)),
         num_full_blocks(end_full_vidx - begin_full_vidx) {}
+
+  /**
+   * @return the current content of a source block to copy from, with its
+   * deltas (if any) applied to a thread-local copy. The result is only valid
+   * until the next call.
+   */
+  const char* get_src_block(VirtualBlockIdx vidx, LogicalBlockIdx lidx) const {
+    alignas(CACHELINE_SIZE) static thread_local char scratch[BLOCK_SIZE];
+    return blk_table->get_block_ro(vidx, lidx, scratch);
+  }
+
+  /**
+   * Catch up with the latest block table after an in-place conflict and rebuild
+   * the commit entry and the recycle image from it
+   */
+  void refresh_commit_entry() {
+    if (refresh_state() && !commit_entry.is_inline()) {
+      allocator->log_entry.free(log_cursor);
+      allocator->log_entry.reset();
+      prepare_commit_entry();
+    } else {
+      recheck_commit_entry();
+    }
+    for (uint32_t i = 0; i < num_blocks; ++i)
+      recycle_image[i] = blk_table->vidx_to_lidx(begin_vidx + i);
+  }
 };
 
 class SingleBlockTx : public CoWTx {
@@ -32,13 +61,13 @@ class SingleBlockTx : public CoWTx {
   const size_t local_offset;
 
  public:
-  SingleBlockTx(File* file, const char* buf, size_t count, size_t offset)
+  SingleBlockTx(File* file, WriteBuf buf, size_t count, size_t offset)
       : CoWTx(file, buf, count, offset),
         local_offset(offset - BLOCK_IDX_TO_SIZE(begin_vidx)) {
     assert(num_blocks == 1);
   }
 
-  SingleBlockTx(File* file, const char* buf, size_t count, size_t offset,
+  SingleBlockTx(File* file, WriteBuf buf, size_t count, size_t offset,
                 FileState state, uint64_t ticket)
       : CoWTx(file, buf, count, offset, state, ticket),
         local_offset(offset - BLOCK_IDX_TO_SIZE(begin_vidx)) {
@@ -59,7 +88,10 @@ class SingleBlockTx : public CoWTx {
     }
 
     // must acquire the tx tail before any get
-    if (!is_offset_depend) blk_table->update(&state, allocator);
+    if (!is_offset_depend) {
+      range_guard.enter(&file->range_locks, begin_vidx, begin_vidx);
+      blk_table->update(&state, allocator);
+    }
 
     if (pinned_tx_block_idx != state.get_tx_block_idx())
       allocator->log_entry.reset();
@@ -70,7 +102,7 @@ class SingleBlockTx : public CoWTx {
     assert(recycle_image[0] != dst_lidxs[0]);
 
     // copy data from buf
-    pmem::memcpy_persist(dst_blocks[0]->data_rw() + local_offset, buf, count);
+    buf.copy_persist(dst_blocks[0]->data_rw() + local_offset, 0, count);
 
   redo:
     assert(dst_blocks.size() == 1);
@@ -80,8 +112,7 @@ class SingleBlockTx : public CoWTx {
       TimerGuard<Event::SINGLE_BLOCK_TX_COPY> timer_guard;
 
       char* dst_block = dst_blocks[0]->data_rw();
-      const char* src_block =
-          mem_table->lidx_to_addr_ro(recycle_image[0])->data_ro();
+      const char* src_block = get_src_block(begin_vidx, recycle_image[0]);
 
       // copy the left part of the block
       if (local_offset != 0) {
@@ -98,13 +129,21 @@ class SingleBlockTx : public CoWTx {
 
     if (is_offset_depend) offset_mgr->wait(ticket);
 
+    // the copy depends on the source block, so the entry is only combined if
+    // no entry since the snapshot may have changed the block
+    if (lock->is_optimistic() &&
+        group_commit(commit_entry, begin_vidx, begin_vidx, recycle_image,
+                     /*is_blind=*/false))
+      goto done;
+
   retry:
-    if constexpr (BuildOptions::cc_occ) {
+    if (lock->is_optimistic()) {
       timer.count<Event::SINGLE_BLOCK_TX_COMMIT>();
       // try to commit the tx entry
       pmem::TxEntry conflict_entry =
           state.cursor.try_commit(commit_entry, mem_table, allocator);
       if (!conflict_entry.is_valid()) goto done;  // success, no conflict
+      timer.count<Event::TX_ABORT>();
 
       bool into_new_block = false;
       // we just treat begin_vidx as both first and last vidx
@@ -120,18 +159,20 @@ class SingleBlockTx : public CoWTx {
       } else {
         recheck_commit_entry();
       }
-      if (!need_redo)
-        goto retry;
-      else
-        goto redo;
+      if (has_inplace_conflict) refresh_commit_entry();
+      if (!need_redo) goto retry;
+      timer.count<Event::TX_REDO>();
+      range_guard.add_conflict();
+      goto redo;
     } else {
       state.cursor.try_commit(commit_entry, mem_table, allocator);
     }
 
   done:
+    range_guard.exit();
     // update the pinned tx block
     allocator->tx_block.pin(state.get_tx_block_idx());
-    allocator->block.free(recycle_image[0]);  // it has only single block
+    file->recycle_blocks(allocator, recycle_image);  // only a single block
     return static_cast<ssize_t>(count);
   }
 };
@@ -147,12 +188,12 @@ class MultiBlockTx : public CoWTx {
   const size_t last_block_overlap_size;
 
  public:
-  MultiBlockTx(File* file, const char* buf, size_t count, size_t offset)
+  MultiBlockTx(File* file, WriteBuf buf, size_t count, size_t offset)
       : CoWTx(file, buf, count, offset),
         first_block_overlap_size(ALIGN_UP(offset, BLOCK_SIZE) - offset),
         last_block_overlap_size(end_offset -
                                 ALIGN_DOWN(end_offset, BLOCK_SIZE)) {}
-  MultiBlockTx(File* file, const char* buf, size_t count, size_t offset,
+  MultiBlockTx(File* file, WriteBuf buf, size_t count, size_t offset,
                FileState state, uint64_t ticket)
       : CoWTx(file, buf, count, offset, state, ticket),
         first_block_overlap_size(ALIGN_UP(offset, BLOCK_SIZE) - offset),
@@ -173,7 +214,7 @@ class MultiBlockTx : public CoWTx {
 
     // copy full blocks first
     if (num_full_blocks > 0) {
-      const char* rest_buf = buf;
+      size_t buf_offset = 0;
       size_t rest_full_count = BLOCK_NUM_TO_SIZE(num_full_blocks);
       for (size_t i = 0; i < dst_blocks.size(); ++i) {
         // get logical block pointer for this iter
@@ -181,7 +222,7 @@ class MultiBlockTx : public CoWTx {
         pmem::Block* full_blocks = dst_blocks[i];
         if (i == 0) {
           full_blocks += (begin_full_vidx - begin_vidx);
-          rest_buf += first_block_overlap_size;
+          buf_offset += first_block_overlap_size;
         }
         // calculate num of full block bytes to be copied in this iter
         // takes care of last block in last chunk which might be partial
@@ -193,14 +234,20 @@ class MultiBlockTx : public CoWTx {
             num_bytes = BITMAP_ENTRY_BYTES_CAPACITY;
         }
         // actual memcpy
-        pmem::memcpy_persist(full_blocks->data_rw(), rest_buf, num_bytes);
-        rest_buf += num_bytes;
+        buf.copy_persist(full_blocks->data_rw(), buf_offset, num_bytes);
+        buf_offset += num_bytes;
         rest_full_count -= num_bytes;
       }
     }
 
     // only get a snapshot of the tail when starting critical piece
-    if (!is_offset_depend) blk_table->update(&state, allocator);
+    if (!is_offset_depend) {
+      // only the blocks on either end are copied from the source
+      range_guard.enter(&file->range_locks,
+                        need_copy_first ? begin_vidx : end_vidx - 1,
+                        need_copy_last ? end_vidx - 1 : begin_vidx);
+      blk_table->update(&state, allocator);
+    }
 
     if (allocator->tx_block.get_pinned_idx() != state.get_tx_block_idx())
       allocator->log_entry.reset();
@@ -216,23 +263,22 @@ class MultiBlockTx : public CoWTx {
     {
       char* dst =
           dst_blocks[0]->data_rw() + BLOCK_SIZE - first_block_overlap_size;
-      pmem::memcpy_persist(dst, buf, first_block_overlap_size);
+      buf.copy_persist(dst, 0, first_block_overlap_size);
     }
 
     // write data from the buf to the last block
     pmem::Block* last_dst_block =
         dst_blocks.back() + (end_full_vidx - begin_vidx) -
         BITMAP_ENTRY_BLOCKS_CAPACITY * (dst_blocks.size() - 1);
-    const char* buf_src = buf + (count - last_block_overlap_size);
-    pmem::memcpy_persist(last_dst_block->data_rw(), buf_src,
-                         last_block_overlap_size);
+    buf.copy_persist(last_dst_block->data_rw(), count - last_block_overlap_size,
+                     last_block_overlap_size);
 
   redo:
     timer.count<Event::MULTI_BLOCK_TX_COPY>();
     // copy the data from the first source block if exists
     if (need_copy_first && do_copy_first) {
       char* dst = dst_blocks[0]->data_rw();
-      const char* src = mem_table->lidx_to_addr_ro(src_first_lidx)->data_ro();
+      const char* src = get_src_block(begin_vidx, src_first_lidx);
       size_t size = BLOCK_SIZE - first_block_overlap_size;
       pmem::memcpy_persist(dst, src, size);
     }
@@ -240,8 +286,8 @@ class MultiBlockTx : public CoWTx {
     // copy the data from the last source block if exits
     if (need_copy_last && do_copy_last) {
       char* dst = last_dst_block->data_rw() + last_block_overlap_size;
-      const char* src = mem_table->lidx_to_addr_ro(src_last_lidx)->data_ro() +
-                        last_block_overlap_size;
+      const char* src =
+          get_src_block(end_vidx - 1, src_last_lidx) + last_block_overlap_size;
       size_t size = BLOCK_SIZE - last_block_overlap_size;
       pmem::memcpy_persist(dst, src, size);
     }
@@ -249,21 +295,32 @@ class MultiBlockTx : public CoWTx {
 
     if (is_offset_depend) offset_mgr->wait(ticket);
 
+    if (lock->is_optimistic() &&
+        group_commit(commit_entry, begin_vidx, end_full_vidx, recycle_image,
+                     /*is_blind=*/false))
+      goto done;
+
   retry:
-    if constexpr (BuildOptions::cc_occ) {
+    if (lock->is_optimistic()) {
       timer.count<Event::MULTI_BLOCK_TX_COMMIT>();
       // try to commit the transaction
       pmem::TxEntry conflict_entry =
           state.cursor.try_commit(commit_entry, mem_table, allocator);
       if (!conflict_entry.is_valid()) goto done;  // success
-      // make a copy of the first and last again
-      src_first_lidx = recycle_image[0];
-      src_last_lidx = recycle_image[num_blocks - 1];
+      timer.count<Event::TX_ABORT>();
 
       bool into_new_block = false;
+      // the source blocks may be recycled and mapped again in between, so
+      // whether to copy an end block again is told by whether any entry maps
+      // it, not by whether its lidx has changed
+      recycle_image[0] = recycle_image[num_blocks - 1] = 0;
       need_redo = handle_conflict(
           conflict_entry, begin_vidx, end_full_vidx, recycle_image,
           commit_entry.is_inline() ? nullptr : &into_new_block);
+      const bool is_first_remapped = recycle_image[0] != 0;
+      const bool is_last_remapped = recycle_image[num_blocks - 1] != 0;
+      if (!is_first_remapped) recycle_image[0] = src_first_lidx;
+      if (!is_last_remapped) recycle_image[num_blocks - 1] = src_last_lidx;
       if (into_new_block) {
         assert(!commit_entry.is_inline());
         allocator->log_entry.free(log_cursor);
@@ -273,25 +330,33 @@ class MultiBlockTx : public CoWTx {
       } else {
         recheck_commit_entry();
       }
-      if (!need_redo)
+      if (has_inplace_conflict) {
+        // the deltas may be on either end; copy both again
+        refresh_commit_entry();
+        do_copy_first = do_copy_last = true;
+      } else if (!need_redo) {
         goto retry;  // we have moved to the new tail, retry commit
-      else {
-        do_copy_first = src_first_lidx != recycle_image[0];
-        do_copy_last = src_last_lidx != recycle_image[num_blocks - 1];
-        if (do_copy_first || do_copy_last)
-          goto redo;
-        else
-          goto retry;
+      } else {
+        do_copy_first = is_first_remapped;
+        do_copy_last = is_last_remapped;
       }
+      if (!do_copy_first && !do_copy_last) goto retry;
+      timer.count<Event::TX_REDO>();
+      range_guard.add_conflict();
+      // make a copy of the first and last again
+      src_first_lidx = recycle_image[0];
+      src_last_lidx = recycle_image[num_blocks - 1];
+      goto redo;
     } else {
       state.cursor.try_commit(commit_entry, mem_table, allocator);
     }
 
   done:
+    range_guard.exit();
     // update the pinned tx block
     allocator->tx_block.pin(state.get_tx_block_idx());
     // recycle the data blocks being overwritten
-    allocator->block.free(recycle_image);
+    file->recycle_blocks(allocator, recycle_image);
     return static_cast<ssize_t>(count);
   }
 };
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "const.h"
+#include "utils/utils.h"
+
+namespace madfs {
+
+/**
+ * Epoch-based reclamation of objects of type T that are read without holding
+ * a reference.
+ *
+ * A reader enters a critical section with a Guard before loading a pointer to
+ * the object and must not use the pointer after the guard is gone. A writer
+ * unlinks the object first and then retires it; the object is deleted once no
+ * thread can still be in a critical section that started before it was
+ * unlinked. Guards are reentrant, and entering or leaving the outermost one
+ * costs a store to a thread-local record.
+ *
+ * There shall be only one domain per type T, since the thread-local state is
+ * per type.
+ */
+template <typename T>
+class EpochDomain : noncopyable {
+  struct alignas(CACHELINE_SIZE) Record {
+    // the global epoch when the critical section started; 0 if not in one
+    std::atomic<uint64_t> epoch{0};
+    std::atomic_bool in_use{true};
+    Record* next{nullptr};
+  };
+
+  struct LocalState {
+    EpochDomain* domain{nullptr};
+    Record* record{nullptr};
+    uint32_t depth{0};
+    ~LocalState() {
+      if (record) record->in_use.store(false, std::memory_order_release);
+    }
+  };
+
+  static inline thread_local LocalState local;
+
+  std::atomic<uint64_t> global_epoch{1};
+  // records are never freed, but reused after their thread exits
+  std::atomic<Record*> records{nullptr};
+
+  std::mutex retired_mutex;
+  std::vector<std::pair<uint64_t, T*>> retired;  // guarded by retired_mutex
+  std::atomic<size_t> num_retired{0};
+
+ public:
+  class Guard {
+    EpochDomain* domain;
+
+   public:
+    explicit Guard(EpochDomain* domain) : domain(domain) { domain->enter(); }
+    Guard(Guard&& other) noexcept : domain(std::exchange(other.domain, {})) {}
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+    ~Guard() {
+      if (domain) domain->leave();
+    }
+  };
+
+  EpochDomain() = default;
+  ~EpochDomain() {
+    for (auto [epoch, ptr] : retired) delete ptr;
+  }
+
+  /**
+   * Delete ptr once no reader can still see it; ptr must already be unlinked
+   */
+  void retire(T* ptr) {
+    uint64_t epoch = global_epoch.fetch_add(1, std::memory_order_seq_cst);
+    {
+      std::lock_guard<std::mutex> guard(retired_mutex);
+      retired.emplace_back(epoch, ptr);
+    }
+    num_retired.fetch_add(1, std::memory_order_relaxed);
+    reclaim();
+  }
+
+  /**
+   * Delete the retired objects that no reader can still see
+   */
+  void reclaim() {
+    uint64_t min_epoch = std::numeric_limits<uint64_t>::max();
+    for (Record* r = records.load(std::memory_order_acquire); r; r = r->next) {
+      uint64_t epoch = r->epoch.load(std::memory_order_seq_cst);
+      if (epoch != 0 && epoch < min_epoch) min_epoch = epoch;
+    }
+
+    std::vector<T*> to_delete;
+    {
+      std::lock_guard<std::mutex> guard(retired_mutex);
+      std::erase_if(retired, [&](const auto& item) {
+        if (item.first >= min_epoch) return false;
+        to_delete.push_back(item.second);
+        return true;
+      });
+    }
+    num_retired.fetch_sub(to_delete.size(), std::memory_order_relaxed);
+    for (T* ptr : to_delete) delete ptr;
+  }
+
+ private:
+  void enter() {
+    if (local.depth++ != 0) return;
+    if (unlikely(local.domain != this)) {
+      local.domain = this;
+      local.record = acquire_record();
+    }
+    local.record->epoch.store(global_epoch.load(std::memory_order_relaxed),
+                              std::memory_order_seq_cst);
+  }
+
+  void leave() {
+    if (--local.depth != 0) return;
+    local.record->epoch.store(0, std::memory_order_release);
+    if (unlikely(num_retired.load(std::memory_order_relaxed) != 0)) reclaim();
+  }
+
+  Record* acquire_record() {
+    for (Record* r = records.load(std::memory_order_acquire); r; r = r->next) {
+      bool expected = false;
+      if (!r->in_use.load(std::memory_order_relaxed) &&
+          r->in_use.compare_exchange_strong(expected, true,
+                                            std::memory_order_acquire))
+        return r;
+    }
+    auto r = new Record;
+    r->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+    }
+    return r;
+  }
+};
+
+}  // namespace madfs
@@ -0,0 +1,171 @@
+#include "persist.h"
+
+#include <cpuid.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace madfs::pmem {
+
+constinit Kernels kernels;
+
+namespace {
+
+// with eADR, copies up to this size use temporal stores by default
+constexpr size_t EADR_NT_THRESHOLD = 2 * BLOCK_SIZE;
+
+/**
+ * @return whether all the NVDIMM regions report that their persistence domain
+ * includes the CPU caches, and there is one at least
+ */
+bool is_eadr_reported() {
+  // the libc functions may be intercepted and not ready yet, so use syscalls
+  bool has_region = false;
+  for (int i = 0; i < 64; ++i) {
+    char path[64], domain[16]{};
+    snprintf(path, sizeof(path),
+             "/sys/bus/nd/devices/region%d/persistence_domain", i);
+    auto fd = static_cast<int>(syscall(SYS_openat, AT_FDCWD, path, O_RDONLY));
+    if (fd < 0) continue;
+    ssize_t len = syscall(SYS_read, fd, domain, sizeof(domain) - 1);
+    syscall(SYS_close, fd);
+    if (len <= 0 || strncmp(domain, "cpu_cache", 9) != 0) return false;
+    has_region = true;
+  }
+  return has_region;
+}
+
+/**
+ * @return whether the OS saves the AVX-512 registers on context switches
+ */
+bool is_avx512_enabled_by_os() {
+  uint32_t eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+    return false;
+  uint32_t xcr0_lo, xcr0_hi;
+  asm volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  // SSE, AVX, opmask, and the upper halves of ZMM0-15 and ZMM16-31
+  constexpr uint32_t mask = 0b11100110;
+  return (xcr0_lo & mask) == mask;
+}
+
+// run before the other initializers of the library, which may persist
+struct KernelsInit {
+  KernelsInit() { init_kernels(); }
+} kernels_init __attribute__((init_priority(101)));
+
+}  // namespace
+
+void init_kernels() {
+  using Flush = Kernels::Flush;
+
+  uint32_t eax, ebx = 0, ecx, edx;
+  __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+  Flush flush = (ebx & bit_CLWB)         ? Flush::CLWB
+                : (ebx & bit_CLFLUSHOPT) ? Flush::CLFLUSHOPT
+                                         : Flush::CLFLUSH;
+  bool use_avx512f = (ebx & bit_AVX512F) && is_avx512_enabled_by_os() &&
+                     !BuildOptions::use_pmemcheck;
+
+  // runtime_options may not be initialized yet, so read the environment
+  if (auto str = std::getenv("MADFS_FLUSH"); str) {
+    if (strcasecmp(str, "clflush") == 0)
+      flush = Flush::CLFLUSH;
+    else if (strcasecmp(str, "clflushopt") == 0 && flush != Flush::CLFLUSH)
+      flush = Flush::CLFLUSHOPT;
+  }
+  if (std::getenv("MADFS_NO_AVX512F")) use_avx512f = false;
+  bool is_eadr = is_eadr_reported();
+  if (auto str = std::getenv("MADFS_EADR"); str) is_eadr = std::atoi(str);
+  if (is_eadr) kernels.nt_threshold = EADR_NT_THRESHOLD;
+  if (auto str = std::getenv("MADFS_NT_THRESHOLD"); str)
+    kernels.nt_threshold = std::strtoul(str, nullptr, 10);
+  if (std::getenv("MADFS_NT_AUTOTUNE")) kernels.need_tune = true;
+
+  kernels.flush = flush;
+  kernels.use_avx512f = use_avx512f;
+  switch (flush) {
+    case Flush::CLWB:
+      kernels.memmove_nt = use_avx512f ? memmove_movnt_avx512f_clwb
+                                       : memmove_movnt_avx_clwb_wcbarrier;
+      kernels.memmove_t =
+          use_avx512f ? memmove_mov_avx512f_clwb : memmove_mov_avx_clwb;
+      break;
+    case Flush::CLFLUSHOPT:
+      kernels.memmove_nt = use_avx512f ? memmove_movnt_avx512f_clflushopt
+                                       : memmove_movnt_avx_clflushopt_wcbarrier;
+      kernels.memmove_t = use_avx512f ? memmove_mov_avx512f_clflushopt
+                                      : memmove_mov_avx_clflushopt;
+      break;
+    case Flush::CLFLUSH:
+    case Flush::NONE:
+      kernels.memmove_nt = use_avx512f ? memmove_movnt_avx512f_clflush
+                                       : memmove_movnt_avx_clflush_wcbarrier;
+      kernels.memmove_t =
+          use_avx512f ? memmove_mov_avx512f_clflush : memmove_mov_avx_clflush;
+      break;
+  }
+  // the non-temporal kernels still flush the cache lines they only partly
+  // write, which is cheap enough not to add kernels without flushes
+  if (is_eadr) {
+    kernels.flush = Flush::NONE;
+    kernels.memmove_t =
+        use_avx512f ? memmove_mov_avx512f_noflush : memmove_mov_avx_noflush;
+  }
+  kernels.memmove_small = memmove_mov_avx_noflush;
+  kernels.memmove_large =
+      use_avx512f ? memmove_mov_avx512f_noflush : memmove_mov_avx_noflush;
+}
+
+void tune_nt_threshold(char *pmem, size_t size) {
+  constexpr size_t MIN_SIZE = 64;
+  constexpr uint64_t BYTES_PER_ROUND = 4 << 20;
+  alignas(CACHELINE_SIZE) static char src[64 << 10];
+  size_t max_size = std::min(size / 4, sizeof(src));
+
+  // the time per byte of each size, with each kernel
+  auto measure = [&](Kernels::Memmove memmove, size_t copy_size) {
+    auto begin = std::chrono::steady_clock::now();
+    size_t off = 0;
+    for (uint64_t n = 0; n < BYTES_PER_ROUND; n += copy_size) {
+      memmove(pmem + off, src, copy_size);
+      fence();
+      off = off + 2 * copy_size > size ? 0 : off + copy_size;
+    }
+    return std::chrono::steady_clock::now() - begin;
+  };
+
+  size_t threshold = max_size * 2;
+  for (size_t copy_size = max_size; copy_size >= MIN_SIZE; copy_size /= 2) {
+    // warm up both first
+    measure(kernels.memmove_t, copy_size);
+    measure(kernels.memmove_nt, copy_size);
+    if (measure(kernels.memmove_nt, copy_size) >
+        measure(kernels.memmove_t, copy_size))
+      break;
+    threshold = copy_size;
+  }
+  kernels.nt_threshold.store(threshold, std::memory_order_relaxed);
+  kernels.need_tune.store(false, std::memory_order_relaxed);
+  LOG_INFO("nt_threshold tuned to %zu", threshold);
+}
+
+std::ostream &operator<<(std::ostream &out, const Kernels &k) {
+  constexpr static const char *flush_names[] = {"clflush", "clflushopt",
+                                                "clwb", "none (eADR)"};
+  out << "Kernels: \n";
+  out << "\tflush: " << flush_names[static_cast<size_t>(k.flush)] << "\n";
+  out << "\tavx512f: " << k.use_avx512f << "\n";
+  out << "\tnt_threshold: " << k.nt_threshold
+      << (k.need_tune ? " (to be tuned)" : "") << "\n";
+  return out;
+}
+
+}  // namespace madfs::pmem
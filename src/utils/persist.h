@@ -2,7 +2,9 @@
 
 #include <immintrin.h>
 
+#include <atomic>
 #include <cstring>
+#include <ostream>
 
 #include "config.h"
 #include "const.h"
@@ -17,6 +19,13 @@ void memmove_movnt_avx_clflush_wcbarrier(char *, const char *, size_t);
 void memmove_movnt_avx_clflushopt_wcbarrier(char *, const char *, size_t);
 void memmove_movnt_avx_clwb_wcbarrier(char *, const char *, size_t);
 
+void memmove_mov_avx512f_clflush(char *, const char *, size_t);
+void memmove_mov_avx512f_clflushopt(char *, const char *, size_t);
+void memmove_mov_avx512f_clwb(char *, const char *, size_t);
+void memmove_mov_avx_clflush(char *, const char *, size_t);
+void memmove_mov_avx_clflushopt(char *, const char *, size_t);
+void memmove_mov_avx_clwb(char *, const char *, size_t);
+
 void memmove_mov_avx512f_noflush(char *, const char *, size_t);
 void memmove_mov_avx_noflush(char *, const char *, size_t);
 }
@@ -32,6 +41,69 @@ static inline void fence() {
 }
 
 namespace pmem {
+
+/**
+ * The flush instruction and the copy kernels, chosen when the library is
+ * loaded by the features of the CPU it runs on rather than the one it is built
+ * on (see init_kernels). Until then, the ones every x86-64 CPU with AVX
+ * supports are used.
+ *
+ * On a platform with eADR, whose persistence domain includes the CPU caches, a
+ * store is persistent once it is globally visible, so cache lines are never
+ * flushed (Flush::NONE), and the copies that are not too large use temporal
+ * stores. Since the stores are still ordered (x86-TSO), fences are only needed
+ * after non-temporal stores, e.g., before a tx entry is committed.
+ */
+struct Kernels {
+  enum class Flush : uint8_t { CLFLUSH, CLFLUSHOPT, CLWB, NONE };
+
+  // the threshold PMDK uses by default
+  static constexpr size_t DEFAULT_NT_THRESHOLD = 256;
+
+  using Memmove = void (*)(char *, const char *, size_t);
+
+  Flush flush{Flush::CLFLUSH};
+  bool use_avx512f{false};
+  // copy to persistent memory with non-temporal stores
+  Memmove memmove_nt{memmove_movnt_avx_clflush_wcbarrier};
+  // copy to persistent memory with temporal stores and flush (if needed)
+  Memmove memmove_t{memmove_mov_avx_clflush};
+  // copies of at least this many bytes use memmove_nt; smaller ones are faster
+  // with temporal stores, which also leave the data in the cache for reads
+  // that follow (see tune_nt_threshold)
+  std::atomic<size_t> nt_threshold{DEFAULT_NT_THRESHOLD};
+  // whether to tune nt_threshold when the first file is opened for writing;
+  // read without a lock by the threads opening files
+  std::atomic<bool> need_tune{false};
+  // copy to DRAM, for small and large copies
+  Memmove memmove_small{memmove_mov_avx_noflush};
+  Memmove memmove_large{memmove_mov_avx_noflush};
+
+  friend std::ostream &operator<<(std::ostream &out, const Kernels &k);
+};
+
+extern Kernels kernels;
+
+/**
+ * Detect the CPU features with CPUID and choose the kernels. The choice can be
+ * narrowed with MADFS_FLUSH (clflush, clflushopt, or clwb) and
+ * MADFS_NO_AVX512F, and the threshold of non-temporal copies is set by
+ * MADFS_NT_THRESHOLD, or tuned if MADFS_NT_AUTOTUNE is set.
+ *
+ * eADR is detected by the persistence domain of the NVDIMM regions, or set by
+ * MADFS_EADR (1 or 0) for platforms that do not report it.
+ */
+void init_kernels();
+
+/**
+ * Set the threshold of non-temporal copies to the smallest size from which
+ * memmove_nt beats memmove_t at every size measured
+ *
+ * @param pmem the persistent memory to copy to, which is overwritten
+ * @param size the size of pmem; the sizes measured are up to a quarter of it
+ */
+void tune_nt_threshold(char *pmem, size_t size);
+
 /**
  * persist the cache line that contains p from any level of the cache
  * hierarchy using the appropriate instruction
@@ -39,18 +111,28 @@ namespace pmem {
  * Note that the this instruction might be reordered
  */
 static inline void persist_cl_unfenced(void *p) {
-  if constexpr (BuildOptions::support_clwb)
-    return _mm_clwb(p);
-  else if constexpr (BuildOptions::support_clflushopt)
-    return _mm_clflushopt(p);
-  else
-    return _mm_clflush(p);
+  // clwb and clflushopt are encoded as in PMDK, so that they do not need to be
+  // enabled at build time
+  switch (kernels.flush) {
+    case Kernels::Flush::CLWB:
+      asm volatile(".byte 0x66; xsaveopt %0" : "+m"(*(volatile char *)p));
+      break;
+    case Kernels::Flush::CLFLUSHOPT:
+      asm volatile(".byte 0x66; clflush %0" : "+m"(*(volatile char *)p));
+      break;
+    case Kernels::Flush::CLFLUSH:
+      _mm_clflush(p);
+      break;
+    case Kernels::Flush::NONE:
+      break;
+  }
 }
 
 /**
  * persist the cache line that contains p without reordering
  */
 static inline void persist_cl_fenced(void *p) {
+  if (kernels.flush == Kernels::Flush::NONE) return;
   persist_cl_unfenced(p);
   fence();
 }
@@ -59,6 +141,7 @@ static inline void persist_cl_fenced(void *p) {
  * persist the range [buf, buf + len) with possibly reordering
  */
 static inline void persist_unfenced(void *buf, uint64_t len) {
+  if (kernels.flush == Kernels::Flush::NONE) return;
   // adjust for cacheline alignment
   len += (uint64_t)buf & (CACHELINE_SIZE - 1);
   for (uint64_t i = 0; i < len; i += CACHELINE_SIZE)
@@ -69,41 +152,26 @@ static inline void persist_unfenced(void *buf, uint64_t len) {
  * persist the range [buf, buf + len) without reordering
  */
 static inline void persist_fenced(void *buf, uint64_t len) {
+  if (kernels.flush == Kernels::Flush::NONE) return;
   persist_unfenced(buf, len);
   fence();
 }
 
 static inline void memcpy_persist(char *dst, const char *src, size_t size) {
-  if constexpr (BuildOptions::support_avx512f) {
-    if constexpr (BuildOptions::support_clwb)
-      memmove_movnt_avx512f_clwb(dst, src, size);
-    else if constexpr (BuildOptions::support_clflushopt)
-      memmove_movnt_avx512f_clflushopt(dst, src, size);
-    else
-      memmove_movnt_avx512f_clflush(dst, src, size);
-  } else {
-    if constexpr (BuildOptions::support_clwb)
-      memmove_movnt_avx_clwb_wcbarrier(dst, src, size);
-    else if constexpr (BuildOptions::support_clflushopt)
-      memmove_movnt_avx_clflushopt_wcbarrier(dst, src, size);
-    else
-      memmove_movnt_avx_clflush_wcbarrier(dst, src, size);
-    VALGRIND_PMC_DO_FLUSH(dst, size);
-  }
+  if (size >= kernels.nt_threshold.load(std::memory_order_relaxed))
+    kernels.memmove_nt(dst, src, size);
+  else
+    kernels.memmove_t(dst, src, size);
+  VALGRIND_PMC_DO_FLUSH(dst, size);
 }
 }  // namespace pmem
 
 namespace dram {
 static inline void memcpy(char *dst, const char *src, size_t size) {
-  if constexpr (BuildOptions::support_avx512f) {
-    if (size <= 2048) {
-      memmove_mov_avx_noflush(dst, src, size);
-    } else {
-      memmove_mov_avx512f_noflush(dst, src, size);
-    }
-  } else {
-    memmove_mov_avx_noflush(dst, src, size);
-  }
+  if (size <= 2048)
+    pmem::kernels.memmove_small(dst, src, size);
+  else
+    pmem::kernels.memmove_large(dst, src, size);
 }
 }  // namespace dram
 
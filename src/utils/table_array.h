@@ -0,0 +1,71 @@
+#pragma once
+
+#include <tbb/concurrent_vector.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "utils/tbb.h"
+#include "utils/utils.h"
+
+namespace madfs {
+
+/**
+ * An array whose elements never move as it grows, so that readers can access
+ * the elements below size() without a lock while a single writer grows it.
+ *
+ * It lives in the heap unless attached to a fixed-size region of shared memory
+ * (see attach), in which case the size is kept in the shared memory as well.
+ * Either way, new elements are zero-initialized.
+ */
+template <typename T>
+class TableArray : noncopyable {
+  tbb::concurrent_vector<T, zero_allocator<T>> heap;
+  T* shm_data{nullptr};
+  uint32_t shm_capacity{0};
+  std::atomic<uint32_t>* size_ptr;
+
+ public:
+  explicit TableArray(std::atomic<uint32_t>* size_ptr) : size_ptr(size_ptr) {}
+
+  /**
+   * Use the region of shared memory instead; the array must be empty
+   */
+  void attach(T* data, uint32_t capacity, std::atomic<uint32_t>* size) {
+    shm_data = data;
+    shm_capacity = capacity;
+    size_ptr = size;
+  }
+
+  [[nodiscard]] uint32_t size() const {
+    return size_ptr->load(std::memory_order_acquire);
+  }
+
+  T& operator[](uint32_t i) { return shm_data ? shm_data[i] : heap[i]; }
+  const T& operator[](uint32_t i) const {
+    return shm_data ? shm_data[i] : heap[i];
+  }
+
+  /**
+   * @return the number of elements the array can grow to
+   */
+  [[nodiscard]] uint32_t capacity() const {
+    return shm_data ? shm_capacity : UINT32_MAX;
+  }
+
+  /**
+   * Grow the array to at least n elements, which must be within capacity();
+   * must be called by the writer
+   */
+  void grow_to(uint32_t n) {
+    if (n <= size()) return;
+    if (shm_data)
+      PANIC_IF(n > shm_capacity, "shared table of %u elements is full",
+               shm_capacity);
+    else
+      heap.grow_to_at_least(n);
+    size_ptr->store(n, std::memory_order_release);
+  }
+};
+
+}  // namespace madfs
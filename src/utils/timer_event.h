@@ -8,13 +8,20 @@ enum class Event : std::size_t {
   WRITE,
   PREAD,
   PWRITE,
+  READV,
+  WRITEV,
+  PREADV,
+  PWRITEV,
   OPEN,
   OPEN_SYS,
   MMAP,
   CLOSE,
   FSYNC,
+  RING_OP,
 
   UPDATE,
+  CHECKPOINT,
+  CHECKPOINT_LOAD,
 
   READ_TX,
   READ_TX_CTOR,
@@ -43,8 +50,23 @@ enum class Event : std::size_t {
   MULTI_BLOCK_TX_COPY,
   MULTI_BLOCK_TX_COMMIT,
 
+  DELTA_TX,
+  DELTA_TX_START,
+  DELTA_TX_COMMIT,
+
+  APPEND_TX,
+  APPEND_TX_START,
+  APPEND_TX_COMMIT,
+
   TX_ENTRY_LOAD,
   TX_ENTRY_STORE,
+  // a commit that failed due to a conflict, and a copy-on-write tx copying its
+  // source blocks again after one
+  TX_ABORT,
+  TX_REDO,
+  // see RangeLockTable
+  RANGE_LOCK,
+  RANGE_LOCK_WAIT,
 
   GC_CREATE,
 };
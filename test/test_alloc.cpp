@@ -0,0 +1,238 @@
+#include <fcntl.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "alloc/block.h"
+#include "common.h"
+#include "lib/lib.h"
+
+const char* filepath = get_filepath();
+
+using madfs::BITMAP_ENTRY_BLOCKS_CAPACITY;
+using madfs::BLOCK_SIZE;
+using madfs::LogicalBlockIdx;
+using madfs::dram::BitmapMgr;
+using madfs::dram::BlockAllocator;
+using madfs::dram::File;
+
+// a shard past the blocks that a new file uses
+constexpr uint32_t SHARD_BEGIN = BitmapMgr::SHARD_NUM_BLOCKS * 2;
+constexpr uint32_t SHARD_END = SHARD_BEGIN + BitmapMgr::SHARD_NUM_BLOCKS;
+// the first block of the last entry of the shard
+constexpr uint32_t LAST_ENTRY_BEGIN = SHARD_END - BITMAP_ENTRY_BLOCKS_CAPACITY;
+
+/**
+ * Open a new file, which has its bitmap set up, for the allocators to take the
+ * blocks of
+ */
+int open_new_file() {
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  char buf[BLOCK_SIZE]{};
+  ssize_t ret = pwrite(fd, buf, BLOCK_SIZE, 0);
+  ASSERT(ret == BLOCK_SIZE);
+  return fd;
+}
+
+bool is_all_allocated(File* file, LogicalBlockIdx lidx, uint32_t num_blocks) {
+  for (uint32_t i = 0; i < num_blocks; ++i)
+    if (!file->bitmap_mgr.is_allocated(lidx + i)) return false;
+  return true;
+}
+
+bool is_all_free(File* file, LogicalBlockIdx lidx, uint32_t num_blocks) {
+  for (uint32_t i = 0; i < num_blocks; ++i)
+    if (file->bitmap_mgr.is_allocated(lidx + i)) return false;
+  return true;
+}
+
+/**
+ * Test that the blocks freed next to each other are merged into a run that
+ * serves a larger allocation, no matter the order they are freed in.
+ */
+void coalesce_test() {
+  int fd = open_new_file();
+  auto file = madfs::get_file(fd);
+  {
+    BlockAllocator allocator(&file->mem_table, &file->bitmap_mgr, 0);
+    LogicalBlockIdx lidx = allocator.alloc(48);
+    allocator.free(lidx, 16);
+    allocator.free(lidx + 32, 16);
+    // fills the gap between the two runs, which makes all three one run
+    allocator.free(lidx + 16, 16);
+    ASSERT(allocator.alloc(48) == lidx);
+    ASSERT(is_all_allocated(file.get(), lidx, 48));
+    allocator.free(lidx, 48);
+  }
+  close(fd);
+}
+
+/**
+ * Test that a run spans more than one bitmap entry, up to a grow unit, and
+ * that the runs handed out do not overlap.
+ */
+void long_run_test() {
+  constexpr uint32_t num_blocks = BITMAP_ENTRY_BLOCKS_CAPACITY * 3 + 8;
+
+  int fd = open_new_file();
+  auto file = madfs::get_file(fd);
+  {
+    BlockAllocator allocator(&file->mem_table, &file->bitmap_mgr, 0);
+    LogicalBlockIdx first = allocator.alloc(num_blocks);
+    LogicalBlockIdx second = allocator.alloc(num_blocks);
+    ASSERT(first + num_blocks <= second || second + num_blocks <= first);
+    ASSERT(is_all_allocated(file.get(), first, num_blocks));
+    ASSERT(is_all_allocated(file.get(), second, num_blocks));
+
+    LogicalBlockIdx unit = allocator.alloc(BlockAllocator::MAX_RUN_BLOCKS);
+    ASSERT((unit & (BlockAllocator::MAX_RUN_BLOCKS - 1)) == 0);
+    ASSERT(is_all_allocated(file.get(), unit, BlockAllocator::MAX_RUN_BLOCKS));
+
+    // the freed runs are merged again into one that serves the same size
+    allocator.free(first, num_blocks);
+    ASSERT(allocator.alloc(num_blocks) == first);
+  }
+  close(fd);
+}
+
+/**
+ * Test that the free list is returned to the bitmap only once, including the
+ * bitmap entries that are free as a whole.
+ */
+void return_test() {
+  constexpr uint32_t num_blocks = BITMAP_ENTRY_BLOCKS_CAPACITY * 2;
+
+  int fd = open_new_file();
+  auto file = madfs::get_file(fd);
+  LogicalBlockIdx lidx;
+  {
+    BlockAllocator allocator(&file->mem_table, &file->bitmap_mgr, 0);
+    lidx = allocator.alloc(num_blocks);
+    allocator.free(lidx, num_blocks);
+    allocator.return_free_list();
+    // the range holds at least one whole bitmap entry
+    ASSERT(is_all_free(file.get(), lidx, num_blocks));
+
+    // the blocks are taken by someone else; the destructor must not return
+    // them again
+    for (uint32_t i = 0; i < num_blocks; ++i)
+      file->bitmap_mgr.set_allocated(lidx + i);
+  }
+  ASSERT(is_all_allocated(file.get(), lidx, num_blocks));
+  close(fd);
+}
+
+/**
+ * Test that a search skips the entries that the summary marks as fully used,
+ * and finds them again once blocks of them are freed.
+ */
+void summary_test() {
+  int fd = open_new_file();
+  auto file = madfs::get_file(fd);
+  BitmapMgr& bitmap_mgr = file->bitmap_mgr;
+
+  ASSERT(bitmap_mgr.alloc_shard(SHARD_BEGIN, 1) == SHARD_BEGIN);
+  ASSERT(!bitmap_mgr.may_have_free(SHARD_BEGIN, SHARD_END));
+  auto [idx, bits] = bitmap_mgr.try_alloc(SHARD_BEGIN);
+  ASSERT(idx >= SHARD_END);
+  bitmap_mgr.free(idx, BITMAP_ENTRY_BLOCKS_CAPACITY);
+
+  // free a block in the middle of the shard
+  const uint32_t freed = SHARD_BEGIN + BitmapMgr::SHARD_NUM_BLOCKS / 2 + 1;
+  bitmap_mgr.free(freed, 1);
+  ASSERT(bitmap_mgr.may_have_free(SHARD_BEGIN, SHARD_END));
+  std::tie(idx, bits) = bitmap_mgr.try_alloc(SHARD_BEGIN);
+  ASSERT(idx == ALIGN_DOWN(freed, BITMAP_ENTRY_BLOCKS_CAPACITY));
+  ASSERT(bits == ~(1ul << (freed - idx)));
+  ASSERT(!bitmap_mgr.may_have_free(SHARD_BEGIN, SHARD_END));
+  close(fd);
+}
+
+/**
+ * Test that a shard that cannot be taken as a whole is given back, including
+ * its summary, even if a concurrent search marks the entries taken meanwhile
+ * as fully used.
+ */
+void shard_rollback_test() {
+  constexpr int num_iter = 1000000;
+
+  int fd = open_new_file();
+  auto file = madfs::get_file(fd);
+  BitmapMgr& bitmap_mgr = file->bitmap_mgr;
+
+  // a block in use in the last entry makes the shard fail to be taken
+  bitmap_mgr.set_allocated(LAST_ENTRY_BEGIN);
+  ASSERT(!bitmap_mgr.alloc_shard(SHARD_BEGIN, 1));
+  ASSERT(is_all_free(file.get(), SHARD_BEGIN, LAST_ENTRY_BEGIN - SHARD_BEGIN));
+
+  std::thread shard_thread([&] {
+    for (int i = 0; i < num_iter; ++i)
+      ASSERT(!bitmap_mgr.alloc_shard(SHARD_BEGIN, 1));
+  });
+  std::thread search_thread([&] {
+    for (int i = 0; i < num_iter; ++i) {
+      // skips the entries held by the other thread
+      auto [idx, bits] = bitmap_mgr.try_alloc(SHARD_BEGIN);
+      if (idx == LAST_ENTRY_BEGIN)
+        bitmap_mgr.free(idx + 1, BITMAP_ENTRY_BLOCKS_CAPACITY - 1);
+      else
+        bitmap_mgr.free(idx, BITMAP_ENTRY_BLOCKS_CAPACITY);
+    }
+  });
+  shard_thread.join();
+  search_thread.join();
+
+  for (uint32_t idx = SHARD_BEGIN; idx < SHARD_END;
+       idx += BITMAP_ENTRY_BLOCKS_CAPACITY)
+    ASSERT(bitmap_mgr.may_have_free(idx, idx + BITMAP_ENTRY_BLOCKS_CAPACITY));
+  ASSERT(is_all_free(file.get(), SHARD_BEGIN, LAST_ENTRY_BEGIN - SHARD_BEGIN));
+  close(fd);
+}
+
+/**
+ * Test that many threads overwriting a small file do not grow it, although
+ * each starts from a shard of its own.
+ */
+void file_size_test() {
+  constexpr int num_threads = 16;
+  constexpr int num_iter = 100;
+
+  int fd = open_new_file();
+  auto file = madfs::get_file(fd);
+
+  std::atomic<int> num_started = 0;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&, i] {
+      char buf[BLOCK_SIZE]{};
+      ssize_t ret = pwrite(fd, buf, BLOCK_SIZE, i * BLOCK_SIZE);
+      ASSERT(ret == BLOCK_SIZE);
+      // keep all the threads, and thus their allocators, alive at once
+      ++num_started;
+      while (num_started < num_threads) std::this_thread::yield();
+      for (int j = 0; j < num_iter; ++j) {
+        ret = pwrite(fd, buf, BLOCK_SIZE, i * BLOCK_SIZE);
+        ASSERT(ret == BLOCK_SIZE);
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  // the threads take a bitmap entry or two each, which fits in a few shards
+  ASSERT(file->meta->get_num_logical_blocks() <=
+         4 * BitmapMgr::SHARD_NUM_BLOCKS);
+  close(fd);
+}
+
+int main() {
+  coalesce_test();
+  long_run_test();
+  return_test();
+  summary_test();
+  shard_rollback_test();
+  file_size_test();
+  unlink(filepath);
+  return 0;
+}
@@ -6,6 +6,7 @@
 #include <string>
 
 #include "common.h"
+#include "madfs.h"
 
 using madfs::debug::print_file;
 
@@ -215,6 +216,36 @@ void test_print() {
   ASSERT(rc == 0);
 }
 
+void test_direct() {
+  fprintf(stderr, "test_direct\n");
+
+  unlink(filepath);
+  madfs_file* file = madfs_open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(file != nullptr);
+
+  sz = madfs_pwrite(file, test_str.data(), test_str.length(), 0);
+  ASSERT(sz == test_str.length());
+  rc = madfs_fsync(file);
+  ASSERT(rc == 0);
+
+  // the handle and its fd see the same file
+  int fd = madfs_fileno(file);
+  sz = pread(fd, buff, test_str.length(), 0);
+  ASSERT(sz == test_str.length());
+  ASSERT(test_str.compare(0, test_str.length(), buff) == 0);
+
+  sz = pwrite(fd, "abc", 3, 10);
+  ASSERT(sz == 3);
+  sz = madfs_pread(file, buff, 3, 10);
+  ASSERT(sz == 3);
+  ASSERT(memcmp(buff, "abc", 3) == 0);
+
+  rc = madfs_close(file);
+  ASSERT(rc == 0);
+
+  ASSERT(madfs_open("/nonexistent/file", O_RDONLY, 0) == nullptr);
+}
+
 int main() {
   unsetenv("LD_PRELOAD");
   test_str = random_string(STR_LEN);
@@ -228,5 +259,6 @@ int main() {
   test_stream();
   test_unlink();
   test_print();
+  test_direct();
   return 0;
 }
@@ -65,6 +65,48 @@ void basic_test(BasicTestOpt opt) {
   }
 }
 
+/**
+ * Test that the content of a file overwritten by small writes (which are
+ * logged as deltas) survives garbage collection.
+ */
+void delta_test() {
+  constexpr int num_blocks = 8;
+  constexpr int file_size = num_blocks * BLOCK_SIZE;
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+
+  auto expected = std::make_unique<char[]>(file_size);
+  memset(expected.get(), 0, file_size);
+  ssize_t ret = pwrite(fd, expected.get(), file_size, 0);
+  ASSERT(ret == file_size);
+
+  for (int i = 0; i < NUM_INLINE_TX_ENTRY + NUM_TX_ENTRY_PER_BLOCK * 2; ++i) {
+    int count = rand() % 128 + 1;
+    int offset = rand() % (file_size - count + 1);
+    std::string str = random_string(count);
+    memcpy(expected.get() + offset, str.data(), count);
+    ret = pwrite(fd, str.data(), count, offset);
+    ASSERT(ret == count);
+  }
+  fsync(fd);
+  close(fd);
+
+  {
+    GarbageCollector garbage_collector(filepath);
+    ASSERT(garbage_collector.do_gc());
+  }
+
+  {
+    fd = open(filepath, O_RDONLY);
+    auto actual = std::make_unique<char[]>(file_size);
+    ret = pread(fd, actual.get(), file_size, 0);
+    ASSERT(ret == file_size);
+    CHECK_RESULT(expected.get(), actual.get(), file_size, fd);
+    close(fd);
+  }
+}
+
 /**
  * Test the basic functionality of garbage collection.
  *
@@ -158,5 +200,6 @@ int main() {
     basic_test({.num_bytes_per_iter = BLOCK_SIZE * 65});
   }
 
+  delta_test();
   sync_test();
 }
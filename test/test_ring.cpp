@@ -0,0 +1,106 @@
+#include <fcntl.h>
+
+#include <cerrno>
+#include <iostream>
+#include <memory>
+
+#include "common.h"
+#include "madfs.h"
+
+using madfs::BLOCK_SIZE;
+
+constexpr unsigned QUEUE_DEPTH = 16;
+constexpr int NUM_BLOCKS = 256;
+
+const char* filepath = get_filepath();
+
+/**
+ * Wait for a completion and check its result
+ *
+ * @return the user_data of the completion
+ */
+uint64_t reap(madfs_ring* ring, ssize_t expected_res) {
+  madfs_cqe* cqe;
+  int rc = madfs_ring_wait_cqe(ring, &cqe);
+  ASSERT(rc == 0);
+  ASSERT(cqe->res == expected_res);
+  uint64_t user_data = cqe->user_data;
+  madfs_ring_cqe_seen(ring, cqe);
+  return user_data;
+}
+
+int main() {
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+
+  constexpr size_t file_size = NUM_BLOCKS * BLOCK_SIZE;
+  auto expected = std::make_unique<char[]>(file_size);
+  auto actual = std::make_unique<char[]>(file_size);
+  fill_buff(expected.get(), file_size);
+
+  madfs_ring* ring;
+  int rc = madfs_ring_setup(QUEUE_DEPTH, &ring);
+  ASSERT(rc == 0);
+
+  // write the file one block per SQE, keeping the queue full
+  {
+    int num_submitted = 0;
+    int num_completed = 0;
+    while (num_completed < NUM_BLOCKS) {
+      madfs_sqe* sqe;
+      while (num_submitted < NUM_BLOCKS &&
+             (sqe = madfs_ring_get_sqe(ring)) != nullptr) {
+        size_t offset = static_cast<size_t>(num_submitted) * BLOCK_SIZE;
+        madfs_prep_pwrite(sqe, fd, expected.get() + offset, BLOCK_SIZE,
+                          static_cast<off_t>(offset), num_submitted);
+        num_submitted++;
+      }
+      madfs_ring_submit(ring);
+      uint64_t user_data = reap(ring, BLOCK_SIZE);
+      ASSERT(user_data < NUM_BLOCKS);
+      num_completed++;
+    }
+  }
+
+  // the queue depth is bounded
+  for (unsigned i = 0; i < QUEUE_DEPTH; ++i) {
+    madfs_sqe* sqe = madfs_ring_get_sqe(ring);
+    ASSERT(sqe != nullptr);
+    madfs_prep_fsync(sqe, fd, i);
+  }
+  ASSERT(madfs_ring_get_sqe(ring) == nullptr);
+  rc = madfs_ring_submit(ring);
+  ASSERT(rc == QUEUE_DEPTH);
+  for (unsigned i = 0; i < QUEUE_DEPTH; ++i) reap(ring, 0);
+
+  // nothing in flight
+  madfs_cqe* cqe;
+  ASSERT(madfs_ring_peek_cqe(ring, &cqe) == -EAGAIN);
+  ASSERT(madfs_ring_wait_cqe(ring, &cqe) == -EAGAIN);
+
+  // read it back in a batch of unaligned ranges
+  {
+    constexpr size_t num_bytes = file_size / QUEUE_DEPTH;
+    for (unsigned i = 0; i < QUEUE_DEPTH; ++i) {
+      madfs_sqe* sqe = madfs_ring_get_sqe(ring);
+      madfs_prep_pread(sqe, fd, actual.get() + i * num_bytes, num_bytes,
+                       static_cast<off_t>(i * num_bytes), i);
+    }
+    madfs_ring_submit(ring);
+    for (unsigned i = 0; i < QUEUE_DEPTH; ++i) reap(ring, num_bytes);
+    CHECK_RESULT(expected.get(), actual.get(), file_size, fd);
+  }
+
+  // errors are reported as -errno
+  {
+    madfs_sqe* sqe = madfs_ring_get_sqe(ring);
+    madfs_prep_pread(sqe, -1, actual.get(), 1, 0, 0);
+    madfs_ring_submit(ring);
+    reap(ring, -EBADF);
+  }
+
+  madfs_ring_exit(ring);
+  close(fd);
+  return 0;
+}
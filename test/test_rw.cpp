@@ -1,8 +1,13 @@
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "common.h"
+#include "lib/lib.h"
 
 using madfs::BLOCK_SIZE;
 using madfs::NUM_INLINE_TX_ENTRY;
@@ -82,7 +87,326 @@ void test(TestOpt test_opt) {
   close(fd);
 }
 
+/**
+ * Write many small deltas into a few blocks, so that they are folded over and
+ * over, and check that the memory of the folded deltas is reused.
+ */
+void test_delta_reuse(int num_blocks, int num_iter) {
+  fprintf(stderr,
+          "\n\n\n====== delta reuse: "
+          "num_blocks = %d, "
+          "num_iter = %d "
+          "======\n",
+          num_blocks, num_iter);
+
+  const int file_size = num_blocks * static_cast<int>(BLOCK_SIZE);
+  auto expected = std::make_unique<char[]>(file_size);
+  auto actual = std::make_unique<char[]>(file_size);
+  fill_buff(expected.get(), file_size);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ssize_t ret = pwrite(fd, expected.get(), file_size, 0);
+  ASSERT(ret == file_size);
+
+  size_t max_memory = 0;
+  for (int i = 0; i < num_iter; ++i) {
+    int count = rand() % 512 + 1;
+    int offset = rand() % (file_size - count + 1);
+    std::string str = random_string(count);
+    memcpy(expected.get() + offset, str.data(), count);
+    ret = pwrite(fd, str.data(), count, offset);
+    ASSERT(ret == count);
+    max_memory = std::max(max_memory,
+                          madfs::get_file(fd)->blk_table.get_delta_memory());
+  }
+  // a few blocks never hold more than a chunk of deltas at a time
+  ASSERT(max_memory <= madfs::dram::DeltaTable::CHUNK_SIZE);
+
+  ret = pread(fd, actual.get(), file_size, 0);
+  ASSERT(ret == file_size);
+  CHECK_RESULT(expected.get(), actual.get(), file_size, fd);
+  close(fd);
+}
+
+/**
+ * Overwrite a file with small writes at random offsets and compare with a copy
+ * in DRAM, both before and after reopening the file
+ */
+void test_overwrite(int num_blocks, int max_bytes_per_iter, int num_iter) {
+  fprintf(stderr,
+          "\n\n\n====== overwrite: "
+          "num_blocks = %d, "
+          "max_bytes_per_iter = %d, "
+          "num_iter = %d "
+          "======\n",
+          num_blocks, max_bytes_per_iter, num_iter);
+
+  const int file_size = num_blocks * static_cast<int>(BLOCK_SIZE);
+  auto expected = std::make_unique<char[]>(file_size);
+  auto actual = std::make_unique<char[]>(file_size);
+  fill_buff(expected.get(), file_size);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ssize_t ret = pwrite(fd, expected.get(), file_size, 0);
+  ASSERT(ret == file_size);
+
+  for (int i = 0; i < num_iter; ++i) {
+    int count = rand() % max_bytes_per_iter + 1;
+    int offset = rand() % (file_size - count + 1);
+    std::string str = random_string(count);
+    memcpy(expected.get() + offset, str.data(), count);
+    ret = pwrite(fd, str.data(), count, offset);
+    ASSERT(ret == count);
+
+    // read a range around the write back
+    int begin = std::max(offset - 100, 0);
+    int length = std::min(offset + count + 100, file_size) - begin;
+    const char* expected_range = expected.get() + begin;
+    ret = pread(fd, actual.get(), length, begin);
+    ASSERT(ret == length);
+    CHECK_RESULT(expected_range, actual.get(), length, fd);
+  }
+  ret = pread(fd, actual.get(), file_size, 0);
+  ASSERT(ret == file_size);
+  CHECK_RESULT(expected.get(), actual.get(), file_size, fd);
+  close(fd);
+
+  // reopen the file so that the log is replayed
+  fd = open(filepath, O_RDONLY);
+  ret = pread(fd, actual.get(), file_size, 0);
+  ASSERT(ret == file_size);
+  CHECK_RESULT(expected.get(), actual.get(), file_size, fd);
+  close(fd);
+}
+
+/**
+ * Append with random sizes to a file opened with O_APPEND, so that most appends
+ * are written into the last block in place, with occasional small overwrites
+ * of the last block in between
+ */
+void test_append(int max_bytes_per_iter, int num_iter) {
+  fprintf(stderr,
+          "\n\n\n====== append: "
+          "max_bytes_per_iter = %d, "
+          "num_iter = %d "
+          "======\n",
+          max_bytes_per_iter, num_iter);
+
+  std::string expected;
+  auto actual = std::make_unique<char[]>(max_bytes_per_iter * num_iter);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
+  ssize_t ret;
+  for (int i = 0; i < num_iter; ++i) {
+    int count = rand() % max_bytes_per_iter + 1;
+    std::string str = random_string(count);
+    int offset = static_cast<int>(expected.size());
+    expected += str;
+    ret = write(fd, str.data(), count);
+    ASSERT(ret == count);
+
+    if (i % 10 == 9) {
+      int overwrite_offset = offset + rand() % count;
+      std::string overwrite = random_string(1);
+      expected[overwrite_offset] = overwrite[0];
+      ret = pwrite(fd, overwrite.data(), 1, overwrite_offset);
+      ASSERT(ret == 1);
+    }
+
+    const char* expected_range = expected.data() + offset;
+    ret = pread(fd, actual.get(), count, offset);
+    ASSERT(ret == count);
+    CHECK_RESULT(expected_range, actual.get(), count, fd);
+  }
+  close(fd);
+
+  // reopen the file so that the log is replayed
+  int length = static_cast<int>(expected.size());
+  const char* expected_all = expected.data();
+  fd = open(filepath, O_RDONLY);
+  ret = pread(fd, actual.get(), length, 0);
+  ASSERT(ret == length);
+  CHECK_RESULT(expected_all, actual.get(), length, fd);
+  struct stat stat_buf;
+  fstat(fd, &stat_buf);
+  ASSERT(stat_buf.st_size == length);
+  close(fd);
+}
+
+/**
+ * Write and read back a file with iovec arrays of random segment sizes, mixed
+ * with writev/readv at the file offset, and compare with a copy in DRAM
+ */
+void test_vectored(int max_bytes_per_segment, int num_iter) {
+  fprintf(stderr,
+          "\n\n\n====== vectored: "
+          "max_bytes_per_segment = %d, "
+          "num_iter = %d "
+          "======\n",
+          max_bytes_per_segment, num_iter);
+
+  constexpr int max_num_segments = 8;
+  const int file_size = max_bytes_per_segment * max_num_segments * 4;
+  auto expected = std::make_unique<char[]>(file_size);
+  auto actual = std::make_unique<char[]>(file_size);
+  fill_buff(expected.get(), file_size);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ssize_t ret = pwrite(fd, expected.get(), file_size, 0);
+  ASSERT(ret == file_size);
+
+  std::vector<std::string> segments;
+  std::vector<struct iovec> iov;
+  for (int i = 0; i < num_iter; ++i) {
+    // zero-length segments are allowed and must be skipped, even at the end
+    int num_segments = rand() % max_num_segments + 1;
+    segments.clear();
+    iov.clear();
+    int count = 0;
+    for (int j = 0; j < num_segments; ++j) {
+      segments.push_back(random_string(rand() % (max_bytes_per_segment + 1)));
+      count += static_cast<int>(segments.back().size());
+    }
+    if (i % 3 == 0) {
+      segments.emplace_back();
+      ++num_segments;
+    }
+    for (auto& segment : segments)
+      iov.push_back({segment.data(), segment.size()});
+
+    int offset = rand() % (file_size - count + 1);
+    if (i % 2 == 0) {
+      ret = pwritev(fd, iov.data(), num_segments, offset);
+    } else {
+      lseek(fd, offset, SEEK_SET);
+      ret = writev(fd, iov.data(), num_segments);
+    }
+    ASSERT(ret == count);
+    for (auto& segment : segments) {
+      memcpy(expected.get() + offset, segment.data(), segment.size());
+      offset += static_cast<int>(segment.size());
+    }
+
+    // read the whole file back into a scattered buffer
+    int split = rand() % (file_size + 1);
+    struct iovec read_iov[2] = {{actual.get(), static_cast<size_t>(split)},
+                                {actual.get() + split,
+                                 static_cast<size_t>(file_size - split)}};
+    if (i % 2 == 0) {
+      ret = preadv(fd, read_iov, 2, 0);
+    } else {
+      lseek(fd, 0, SEEK_SET);
+      ret = readv(fd, read_iov, 2);
+    }
+    ASSERT(ret == file_size);
+    CHECK_RESULT(expected.get(), actual.get(), file_size, fd);
+  }
+  close(fd);
+
+  // reopen the file so that the log is replayed
+  fd = open(filepath, O_RDONLY);
+  ret = pread(fd, actual.get(), file_size, 0);
+  ASSERT(ret == file_size);
+  CHECK_RESULT(expected.get(), actual.get(), file_size, fd);
+  close(fd);
+}
+
+void test_fragmented(int num_blocks, int num_iter) {
+  fprintf(stderr,
+          "\n\n\n====== fragmented: "
+          "num_blocks = %d, "
+          "num_iter = %d "
+          "======\n",
+          num_blocks, num_iter);
+
+  const int file_size = num_blocks * static_cast<int>(BLOCK_SIZE);
+  auto expected = std::make_unique<char[]>(file_size);
+  auto actual = std::make_unique<char[]>(file_size);
+  fill_buff(expected.get(), file_size);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ssize_t ret = pwrite(fd, expected.get(), file_size, 0);
+  ASSERT(ret == file_size);
+
+  // aligned overwrites of random blocks in the first half only, so that some
+  // parts of the mapping are fragmented and the rest stays in long runs
+  for (int i = 0; i < num_iter; ++i) {
+    int num = rand() % 4 + 1;
+    int offset = rand() % (num_blocks / 2) * static_cast<int>(BLOCK_SIZE);
+    int count = num * static_cast<int>(BLOCK_SIZE);
+    std::string str = random_string(count);
+    memcpy(expected.get() + offset, str.data(), count);
+    ret = pwrite(fd, str.data(), count, offset);
+    ASSERT(ret == count);
+  }
+  ret = pread(fd, actual.get(), file_size, 0);
+  ASSERT(ret == file_size);
+  CHECK_RESULT(expected.get(), actual.get(), file_size, fd);
+  close(fd);
+
+  fd = open(filepath, O_RDONLY);
+  ret = pread(fd, actual.get(), file_size, 0);
+  ASSERT(ret == file_size);
+  CHECK_RESULT(expected.get(), actual.get(), file_size, fd);
+  close(fd);
+}
+
+void test_checkpoint(int num_blocks, int num_iter) {
+  fprintf(stderr,
+          "\n\n\n====== checkpoint: "
+          "num_blocks = %d, "
+          "num_iter = %d "
+          "======\n",
+          num_blocks, num_iter);
+
+  const int file_size = num_blocks * static_cast<int>(BLOCK_SIZE);
+  auto expected = std::make_unique<char[]>(file_size);
+  auto actual = std::make_unique<char[]>(file_size);
+  fill_buff(expected.get(), file_size);
+
+  auto overwrite = [&](int fd) {
+    for (int i = 0; i < num_iter; ++i) {
+      int count = rand() % 64 + 1;
+      int offset = rand() % (file_size - count + 1);
+      std::string str = random_string(count);
+      memcpy(expected.get() + offset, str.data(), count);
+      ssize_t rc = pwrite(fd, str.data(), count, offset);
+      ASSERT(rc == count);
+    }
+  };
+  auto check = [&](int flags) {
+    int fd = open(filepath, flags);
+    ssize_t rc = pread(fd, actual.get(), file_size, 0);
+    ASSERT(rc == file_size);
+    CHECK_RESULT(expected.get(), actual.get(), file_size, fd);
+    return fd;
+  };
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ssize_t ret = pwrite(fd, expected.get(), file_size, 0);
+  ASSERT(ret == file_size);
+  // the history after the checkpoint taken by fsync is replayed on open
+  overwrite(fd);
+  fsync(fd);
+  overwrite(fd);
+  close(fd);
+
+  close(check(O_RDONLY));
+  fd = check(O_RDWR);
+  overwrite(fd);
+  close(fd);
+  close(check(O_RDONLY));
+}
+
 int main() {
+  srand(0);  // NOLINT(cert-msc51-cpp)
+
   // everything block-aligned
   test({.num_bytes_per_iter = BLOCK_SIZE});
   test({.num_bytes_per_iter = BLOCK_SIZE * 8});
@@ -136,5 +460,27 @@ int main() {
   test({.num_bytes_per_iter = BLOCK_SIZE * 1024 * 4,
         .init_offset = BLOCK_SIZE * 3});
 
+  // small overwrites, including many to the same block
+  test_overwrite(1, 64, 100);
+  test_overwrite(4, 512, 1000);
+  test_delta_reuse(4, 20000);
+  test_overwrite(16, BLOCK_SIZE * 2, 1000);
+  // a tx history long enough to be replayed in parallel on reopen
+  test_overwrite(64, BLOCK_SIZE * 2, 40000);
+  // a mapping with both long runs and fragmented parts
+  test_fragmented(4096, 2000);
+  // a reopen starts from the checkpoint of the block table
+  test_checkpoint(64, 40000);
+
+  // appends written into the last block in place
+  test_append(64, 1000);
+  test_append(BLOCK_SIZE, 300);
+  test_append(BLOCK_SIZE * 100, 30);
+
+  // vectored writes and reads as single transactions
+  test_vectored(64, 300);
+  test_vectored(BLOCK_SIZE, 100);
+  test_vectored(BLOCK_SIZE * 3, 30);
+
   return 0;
 }
@@ -1,6 +1,10 @@
 #include <fcntl.h>
+#include <sys/wait.h>
 
+#include <atomic>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -52,6 +56,354 @@ int main() {
     CHECK_RESULT(expected, actual, NUM_BYTES, fd);
   }
 
+  // concurrent aligned overwrites, whose commits may be combined
+  {
+    constexpr int num_threads = 16;
+    constexpr int num_iter = 100;
+    constexpr int length = num_threads * madfs::BLOCK_SIZE;
+
+    threads.clear();
+    for (int i = 0; i < num_threads; ++i) {
+      threads.emplace_back([&, i]() {
+        char buf[madfs::BLOCK_SIZE];
+        for (int j = 0; j < num_iter; ++j) {
+          fill_buff(buf, madfs::BLOCK_SIZE, i + j);
+          ssize_t rc = pwrite(fd, buf, madfs::BLOCK_SIZE,
+                              i * static_cast<off_t>(madfs::BLOCK_SIZE));
+          ASSERT(rc == madfs::BLOCK_SIZE);
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+
+    auto actual = std::make_unique<char[]>(length);
+    auto expected = std::make_unique<char[]>(length);
+    for (int i = 0; i < num_threads; ++i)
+      fill_buff(expected.get() + i * madfs::BLOCK_SIZE, madfs::BLOCK_SIZE,
+                i + num_iter - 1);
+    ret = pread(fd, actual.get(), length, 0);
+    ASSERT(ret == length);
+    CHECK_RESULT(expected.get(), actual.get(), length, fd);
+  }
+
+  // concurrent unaligned writes to disjoint ranges within shared blocks, which
+  // copy the rest of the blocks; combining them must not lose any update
+  for (int range_size : {600, 5000}) {
+    constexpr int num_threads = 8;
+    constexpr int num_iter = 100;
+    const int length = num_threads * range_size;
+
+    threads.clear();
+    for (int i = 0; i < num_threads; ++i) {
+      threads.emplace_back([&, i]() {
+        std::vector<char> buf(range_size);
+        for (int j = 0; j < num_iter; ++j) {
+          fill_buff(buf.data(), range_size, i + j);
+          ssize_t rc = pwrite(fd, buf.data(), range_size, i * range_size);
+          ASSERT(rc == range_size);
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+
+    auto actual = std::make_unique<char[]>(length);
+    auto expected = std::make_unique<char[]>(length);
+    for (int i = 0; i < num_threads; ++i)
+      fill_buff(expected.get() + i * range_size, range_size,
+                i + num_iter - 1);
+    ret = pread(fd, actual.get(), length, 0);
+    ASSERT(ret == length);
+    CHECK_RESULT(expected.get(), actual.get(), length, fd);
+  }
+
+  // unaligned writes to overlapping ranges, while other threads keep
+  // committing to unrelated blocks; a tx must find the overlapping entries
+  // among the unrelated ones it skips (see ConflictIndex)
+  {
+    constexpr int num_overlapping = 4;
+    constexpr int num_unrelated = 4;
+    constexpr int num_iter = 200;
+    constexpr int overlap_length = 4 * madfs::BLOCK_SIZE;
+    constexpr off_t unrelated_offset = 64 * madfs::BLOCK_SIZE;
+    const std::string conflict_path = std::string(filepath) + ".conflict";
+
+    unlink(conflict_path.c_str());
+    int conflict_fd =
+        open(conflict_path.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    ASSERT(conflict_fd >= 0);
+    {
+      const size_t prefill_length =
+          unrelated_offset + num_unrelated * madfs::BLOCK_SIZE;
+      auto zeros = std::make_unique<char[]>(prefill_length);
+      ret = pwrite(conflict_fd, zeros.get(), prefill_length, 0);
+      ASSERT(ret == static_cast<ssize_t>(prefill_length));
+    }
+
+    // the contents only depend on the offset, so that the order of the
+    // overlapping writes does not matter, but an update lost by a tx that
+    // copied a block without seeing an overlapping one leaves zeros behind
+    std::vector<std::vector<bool>> written(
+        num_overlapping, std::vector<bool>(overlap_length));
+    threads.clear();
+    for (int i = 0; i < num_overlapping; ++i) {
+      threads.emplace_back([&, i]() {
+        unsigned int seed = i;
+        char buf[overlap_length];
+        for (int j = 0; j < num_iter; ++j) {
+          int offset = rand_r(&seed) % (overlap_length - 1);
+          int count = std::min(rand_r(&seed) % 3000 + 1,
+                               overlap_length - offset);
+          fill_buff(buf, count, offset);
+          ssize_t rc = pwrite(conflict_fd, buf, count, offset);
+          ASSERT(rc == count);
+          std::fill_n(written[i].begin() + offset, count, true);
+          std::this_thread::yield();
+        }
+      });
+    }
+    for (int i = 0; i < num_unrelated; ++i) {
+      threads.emplace_back([&, i]() {
+        char buf[madfs::BLOCK_SIZE];
+        for (int j = 0; j < num_iter; ++j) {
+          fill_buff(buf, madfs::BLOCK_SIZE, i + j);
+          ssize_t rc = pwrite(conflict_fd, buf, madfs::BLOCK_SIZE,
+                              unrelated_offset + i * madfs::BLOCK_SIZE);
+          ASSERT(rc == madfs::BLOCK_SIZE);
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+
+    auto actual = std::make_unique<char[]>(overlap_length);
+    auto expected = std::make_unique<char[]>(overlap_length);
+    fill_buff(expected.get(), overlap_length);
+    for (int k = 0; k < overlap_length; ++k) {
+      bool is_written = false;
+      for (const auto& w : written) is_written = is_written || w[k];
+      if (!is_written) expected[k] = 0;
+    }
+    ret = pread(conflict_fd, actual.get(), overlap_length, 0);
+    ASSERT(ret == overlap_length);
+    CHECK_RESULT(expected.get(), actual.get(), overlap_length, conflict_fd);
+
+    char unrelated_expected[madfs::BLOCK_SIZE];
+    char unrelated_actual[madfs::BLOCK_SIZE];
+    for (int i = 0; i < num_unrelated; ++i) {
+      fill_buff(unrelated_expected, madfs::BLOCK_SIZE, i + num_iter - 1);
+      ret = pread(conflict_fd, unrelated_actual, madfs::BLOCK_SIZE,
+                  unrelated_offset + i * madfs::BLOCK_SIZE);
+      ASSERT(ret == madfs::BLOCK_SIZE);
+      CHECK_RESULT(unrelated_expected, unrelated_actual, madfs::BLOCK_SIZE,
+                   conflict_fd);
+    }
+    close(conflict_fd);
+    unlink(conflict_path.c_str());
+  }
+
+  // short-lived threads, more than the per-thread data slots of a file; the
+  // allocator of each is handed back to the file when it exits
+  {
+    constexpr int num_waves = 4 * madfs::MAX_NUM_THREADS / 8;
+    constexpr int num_threads = 8;
+
+    char expected[madfs::BLOCK_SIZE];
+    for (int w = 0; w < num_waves; ++w) {
+      threads.clear();
+      for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&, i]() {
+          char buf[madfs::BLOCK_SIZE];
+          fill_buff(buf, madfs::BLOCK_SIZE, w + i);
+          ssize_t rc = pwrite(fd, buf, madfs::BLOCK_SIZE,
+                              i * static_cast<off_t>(madfs::BLOCK_SIZE));
+          ASSERT(rc == madfs::BLOCK_SIZE);
+        });
+      }
+      for (auto& thread : threads) thread.join();
+    }
+
+    char actual[madfs::BLOCK_SIZE];
+    fill_buff(expected, madfs::BLOCK_SIZE, num_waves - 1);
+    ret = pread(fd, actual, madfs::BLOCK_SIZE, 0);
+    ASSERT(ret == madfs::BLOCK_SIZE);
+    CHECK_RESULT(expected, actual, madfs::BLOCK_SIZE, fd);
+  }
+
+  // processes writing to their own blocks, both copy-on-write and deltas; with
+  // MADFS_SHARED_BLK_TABLE, they all use the block table of the parent
+  {
+    constexpr int num_procs = 4;
+    constexpr int num_iter = 100;
+    constexpr int delta_size = 8;
+
+    auto expected_block = [&](char* buf, int i, int num_done) {
+      fill_buff(buf, madfs::BLOCK_SIZE, i * num_iter + num_done - 1);
+      fill_buff(buf + (num_done - 1) * delta_size, delta_size, i);
+    };
+
+    std::vector<pid_t> pids;
+    for (int i = 0; i < num_procs; ++i) {
+      pid_t pid = fork();
+      ASSERT(pid >= 0);
+      if (pid > 0) {
+        pids.push_back(pid);
+        continue;
+      }
+      int child_fd = open(filepath, O_RDWR);
+      ASSERT(child_fd >= 0);
+      off_t offset = i * static_cast<off_t>(madfs::BLOCK_SIZE);
+      char buf[madfs::BLOCK_SIZE], expected[madfs::BLOCK_SIZE];
+      for (int j = 0; j < num_iter; ++j) {
+        fill_buff(buf, madfs::BLOCK_SIZE, i * num_iter + j);
+        ssize_t rc = pwrite(child_fd, buf, madfs::BLOCK_SIZE, offset);
+        ASSERT(rc == madfs::BLOCK_SIZE);
+        fill_buff(buf, delta_size, i);
+        rc = pwrite(child_fd, buf, delta_size, offset + j * delta_size);
+        ASSERT(rc == delta_size);
+        expected_block(expected, i, j + 1);
+        rc = pread(child_fd, buf, madfs::BLOCK_SIZE, offset);
+        ASSERT(rc == madfs::BLOCK_SIZE);
+        CHECK_RESULT(expected, buf, madfs::BLOCK_SIZE, child_fd);
+      }
+      close(child_fd);
+      // skip the destructors of what is inherited from the parent
+      _exit(0);
+    }
+
+    for (pid_t pid : pids) {
+      int status;
+      ASSERT(waitpid(pid, &status, 0) == pid);
+      ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    char expected[madfs::BLOCK_SIZE], actual[madfs::BLOCK_SIZE];
+    for (int i = 0; i < num_procs; ++i) {
+      expected_block(expected, i, num_iter);
+      ret = pread(fd, actual, madfs::BLOCK_SIZE,
+                  i * static_cast<off_t>(madfs::BLOCK_SIZE));
+      ASSERT(ret == madfs::BLOCK_SIZE);
+      CHECK_RESULT(expected, actual, madfs::BLOCK_SIZE, fd);
+    }
+  }
+
+  // close while other threads still read through the fd; the fd must be
+  // released by close itself, and not later once the file is no longer in use,
+  // by when the number may have been reused
+  {
+    constexpr int num_threads = 4;
+    const std::string close_path = std::string(filepath) + ".close";
+
+    unlink(close_path.c_str());
+    int close_fd =
+        open(close_path.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    ASSERT(close_fd >= 0);
+    char expected[madfs::BLOCK_SIZE];
+    fill_buff(expected, madfs::BLOCK_SIZE);
+    ret = pwrite(close_fd, expected, madfs::BLOCK_SIZE, 0);
+    ASSERT(ret == madfs::BLOCK_SIZE);
+
+    std::atomic<bool> is_done{false};
+    threads.clear();
+    for (int i = 0; i < num_threads; ++i) {
+      threads.emplace_back([&]() {
+        char actual[madfs::BLOCK_SIZE];
+        while (!is_done.load()) {
+          // either the file, /dev/null, or nothing once closed
+          ssize_t rc = pread(close_fd, actual, madfs::BLOCK_SIZE, 0);
+          ASSERT(rc == madfs::BLOCK_SIZE || rc == 0 || rc == -1);
+          if (rc == madfs::BLOCK_SIZE)
+            CHECK_RESULT(expected, actual, madfs::BLOCK_SIZE, close_fd);
+        }
+      });
+    }
+    std::this_thread::yield();
+
+    ret = close(close_fd);
+    ASSERT(ret == 0);
+    // reuse the number of the fd closed
+    int null_fd = open("/dev/null", O_RDONLY);
+    ASSERT(null_fd >= 0);
+    if (null_fd != close_fd) {
+      ASSERT(dup2(null_fd, close_fd) == close_fd);
+      close(null_fd);
+    }
+    is_done = true;
+    for (auto& thread : threads) thread.join();
+
+    // the file is released by now, which must not have closed the fd reused
+    ASSERT(fcntl(close_fd, F_GETFD) != -1);
+    char buf[1];
+    ASSERT(read(close_fd, buf, 1) == 0);
+    close(close_fd);
+    unlink(close_path.c_str());
+  }
+
+  // appends written into the last block in place, while another process
+  // replaces the blocks appended with copy-on-write; a replaced block must not
+  // be reused while an append still writes into it
+  {
+    constexpr int num_appends = 2000;
+    constexpr int max_append_size = 300;
+    constexpr int overwrite_size = 600;
+    const std::string append_path = std::string(filepath) + ".append";
+
+    unlink(append_path.c_str());
+    int append_fd = open(append_path.c_str(), O_CREAT | O_RDWR | O_APPEND,
+                         S_IRUSR | S_IWUSR);
+    ASSERT(append_fd >= 0);
+    std::vector<int> counts(num_appends);
+    int length = 0;
+    for (auto& count : counts) {
+      count = rand() % max_append_size + 1;
+      length += count;
+    }
+
+    pid_t pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) {
+      int child_fd = open(append_path.c_str(), O_RDWR);
+      ASSERT(child_fd >= 0);
+      // the contents only depend on the offset, so that the overwrites do not
+      // change what is expected
+      char buf[overwrite_size];
+      for (struct stat stat_buf{}; stat_buf.st_size < length;) {
+        fstat(child_fd, &stat_buf);
+        if (stat_buf.st_size >= overwrite_size) {
+          int offset = rand() % static_cast<int>(stat_buf.st_size -
+                                                 overwrite_size + 1);
+          fill_buff(buf, overwrite_size, offset);
+          ssize_t rc = pwrite(child_fd, buf, overwrite_size, offset);
+          ASSERT(rc == overwrite_size);
+        }
+        std::this_thread::yield();
+      }
+      close(child_fd);
+      _exit(0);
+    }
+
+    char buf[max_append_size];
+    int offset = 0;
+    for (int count : counts) {
+      fill_buff(buf, count, offset);
+      ssize_t rc = write(append_fd, buf, count);
+      ASSERT(rc == count);
+      offset += count;
+      // let the other process run even if there are few cores
+      std::this_thread::yield();
+    }
+    int status;
+    ASSERT(waitpid(pid, &status, 0) == pid);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    auto actual = std::make_unique<char[]>(length);
+    auto expected = std::make_unique<char[]>(length);
+    fill_buff(expected.get(), length);
+    ret = pread(append_fd, actual.get(), length, 0);
+    ASSERT(ret == length);
+    CHECK_RESULT(expected.get(), actual.get(), length, append_fd);
+    close(append_fd);
+    unlink(append_path.c_str());
+  }
+
   fsync(fd);
   close(fd);
 }